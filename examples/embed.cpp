@@ -0,0 +1,79 @@
+/*
+    Minimal host that embeds the compiler and virtual machine. It compiles
+    examples/embed.tin with a host native, runs main and calls Tin functions
+    by name. The exit code is 1 if a result isn't the expected one.
+
+    Build with the compiler sources except src/main.cpp, 'make embed' does
+    that with g++. Run from the root of the repository.
+*/
+#include "Compiler.h"
+
+struct Vec {
+    int x, y;
+};
+
+// host_scale(v: int): int, user_data points to the factor
+static void host_scale(u8* args, u8* ret, void* user_data) {
+    int v = *(int*)args;
+    *(int*)ret = v * *(int*)user_data;
+}
+
+static int failures = 0;
+static void expect(bool yes, const char* what) {
+    if(!yes) {
+        log_color(RED);
+        printf("FAIL %s\n", what);
+        log_color(NO_COLOR);
+        failures++;
+    } else {
+        printf("ok   %s\n", what);
+    }
+}
+
+int main(int argc, const char** argv) {
+    int factor = 10;
+    CompilerOptions options{};
+    options.initial_file = "examples/embed.tin";
+    options.silent = true;
+    // main doesn't call the functions the host calls
+    options.remove_unreachable_functions = false;
+    options.add_native("host_scale(v: int): int", host_scale, &factor);
+
+    Bytecode* bytecode = nullptr;
+    if(!CompileFile(&options, &bytecode)) {
+        printf("Could not compile %s\n", options.initial_file.c_str());
+        if(bytecode)
+            DELNEW(bytecode, Bytecode, HERE);
+        return 1;
+    }
+
+    VirtualMachine* vm = new VirtualMachine();
+    vm->bytecode = bytecode;
+    vm->init();
+    vm->execute(); // main initializes the globals
+
+    int result = 0;
+    expect(vm->call(vm->find_function("add"), &result, sizeof(result), 3, 4) && result == 7, "add(3, 4) == 7");
+
+    Vec v{3, 4};
+    expect(vm->call(vm->find_function("length_sq"), &result, sizeof(result), v) && result == 25, "length_sq({3, 4}) == 25");
+
+    expect(vm->call(vm->find_function("scaled"), &result, sizeof(result), 5) && result == 51, "scaled(5) == 51 through host_scale");
+    factor = 2;
+    expect(vm->call(vm->find_function("scaled"), &result, sizeof(result), 5) && result == 11, "host_scale reads user_data on every call");
+
+    expect(vm->call(vm->find_function("count"), &result, sizeof(result)) && result == 101, "count() == 101 after main set calls");
+    expect(vm->call(vm->find_function("count"), &result, sizeof(result)) && result == 102, "globals are kept between calls");
+
+    // the VM reports these errors and the calls return false
+    expect(!vm->call(vm->find_function("add"), &result, sizeof(result), 3), "add with one argument fails");
+    expect(!vm->call(vm->find_function("add"), &result, sizeof(result), 3, 4.0), "add with a double for an int fails");
+    char small = 0;
+    expect(!vm->call(vm->find_function("add"), &small, sizeof(small), 3, 4), "add with a return value of the wrong size fails");
+    expect(!vm->find_function("missing"), "find_function of a missing function is null");
+    expect(!vm->call(vm->find_function("missing"), &result, sizeof(result)), "calling a missing function fails");
+
+    delete vm;
+    DELNEW(bytecode, Bytecode, HERE);
+    return failures == 0 ? 0 : 1;
+}
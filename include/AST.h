@@ -136,6 +136,7 @@ struct ASTExpression : public ASTNode {
     int literal_integer;
     float literal_float;
     std::string name; // used with IDENTIFIER, FUNCTION_CALL, SIZEOF, MEMBER, CAST
+    TypeId typeId; // name resolved when checking, used with SIZEOF, CAST
     std::vector<ASTExpression*> arguments; // used with FUNCTION_CALL
     ASTExpression* left = nullptr;
     ASTExpression* right = nullptr;
@@ -166,6 +167,7 @@ struct ASTStatement : public ASTNode {
 
     std::string declaration_type; // used by VAR_DECLARATION
     std::string declaration_name; // used by VAR_DECLARATION
+    TypeId declaration_typeId; // declaration_type resolved when checking
     
     ASTExpression* expression = nullptr; // used by RETURN, EXPRESSION, IF, WHILE, VAR_DECLARATION
     ASTBody* body = nullptr; // used by IF, WHILE
@@ -211,6 +213,7 @@ struct ASTFunction : public ASTNode {
     ASTBody* body = nullptr;
     
     bool is_native = false;
+    bool reachable = true; // cleared by RemoveDeadCode if main can't call it, it isn't generated then
 };
 struct ASTStructure : public ASTNode {
     std::string name;
@@ -226,8 +229,23 @@ struct ASTStructure : public ASTNode {
         SourceLocation location;
     };
     std::vector<Member> members;
+    
+    // Primitive and pointer members of the struct and its nested structs
+    // in memory order, computed when the struct is complete.
+    struct Leaf {
+        int offset;
+        int size;
+    };
+    std::vector<Leaf> leaves;
+    std::unordered_map<std::string, int> member_index; // index into members, filled when complete
 
     Member* findMember(const std::string& name) {
+        if(complete) {
+            auto pair = member_index.find(name);
+            if(pair == member_index.end())
+                return nullptr;
+            return &members[pair->second];
+        }
         for(int i=0;i<members.size();i++) {
             auto& mem = members[i];
             if(mem.name == name) {
@@ -355,6 +373,10 @@ struct AST {
     void destroyStructure(ASTStructure* n);
 
     ASTFunction* findFunction(const std::string& name, ScopeId scopeId);
+    // Declares a native function registered by the host from a signature
+    // like "dot(a: float*, b: float*, n: int): float". Returns null if the
+    // signature can't be parsed, types are checked with the other functions.
+    ASTFunction* addHostNative(const std::string& signature, int host_index);
 
     void print(ASTExpression* expr, int depth = 0);
     void print(ASTBody* body, int depth = 0);
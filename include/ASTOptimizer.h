@@ -0,0 +1,12 @@
+#pragma once
+
+#include "AST.h"
+
+// Replaces constant expressions in the function body with literals.
+// Types must be resolved (CheckFunction) before folding.
+void FoldConstants(AST* ast, ASTFunction* function);
+
+// Removes statements that can't run and, if remove_functions is set, marks
+// functions main can't reach as unreachable so they aren't generated.
+// Every import must be checked and no function generated yet.
+void RemoveDeadCode(AST* ast, bool remove_functions);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "Bytecode.h"
+
+/*
+    Ahead of time backend. Lowers the bytecode pieces to x86-64 assembly
+    (GNU assembler, intel syntax, System V calling convention).
+
+    The VM stack and base pointer are the host rsp and rbp. Calls use the
+    same frame layout as the interpreter, the return address takes the
+    place of pc and piece index. Native functions are implemented by the
+    C runtime in runtime/tin_runtime.c:
+        gcc program.s runtime/tin_runtime.c -o program
+*/
+
+// Returns false if the file couldn't be written or the bytecode has unresolved calls
+bool GenerateAssembly(Bytecode* bytecode, const std::string& path);
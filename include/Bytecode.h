@@ -2,6 +2,8 @@
 
 #include "Util.h"
 
+#include <atomic>
+
 struct ASTFunction;
 
 enum Opcode : u8 {
@@ -34,6 +36,7 @@ enum Opcode : u8 {
 
     INST_RET, // return
     INST_MEMZERO,
+    INST_MEMCPY, // memcpy op0, op1, size in op2, the ranges may overlap
     
     // instructions with immediates
     INST_IMMEDIATES,
@@ -41,12 +44,22 @@ enum Opcode : u8 {
     INST_JMP, // jump
     INST_JZ, // conditional jump (if zero)
     INST_CALL, // function call
+    INST_TAILCALL, // jump to the start of a function, it reuses the frame of the current one
     
     INST_MOV_MR_DISP, // memory+disp <- reg
     INST_MOV_RM_DISP, // reg <- memory+disp
     
     INST_DATAPTR,
+    INST_MEMCPY_IMM, // memcpy op0, op1, size in the immediate
+    
+    // superinstructions, the optimizer fuses common sequences into these
+    INST_PUSH_LI,      // li r, imm; push r
+    INST_PUSH_RM_DISP, // mov_rm_disp r, base, size, imm; push r
+    INST_STACK_OP,     // mov_rr x, y; pop y; <imm opcode> y, x
+    INST_CMP_JZ,       // <compare> a, b; jz a, imm (comparison is stored in op2, see encode_cmp_jz)
     // don't add non-immediate instructions here (inst.opcode >= INST_IMMEDIATES)
+    
+    INST_OPCODE_COUNT, // not an instruction
 };
 enum ControlFlags : u8 {
     CONTROL_NONE = 0,
@@ -89,10 +102,25 @@ struct Instruction {
         Register operands[3];
     };
 };
+// INST_INCR stores a signed 16-bit immediate in op1 (low byte) and op2 (high byte)
+inline int decode_incr(Instruction inst) {
+    return (i16)((u16)(u8)inst.op1 | ((u16)(u8)inst.op2 << 8));
+}
+// INST_CMP_JZ keeps the control flags in the low bits of op2 and the comparison above them
+inline Register encode_cmp_jz(Opcode compare, u8 control) {
+    return (Register)(control | ((compare - INST_EQUAL) << 5));
+}
+inline Opcode decode_cmp_jz(Instruction inst) {
+    return (Opcode)(INST_EQUAL + ((u8)inst.op2 >> 5));
+}
+inline ControlFlags decode_cmp_jz_control(Instruction inst) {
+    return (ControlFlags)((u8)inst.op2 & 0x1F);
+}
 struct Bytecode;
 struct BytecodePiece {
     int piece_index=0;
     std::string name;
+    ASTFunction* function = nullptr; // the function the piece was generated from
     std::vector<Instruction> instructions;
     
     #ifndef DISABLE_DEBUG_LINES
@@ -112,7 +140,7 @@ struct BytecodePiece {
     struct Relocation {
         // std::string func_name;
         ASTFunction* function = nullptr;
-        int index_of_immediate; // immediate of INST_CALL instruction
+        int index_of_immediate; // immediate of INST_CALL or INST_TAILCALL instruction
     };
     std::vector<Relocation> relocations;
     void addRelocation(ASTFunction* func, int imm_index);
@@ -150,10 +178,13 @@ struct BytecodePiece {
     void emit_jz(Register reg, int* out_index_of_imm);
     
     void emit_call(int* out_index_of_imm);
+    void emit_tailcall(int* out_index_of_imm);
     void emit_ret();
     void emit_dataptr(Register reg, int offset);
     
     void emit_memzero(Register reg, Register reg_size);
+    void emit_memcpy(Register to_reg, Register from_reg, Register reg_size);
+    void emit_memcpy(Register to_reg, Register from_reg, int size);
 
     int get_pc() { return instructions.size(); }
     void fix_jump_here(int imm_index);
@@ -164,6 +195,7 @@ struct BytecodePiece {
     void print(Bytecode* bytecode, bool with_debug_info = true, int low_index = 0, int high_index = -1);
     
 private:
+    friend struct BytecodeOptimizer;
     std::vector<int> index_of_non_immediates;
     
     void emit(Instruction inst) {
@@ -190,17 +222,43 @@ private:
     }
 };
 
+// Native function registered by the host, see CompilerOptions::add_native.
+// Arguments start at args with the parameter offsets (minus the 16 bytes of
+// the frame) and the return value is written to ret, the same layout the
+// built in natives use.
+typedef void (*HostFunction)(u8* args, u8* ret, void* user_data);
+struct HostNative {
+    std::string signature; // "dot(a: float*, b: float*, n: int): float"
+    HostFunction function = nullptr;
+    void* user_data = nullptr;
+    std::string name; // parsed from the signature when compiling
+};
+
+// Global data appended by one thread. A segment reserves its range of the
+// global data when it's created so offsets are final right away, finalize
+// copies the segments into one buffer.
+struct DataSegment {
+    int offset = 0; // where the segment starts in the global data
+    int size = 0;   // bytes used
+    int max = 0;    // bytes reserved
+    u8* data = nullptr;
+    DataSegment* next = nullptr;
+};
+// String literal in the global data, entries are only added so threads can
+// walk a bucket without a lock.
+struct StringEntry {
+    std::string str;
+    u32 hash = 0;
+    int offset = 0;
+    StringEntry* next = nullptr;
+};
+
 struct Bytecode {
     ~Bytecode() {
         cleanup();
     }
     void cleanup() {
-        if(global_data) {
-            DELNEW_ARRAY(global_data, u8, global_data_max, HERE);
-        }
-        global_data = nullptr;
-        global_data_max = 0;
-        global_data_size = 0;
+        freeData();
         for(auto t : pieces) {
             DELNEW(t, BytecodePiece, HERE);
         }
@@ -221,6 +279,10 @@ struct Bytecode {
         return ptr;
     }
     BytecodePiece* getPiece(int index) {
+        if(finalized.load(std::memory_order_acquire)) {
+            // pieces don't change anymore, no need to lock
+            return index < pieces.size() ? pieces[index] : nullptr;
+        }
         MUTEX_LOCK(general_lock);
         if(pieces.size() <= index) {
             MUTEX_UNLOCK(general_lock);
@@ -232,19 +294,33 @@ struct Bytecode {
     }
     
     void apply_relocations();
+    // Applies relocations once and freezes pieces and global data. After this
+    // the bytecode is only read so several virtual machines on different
+    // threads can execute it, each with a copy of the global data.
+    void finalize();
+    bool is_finalized() { return finalized.load(std::memory_order_acquire); }
+    // Finds the piece of a function by name through a hash index built in finalize.
+    // Returns null if there is no such function or if it's native.
+    BytecodePiece* findPiece(const std::string& name);
     
     void print();
     
-    // MUTEX_DECL(data_lock);
+    // protects pieces, global data and strings don't use it
     MUTEX_DECL(general_lock);
     
-    // returns offset of sub data into the global data
+    // returns offset of sub data into the global data, threads append
+    // to segments of their own so this doesn't lock
     int appendData(int size, void* data = nullptr);
-    // Used by interpreter
+    // Used by interpreter, finalizes the bytecode if it isn't
     u8* copyGlobalData(int* size);
     
+    // returns offset of the null terminated string, equal strings share data
     int appendString(const std::string& str);
-    std::unordered_map<std::string, int> string_map{};
+    
+    // natives registered by the host, called through their function pointers
+    std::vector<HostNative> host_natives;
+    // name of the native a negative CALL immediate refers to
+    const char* nameOfNative(int imm);
     
     // unsafe because direct access without mutex
     std::vector<BytecodePiece*>& pieces_unsafe() {
@@ -255,11 +331,29 @@ struct Bytecode {
     AST* ast=nullptr;
     
 private:
+    static const int DATA_SEGMENT_SIZE = 0x1000;
+    static const int STRING_BUCKETS = 0x1000;
+    static int newDataId();
+    void mergeData();
+    void freeData();
+
+    // merged by finalize
     u8* global_data = nullptr;
     int global_data_size = 0;
     int global_data_max = 0;
+    // stored with release after piece_map and global data are built, threads
+    // that load it with acquire and see true can read them without the lock
+    std::atomic<bool> finalized{false};
+
+    // identifies the bytecode to the segment a thread appends to (see appendData),
+    // a new id is picked in cleanup so old segments aren't reused
+    int data_id = newDataId();
+    volatile i32 reserved_data = 0; // size of the ranges segments reserved
+    DataSegment* volatile data_segments = nullptr;
+    StringEntry* volatile string_buckets[STRING_BUCKETS]{};
     
     std::vector<BytecodePiece*> pieces;
+    std::unordered_map<std::string, BytecodePiece*> piece_map; // name -> piece, built in finalize
 };
 
 enum NativeCalls {
@@ -274,7 +368,21 @@ enum NativeCalls {
     NATIVE_sqrt,
     NATIVE_read_file,
     NATIVE_write_file,
+    NATIVE_flush,
+    NATIVE_file_open,
+    NATIVE_file_close,
+    NATIVE_file_read,
+    NATIVE_file_write,
+    NATIVE_map_file,
+    NATIVE_unmap_file,
     NATIVE_MAX,
 };
+// CALL immediates below the built in natives refer to natives registered by the host
+inline int host_native_imm(int index) {
+    return -NATIVE_MAX - 1 - index;
+}
+inline int host_native_index(int imm) {
+    return -NATIVE_MAX - 1 - imm;
+}
 #define NAME_OF_NATIVE(X) native_names[X]
 extern const char* native_names[];
\ No newline at end of file
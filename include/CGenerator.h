@@ -0,0 +1,22 @@
+#pragma once
+
+#include "AST.h"
+
+/*
+    Ahead of time backend that writes C source from the checked AST.
+
+    Structures keep the member offsets computed by the generator (packed
+    with explicit padding), functions become static C functions and
+    globals become variables initialized before main runs, in the same
+    order as the bytecode does it. Native functions are called through
+    the C runtime, the same one the assembly backend uses:
+        gcc -O2 -fwrapv program.c runtime/tin_runtime.c -lm -o program
+
+    Integers are computed like the registers of the virtual machine (64-bit,
+    loads zero extend, chars compare as signed bytes), see
+    CContext::registerValue. Unlike the bytecode, float operations are
+    always done in floating point.
+*/
+
+// Returns false if the file couldn't be written or the program has no main function
+bool GenerateC(AST* ast, const std::string& path);
@@ -5,6 +5,11 @@
 #include "Lexer.h"
 #include "Generator.h"
 #include "VirtualMachine.h"
+#include "Optimizer.h"
+#include "ASTOptimizer.h"
+#include "IR.h"
+#include "AsmGenerator.h"
+#include "CGenerator.h"
 
 enum TaskType {
     TASK_LEX_FILE,
@@ -26,6 +31,28 @@ struct CompilerOptions {
     int processed_lines = 0;
 
     bool silent = false; // won't silence errors
+
+    u32 optimization_passes = OPT_ALL; // OptimizationPass flags
+    bool fold_constants = true; // fold constant expressions in the AST before generating bytecode
+    bool remove_dead_code = true; // skip statements that can't run, see RemoveDeadCode
+    bool use_ir = false; // generate through the SSA IR, functions it doesn't cover use the stack generator
+    u32 ir_passes = IR_PASS_ALL; // IRPass flags
+    bool remove_unreachable_functions = true; // don't generate functions main can't reach, turn off if the host calls them with VirtualMachine::call
+    bool print_optimization_stats = false;
+
+    bool jit = false; // compile hot functions to machine code when running
+    bool unchecked = false; // don't validate memory accesses when running
+    int stack_size = 0x10000; // bytes of stack for the virtual machine
+    int vm_count = 1; // virtual machines executing the program in parallel
+    std::string asm_output; // write x86-64 assembly to this path if not empty
+    std::string c_output; // write C source to this path if not empty
+    std::string profile_output; // profile the program when running and write collapsed stacks to this path
+    bool vm_stats = false; // print opcode and native call counts when running
+
+    std::vector<HostNative> natives; // native functions callable from Tin, see HostNative
+    void add_native(const std::string& signature, HostFunction function, void* user_data = nullptr) {
+        natives.push_back({signature, function, user_data});
+    }
 };
 struct Compiler {
     ~Compiler() {
@@ -35,6 +62,8 @@ struct Compiler {
     AST* ast = nullptr;
     Reporter* reporter = nullptr;
     Bytecode* bytecode = nullptr;
+    CompilerOptions* options = nullptr;
+    OptimizationStats optimization_stats{};
     
     std::vector<TokenStream*> streams;
     std::unordered_map<std::string, TokenStream*> stream_map;
@@ -49,6 +78,9 @@ struct Compiler {
     
     volatile int threads_processing = 0;
     volatile int total_threads = 0;
+    // Functions are generated when every import is checked
+    int checks_processing = 0;
+    bool dead_code_removed = false;
     MUTEX_DECL(tasks_lock)
 
     bool is_signaled = false;
@@ -58,4 +90,7 @@ struct Compiler {
     void processTasks();
 };
 
-bool CompileFile(CompilerOptions* options, Bytecode** out_bytecode = nullptr);
\ No newline at end of file
+bool CompileFile(CompilerOptions* options, Bytecode** out_bytecode = nullptr);
+// Finalizes the bytecode and executes main on options->vm_count virtual machines,
+// one thread each, set up with the jit, memory, stack, profile and stats options.
+void RunBytecode(Bytecode* bytecode, CompilerOptions* options);
\ No newline at end of file
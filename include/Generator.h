@@ -16,6 +16,8 @@ struct GeneratorContext {
     
     int current_frameOffset = 0; // used for allocating local variables
     ScopeId current_scopeId;
+    bool takes_address = false; // the function uses &, tail calls would reuse a frame that may be pointed to
+    int tail_call_end_pc = -1; // code ending here returned with a tail call
 
     // We need to store continue and break offsets to the bytecode.
     // That is what loop scopes are. Each while statement creates a loop
@@ -41,6 +43,17 @@ struct GeneratorContext {
     TypeId generateExpression(ASTExpression* expr);
     TypeId generateReference(ASTExpression* expr);
     bool generateBody(ASTBody* body);
+    // Reserves the parameters of fun on the stack and evaluates the arguments into them
+    bool generateArguments(ASTExpression* expr, ASTFunction* fun);
+
+    // Returns the function if 'return expr' can reuse the frame of the current function
+    ASTFunction* findTailCallee(ASTExpression* expr);
+    bool generateTailCall(ASTExpression* expr, ASTFunction* fun);
+
+    // Resolves the types in declarations, casts and sizeof so that
+    // generation reads TypeIds instead of converting strings.
+    void resolveTypes(ASTBody* body);
+    void resolveTypes(ASTExpression* expr, ScopeId scopeId);
     
     // only casts if necessary
     bool performCast(TypeId ltype, TypeId rtype);
@@ -55,4 +68,5 @@ struct GeneratorContext {
 bool CheckStructs(AST* ast, AST::Import* imp, Reporter* reporter, bool* changed, bool ignore_errors);
 bool CheckFunction(AST* ast, AST::Import* imp, ASTFunction* function, Reporter* reporter);
 bool CheckGlobals(AST* ast, AST::Import* imp, Bytecode* bytecode, Reporter* reporter);
-void GenerateFunction(AST* ast, ASTFunction* function, Bytecode* bytecode, Reporter* reporter);
\ No newline at end of file
+// use_ir generates the function through the SSA IR (see IR.h) with ir_passes (IRPass flags)
+void GenerateFunction(AST* ast, ASTFunction* function, Bytecode* bytecode, Reporter* reporter, bool use_ir = false, u32 ir_passes = 0);
\ No newline at end of file
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "AST.h"
+#include "Bytecode.h"
+
+struct GeneratorContext;
+
+/*
+    SSA form of a function between the AST and the bytecode (-ir).
+
+    BuildIR turns the body of a function into basic blocks where every value
+    is defined once. Local variables and parameters become values and a phi
+    at the start of a block picks the value of the predecessor control came
+    from. Globals and memory behind pointers are still loaded and stored.
+
+    A value is the 64-bit register the generator would have pushed, the
+    lowered code computes exactly what the stack code computes. Variables
+    keep the bytes of their type (IR_TRUNC) like a store and load would,
+    loads zero extend and float operations only write the low 32 bits.
+
+    Functions the IR doesn't cover (locals and parameters of struct types,
+    taking addresses, globals declared in the body, anything with an error)
+    make BuildIR return null and GeneratorContext generates them as before,
+    which also reports the errors.
+
+    LowerIR allocates registers with linear scan. Values live across calls
+    are kept in frame slots, constants and data pointers are emitted where
+    they are used.
+*/
+
+enum IROp : u8 {
+    IR_CONST,    // imm, sign extended from 32 bits like li
+    IR_PARAM,    // parameter at bp + imm, size bytes zero extended
+    IR_DATAPTR,  // address of global data at imm
+    IR_LOAD,     // memory at args[0] + imm, size bytes zero extended
+    IR_STORE,    // args[1] to memory at args[0] + imm, size bytes
+    IR_BINARY,   // opcode (INST_ADD to INST_GREATER_EQUAL) with control flags, args[0] is op0 and args[1] op1
+    IR_NOT,
+    IR_CAST,     // imm is the CastType
+    IR_TRUNC,    // low size bytes of args[0], what a variable holds after assignment
+    IR_PHI,      // args[i] is the value when coming from block->preds[i]
+    IR_CALL,     // callee with args, the value is the return value if there is one
+
+    // terminators, the last instruction of every block
+    IR_JUMP,     // to succs[0]
+    IR_BRANCH,   // to succs[0] if args[0] isn't zero, otherwise succs[1]
+    IR_RETURN,   // args[0] is written to the return slot with size bytes if there is a value
+    IR_TAILCALL, // callee with args reusing the frame, see GeneratorContext::findTailCallee
+
+    IR_OP_COUNT,
+};
+extern const char* ir_op_names[];
+
+struct IRBlock;
+struct IRInst {
+    int id = 0;
+    IROp op = IR_CONST;
+    TypeId type; // Tin type of the value, void if the instruction has no value
+    Opcode opcode = INST_NOP; // IR_BINARY
+    u8 control = 0; // IR_BINARY
+    u8 size = 0;
+    i64 imm = 0;
+    ASTFunction* callee = nullptr; // IR_CALL and IR_TAILCALL
+    std::vector<IRInst*> args;
+
+    IRBlock* block = nullptr;
+    ASTStatement* stmt = nullptr; // for debug lines
+    IRInst* replaced_by = nullptr; // set when a value is replaced by another one, uses are updated by IRFunction::resolve
+    bool removed = false;
+
+    bool is_terminator() const { return op >= IR_JUMP; }
+};
+
+struct IRBlock {
+    int id = 0;
+    std::vector<IRInst*> insts; // phis first and the terminator last
+    std::vector<IRBlock*> preds;
+    std::vector<IRBlock*> succs;
+
+    // computed by IRFunction::analyze
+    IRBlock* idom = nullptr;
+    int rpo = -1; // index in reverse postorder, -1 if unreachable
+    int loop_depth = 0;
+
+    IRInst* terminator() { return insts.size() && insts.back()->is_terminator() ? insts.back() : nullptr; }
+};
+
+struct IRFunction {
+    ~IRFunction();
+
+    ASTFunction* function = nullptr;
+    std::vector<IRBlock*> blocks; // blocks[0] is the entry
+    std::vector<IRInst*> insts; // every instruction that was created, removed ones too
+    std::vector<IRBlock*> order; // reachable blocks in reverse postorder, computed by analyze
+    std::vector<IRBlock*> dropped_blocks; // unreachable blocks removed by resolve
+    int next_block_id = 0;
+
+    IRInst* create(IROp op, TypeId type = TYPE_VOID);
+    IRBlock* createBlock();
+    void addEdge(IRBlock* from, IRBlock* to);
+
+    // Updates arguments of replaced values, drops removed instructions and unreachable blocks
+    void resolve();
+    // Computes order, dominators and loop depths
+    void analyze();
+    bool dominates(IRBlock* a, IRBlock* b);
+
+    void print();
+};
+
+enum IRPass : u32 {
+    IR_PASS_DCE       = 0x1,  // remove values nothing uses
+    IR_PASS_GVN       = 0x2,  // reuse values computed the same way in a dominating block
+    IR_PASS_LICM      = 0x4,  // compute loop invariant values and loads before the loop
+    IR_PASS_STRENGTH  = 0x8,  // cheaper operations for the same result (x * 1, x + 0...)
+    IR_PASS_INDUCTION = 0x10, // indexed addresses in loops become pointer increments
+
+    IR_PASS_COUNT     = 5,
+    IR_PASS_NONE      = 0,
+    IR_PASS_ALL       = (1 << IR_PASS_COUNT) - 1,
+};
+
+// Returns null if the function uses something the IR doesn't cover.
+// context is set up like for generateBody, the piece isn't touched.
+IRFunction* BuildIR(GeneratorContext* context);
+void OptimizeIR(IRFunction* ir, u32 passes);
+// Emits the function into context->piece after what is already there (the return slot and main's globals)
+void LowerIR(IRFunction* ir, GeneratorContext* context);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "Bytecode.h"
+
+/*
+    Translates hot bytecode pieces to x86-64 machine code.
+
+    The virtual machine counts calls and backward jumps per piece and
+    compiles a piece once the count reaches JIT_THRESHOLD. VM registers
+    live in host registers while machine code runs. Calls to other pieces,
+    returns and instructions the compiler doesn't handle exit back to the
+    interpreter which continues at the pc register.
+
+    Machine code does not validate memory accesses like the interpreter does.
+*/
+
+struct VirtualMachine;
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define JIT_SUPPORTED
+#endif
+
+static const int JIT_THRESHOLD = 100; // calls and backward jumps before a piece is compiled
+
+enum JitExit : int {
+    JIT_EXIT_INTERPRET = 0, // continue interpreting at the pc register
+    JIT_EXIT_STACK_OVERFLOW,
+};
+
+struct JitCode {
+    u8* memory = nullptr;
+    int memory_size = 0;
+    // machine code for each bytecode instruction, null for immediates
+    std::vector<void*> entry_points;
+
+    // starts executing at pc, the registers are read and written back on exit
+    JitExit run(i64* registers, int pc);
+};
+
+// State per piece in the virtual machine
+struct JitPiece {
+    int counter = 0;
+    bool failed = false; // piece couldn't be compiled, don't try again
+    JitCode* code = nullptr;
+};
+
+// Returns null if the piece can't be compiled or the host isn't x86-64.
+// The code refers to the stack and global data of the virtual machine
+// so it can't be shared between virtual machines.
+JitCode* JitCompile(VirtualMachine* vm, BytecodePiece* piece);
+void JitFree(JitCode* code);
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "Bytecode.h"
+
+/*
+    Passes that run on finished bytecode pieces.
+    The generator emits naive stack code, these passes
+    clean it up before the piece is handed to the interpreter.
+*/
+
+enum OptimizationPass : u32 {
+    OPT_JUMP_THREADING  = 0x1,  // jmp to jmp becomes one jump
+    OPT_PUSH_POP        = 0x2,  // push/pop pairs separated by unrelated instructions
+    OPT_COPY_PROPAGATION = 0x4, // reads of a register copied with mov_rr use the source instead
+    OPT_CONSTANT_FOLD   = 0x8,  // operations on registers with known values become li
+    OPT_DEAD_STORE      = 0x10, // remove writes to registers that are never read
+    OPT_MERGE_INCR      = 0x20, // incr sp, x followed by incr sp, y becomes incr sp, x+y
+    OPT_SUPERINSTRUCTIONS = 0x40, // fuse common sequences into one instruction, runs last
+    OPT_INLINE          = 0x80, // calls to small functions without calls become their body, see InlineCalls
+
+    OPT_PASS_COUNT      = 8,
+    OPT_NONE            = 0,
+    OPT_ALL             = (1 << OPT_PASS_COUNT) - 1,
+};
+extern const char* optimization_pass_names[];
+// returns 0 if the name doesn't match a pass
+OptimizationPass FindOptimizationPass(const char* name);
+
+struct OptimizationStats {
+    // instruction counts (immediates excluded) summed over all pieces
+    volatile i32 pass_before[OPT_PASS_COUNT]{0};
+    volatile i32 pass_after[OPT_PASS_COUNT]{0};
+    volatile i32 total_before = 0;
+    volatile i32 total_after = 0;
+
+    void print(u32 enabled_passes);
+};
+
+// stats may be null
+void OptimizePiece(BytecodePiece* piece, u32 passes, OptimizationStats* stats);
+// Runs when all pieces are generated and optimized, the pieces with inlined calls are optimized again.
+void InlineCalls(Bytecode* bytecode, u32 passes, OptimizationStats* stats);
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "Bytecode.h"
+
+/*
+    Profiler for programs running in the virtual machine (-profile).
+
+    Every interpreted instruction is counted per piece and pc. Lines are
+    found through line_of_instruction when the report is made.
+
+    Time is sampled. Every SAMPLE_INTERVAL instructions, and after native
+    calls, the time since the previous sample is charged to the current
+    instruction and the call stack is recorded by following the saved base
+    pointers. The stacks are written in the collapsed format flamegraph
+    tools read ("main;update;step 1234"), weighted by instructions.
+
+    The JIT is disabled while profiling so that no instructions are missed.
+*/
+
+struct VMProfiler {
+    static const int SAMPLE_INTERVAL = 64;
+
+    void init(Bytecode* bytecode);
+
+    // called for every instruction
+    void count(int piece_index, int pc, u8* bp, u8* stack_top) {
+        counters[piece_index][pc].instructions++;
+        if(++since_sample >= SAMPLE_INTERVAL)
+            sample(piece_index, pc, bp, stack_top);
+    }
+    void sample(int piece_index, int pc, u8* bp, u8* stack_top);
+
+    // flat profile of pieces and lines
+    void print_report(Bytecode* bytecode);
+    bool write_collapsed_stacks(Bytecode* bytecode, const std::string& path);
+
+private:
+    struct Counter {
+        u64 instructions;
+        u64 ticks; // sampled, see StartMeasure
+    };
+    std::vector<std::vector<Counter>> counters; // [piece_index][pc]
+    // piece indices from main to the sampled piece, stored as bytes
+    std::unordered_map<std::string, u64> stacks;
+    std::vector<int> frames;
+
+    int since_sample = 0;
+    TimePoint last_sample = 0;
+};
+
+/*
+    Dispatch statistics for the virtual machine (-vmstats).
+
+    Counts executed opcodes, pairs of consecutive opcodes, opcodes per
+    operand size and control flags, and calls per native function. Used to
+    decide which sequences are worth a superinstruction or the JIT.
+    The JIT is disabled while counting.
+*/
+struct VMStats {
+    void init(Bytecode* bytecode);
+
+    // called for every instruction
+    void count(Instruction inst) {
+        opcodes[inst.opcode]++;
+        pairs[prev_opcode][inst.opcode]++;
+        operands[inst.opcode][(u8)inst.op2]++;
+        prev_opcode = inst.opcode;
+    }
+    // type is the native type, host natives come after NATIVE_MAX
+    void count_native(int type) {
+        natives[type]++;
+    }
+
+    void print_report(Bytecode* bytecode);
+
+private:
+    u64 opcodes[INST_OPCODE_COUNT]{};
+    u64 pairs[INST_OPCODE_COUNT][INST_OPCODE_COUNT]{};
+    u64 operands[INST_OPCODE_COUNT][256]{}; // indexed by op2
+    std::vector<u64> natives;
+    Opcode prev_opcode = INST_NOP;
+};
@@ -185,6 +185,8 @@ bool ReadEntireFile(const std::string& path, char*& text, int& size);
 #endif
 // returns the result
 i32 atomic_add(volatile i32* ptr, i32 value);
+// Replaces *ptr with desired if it is expected, returns the value *ptr had
+void* atomic_compare_swap(void* volatile* ptr, void* expected, void* desired);
 
 struct Location {
     const char* file;
@@ -211,4 +213,22 @@ void PrintMemoryUsage(int expected_memory_usage);
 
 
 void SetHighProcessPriority();
-void SetHighThreadPriority();
\ No newline at end of file
+void SetHighThreadPriority();
+
+// Memory for generated machine code. Write the code first,
+// ProtectExecutable makes the memory read-only and executable.
+void* AllocateExecutable(int size);
+bool ProtectExecutable(void* ptr, int size);
+void FreeExecutable(void* ptr, int size);
+
+// Zeroed read-write pages straight from the operating system, not tracked by Alloc
+void* AllocatePages(u64 size);
+void FreePages(void* ptr, u64 size);
+// Makes pages inaccessible, used for guard pages
+bool ProtectNoAccess(void* ptr, u64 size);
+// Calls proc(arg) and returns false if proc accessed inaccessible memory
+// in [region, region + size). Faults elsewhere crash like they normally would.
+bool CallWithGuardPages(void (*proc)(void* arg), void* arg, void* region, u64 size);
+// Read-only view of a whole file, null if it can't be opened or is empty
+void* MapFile(const char* path, u64* out_size);
+void UnmapFile(void* ptr, u64 size);
\ No newline at end of file
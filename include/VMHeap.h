@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Util.h"
+
+/*
+    Heap for malloc and mfree in Tin programs.
+
+    Small allocations are rounded up to a power of two size class. Each
+    size class carves blocks out of its own regions of pages and reuses
+    freed blocks through a free list. Large allocations get a region each.
+    Every block starts with a header holding the requested size which
+    is what memory accesses are validated against.
+
+    Regions are kept sorted by address so the block containing a pointer
+    is found with a binary search over regions and a shift within the region.
+*/
+
+struct VMHeap {
+    ~VMHeap() {
+        release();
+    }
+
+    static const int HEADER_SIZE = 8;
+    static const int MIN_CLASS_SHIFT = 4; // 16 byte blocks, header included
+    static const int CLASS_COUNT = 9; // largest size class is 4096 bytes
+    static const int REGION_SIZE = 0x100000;
+
+    // returns null if the operating system is out of memory
+    void* allocate(int size);
+    // returns false if ptr wasn't returned by allocate or was already freed
+    bool free(void* ptr);
+    // true if [ptr, ptr + size) is inside a live allocation
+    bool contains(void* ptr, int size);
+    // frees all memory, live allocations included
+    void release();
+
+    int live_allocations = 0;
+
+private:
+    struct Header {
+        u32 size; // requested size
+        u32 allocated;
+    };
+    struct Region {
+        u8* base;
+        u64 size;
+        int block_shift; // 0 for a region with one large allocation
+    };
+    std::vector<Region> regions; // sorted by base
+
+    void* free_lists[CLASS_COUNT]{};
+    u8* bump[CLASS_COUNT]{};
+    u8* bump_end[CLASS_COUNT]{};
+
+    Region* find_region(void* ptr);
+    void add_region(u8* base, u64 size, int block_shift);
+};
@@ -1,11 +1,16 @@
 #pragma once
 
 #include "Bytecode.h"
+#include "JIT.h"
+#include "VMHeap.h"
+#include "Profiler.h"
 
 
 struct VirtualMachine {
     ~VirtualMachine() {
-        DELNEW_ARRAY(stack, u8, stack_max, HERE);
+        if(stack_region)
+            FreePages(stack_region, stack_region_size);
+        stack_region = nullptr;
         stack = nullptr;
         stack_max = 0;
         DELNEW_ARRAY(global_data, u8, global_data_max, HERE);
@@ -13,6 +18,10 @@ struct VirtualMachine {
         global_data_max = 0;
         bytecode = nullptr;
         piece = nullptr;
+        for(auto& p : jit_pieces)
+            JitFree(p.code);
+        jit_pieces.clear();
+        close_files();
     }
     Bytecode* bytecode=nullptr;
     
@@ -21,24 +30,94 @@ struct VirtualMachine {
     
     u8* stack = nullptr;
     int stack_max = 0;
+    int stack_size = 0x10000; // set before init, rounded up to STACK_GUARD_SIZE
     
     i64 registers[REG_COUNT];
     
     int piece_index = -1;
     BytecodePiece* piece = nullptr;
     
+    bool enable_jit = false; // compile hot pieces to machine code, see JIT.h
+    bool check_memory = true; // validate loads and stores, disable for trusted programs
+    VMProfiler* profiler = nullptr; // counts instructions and samples time when set, see Profiler.h
+    VMStats* stats = nullptr; // counts opcodes and native calls when set
+    std::vector<JitPiece> jit_pieces;
+    
     void init();
     void execute();
     
+    // Embedding API, call init first. Globals are initialized by main,
+    // run execute once before calling functions that use them. Pointer
+    // arguments must point to VM memory unless check_memory is off.
+    // Functions main doesn't call are only generated if
+    // CompilerOptions::remove_unreachable_functions is off.
+    BytecodePiece* find_function(const std::string& name);
+    // Copies the arguments to the parameter offsets of the function, runs it
+    // until it returns and copies the return value from the return slot.
+    // Returns false if the arguments don't match the parameters or if the
+    // function didn't return normally.
+    //   int result;
+    //   vm->call(vm->find_function("add"), &result, sizeof(result), 3, 4);
+    template<typename... Args>
+    bool call(BytecodePiece* function, void* ret, int ret_size, Args... args) {
+        const void* values[] { &args..., nullptr };
+        int sizes[] { (int)sizeof(Args)..., 0 };
+        return call_packed(function, ret, ret_size, values, sizes, sizeof...(Args));
+    }
+    bool call_packed(BytecodePiece* function, void* ret, int ret_size, const void** args, const int* arg_sizes, int arg_count);
+    
+    // Output of the print natives is buffered and written when the buffer is
+    // full, when the program calls flush or finishes and before the VM reports errors.
+    void flush_output();
+    
     void print_registers(bool subtle = false);
     void print_stack();
     void print_frame(int high, int low);
     
 private:
-    void run_native_call(NativeCalls callType);
+    // Inaccessible pages below and above the stack. Pushing or popping into
+    // them faults which stops the interpreter instead of checking bounds.
+    // Larger than the biggest stack pointer increment.
+    static const int STACK_GUARD_SIZE = 0x10000;
+    u8* stack_region = nullptr;
+    u64 stack_region_size = 0;
+
+    void prepare();
+    // false if execution stopped before returning from the first piece
+    bool interpret();
+    // compiled twice so the profiler and stats cost nothing when they aren't used
+    template<bool INSTRUMENTED>
+    bool interpret_loop();
+    // false if a native was given memory the program can't access, the
+    // access violation is reported and the native does nothing
+    bool run_native_call(NativeCalls callType);
+    // whether [ptr, ptr + size) is in the stack, global data, heap or a mapped
+    // file (mapped files can't be written), reports an access violation if not
+    bool can_access_memory(void* ptr, int size, bool write);
+    void run_host_call(int index) {
+        Assert(index < bytecode->host_natives.size());
+        auto& native = bytecode->host_natives[index];
+        u8* sp = (u8*)registers[REG_SP];
+        native.function(sp, sp - 16 - 8, native.user_data);
+    }
+    friend void jit_native_call(VirtualMachine* vm, int type);
+
+    VMHeap heap; // memory from malloc in Tin programs
+    
+    static const int OUTPUT_BUFFER_SIZE = 0x10000;
+    char output_buffer[OUTPUT_BUFFER_SIZE];
+    int output_used = 0;
+    void write_output(const char* str, int length);
+    void write_int(int value);
+    void write_float(float value);
     
-    struct Allocation {
-        int size;  
+    // handles from file_open are indices, closed files are null
+    std::vector<FILE*> files;
+    // read-only views from map_file, loads from them are valid memory accesses
+    struct MappedFile {
+        u8* data;
+        u64 size;
     };
-    std::unordered_map<void*, Allocation> allocations;
+    std::vector<MappedFile> mapped_files;
+    void close_files();
 };
\ No newline at end of file
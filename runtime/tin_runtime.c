@@ -0,0 +1,220 @@
+/*
+    Runtime for programs compiled with the assembly backend (see include/AsmGenerator.h).
+
+    Native functions receive the stack pointer at the call instruction.
+    Arguments start at sp and the return value is written to sp - 24,
+    the same layout the interpreter uses (VirtualMachine::run_native_call).
+
+    gcc program.s runtime/tin_runtime.c -lm -o program
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#define ARG(TYPE, OFFSET) (*(TYPE*)(sp + (OFFSET)))
+#define RET(TYPE) (*(TYPE*)(sp - 16 - 8))
+
+void tin_main(void);
+
+int main(void) {
+    tin_main();
+    fflush(stdout);
+    return 0;
+}
+
+void tin_native_printi(char* sp) {
+    printf("%d", ARG(int, 0));
+}
+void tin_native_printf(char* sp) {
+    printf("%f", ARG(float, 0));
+}
+void tin_native_printc(char* sp) {
+    printf("%c", ARG(char, 0));
+}
+void tin_native_prints(char* sp) {
+    printf("%s", ARG(char*, 0));
+}
+void tin_native_malloc(char* sp) {
+    RET(void*) = malloc(ARG(int, 0));
+}
+void tin_native_mfree(char* sp) {
+    free(ARG(void*, 0));
+}
+void tin_native_memcpy(char* sp) {
+    memmove(ARG(void*, 0), ARG(void*, 8), ARG(int, 16));
+}
+void tin_native_pow(char* sp) {
+    RET(float) = powf(ARG(float, 0), ARG(float, 4));
+}
+void tin_native_sqrt(char* sp) {
+    RET(float) = sqrtf(ARG(float, 0));
+}
+void tin_native_read_file(char* sp) {
+    const char* path = ARG(char*, 0);
+    char** out_data = ARG(char**, 8);
+    int* out_size = ARG(int*, 16);
+
+    FILE* file = fopen(path, "rb");
+    if(!file) {
+        RET(char) = 0;
+        return;
+    }
+    RET(char) = 1;
+    fseek(file, 0, SEEK_END);
+    int size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if(out_size)
+        *out_size = size;
+    if(out_data) {
+        char* text = (char*)malloc(size);
+        fread(text, 1, size, file);
+        *out_data = text;
+    }
+    fclose(file);
+}
+void tin_native_write_file(char* sp) {
+    const char* path = ARG(char*, 0);
+    const char* data = ARG(char*, 8);
+    int size = ARG(int, 16);
+
+    FILE* file = fopen(path, "wb");
+    if(!file) {
+        RET(char) = 0;
+        return;
+    }
+    RET(char) = 1;
+    if(data && size > 0)
+        fwrite(data, 1, size, file);
+    fclose(file);
+}
+void tin_native_flush(char* sp) {
+    fflush(stdout);
+}
+
+// handles from file_open are indices, closed files are null
+static FILE** files = NULL;
+static int files_max = 0;
+
+void tin_native_file_open(char* sp) {
+    static const char* modes[] = { "rb", "wb", "ab" };
+    int mode = ARG(int, 8);
+    FILE* file = mode >= 0 && mode < 3 ? fopen(ARG(char*, 0), modes[mode]) : NULL;
+    if(!file) {
+        RET(int) = -1;
+        return;
+    }
+    int handle = 0;
+    while(handle < files_max && files[handle])
+        handle++;
+    if(handle == files_max) {
+        files_max = files_max * 2 + 8;
+        files = (FILE**)realloc(files, files_max * sizeof(FILE*));
+        memset(files + handle, 0, (files_max - handle) * sizeof(FILE*));
+    }
+    files[handle] = file;
+    RET(int) = handle;
+}
+void tin_native_file_close(char* sp) {
+    int handle = ARG(int, 0);
+    if(handle >= 0 && handle < files_max && files[handle]) {
+        fclose(files[handle]);
+        files[handle] = NULL;
+    }
+}
+void tin_native_file_read(char* sp) {
+    int handle = ARG(int, 0);
+    int size = ARG(int, 16);
+    if(handle < 0 || handle >= files_max || !files[handle] || size < 0) {
+        RET(int) = -1;
+        return;
+    }
+    RET(int) = (int)fread(ARG(void*, 8), 1, size, files[handle]);
+}
+void tin_native_file_write(char* sp) {
+    int handle = ARG(int, 0);
+    int size = ARG(int, 16);
+    if(handle < 0 || handle >= files_max || !files[handle] || size < 0) {
+        RET(int) = -1;
+        return;
+    }
+    RET(int) = (int)fwrite(ARG(void*, 8), 1, size, files[handle]);
+}
+// views from map_file, unmapping needs the size
+typedef struct {
+    char* data;
+    long long size;
+} MappedFile;
+static MappedFile* mapped = NULL;
+static int mapped_count = 0;
+static int mapped_max = 0;
+
+void tin_native_map_file(char* sp) {
+    const char* path = ARG(char*, 0);
+    int* out_size = ARG(int*, 8);
+    char* data = NULL;
+    long long size = 0;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER file_size;
+        if(GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 && file_size.QuadPart <= 0x7FFFFFFF) {
+            HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if(mapping) {
+                data = (char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(mapping);
+                if(data)
+                    size = file_size.QuadPart;
+            }
+        }
+        CloseHandle(file);
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if(fd != -1) {
+        struct stat info;
+        if(fstat(fd, &info) == 0 && info.st_size > 0 && info.st_size <= 0x7FFFFFFF) {
+            data = (char*)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(data == MAP_FAILED)
+                data = NULL;
+            else
+                size = info.st_size;
+        }
+        close(fd);
+    }
+#endif
+    if(data) {
+        if(mapped_count == mapped_max) {
+            mapped_max = mapped_max * 2 + 8;
+            mapped = (MappedFile*)realloc(mapped, mapped_max * sizeof(MappedFile));
+        }
+        mapped[mapped_count].data = data;
+        mapped[mapped_count].size = size;
+        mapped_count++;
+    }
+    if(out_size)
+        *out_size = (int)size;
+    RET(char*) = data;
+}
+void tin_native_unmap_file(char* sp) {
+    char* data = ARG(char*, 0);
+    for(int i=0;i<mapped_count;i++) {
+        if(mapped[i].data != data)
+            continue;
+#ifdef _WIN32
+        UnmapViewOfFile(data);
+#else
+        munmap(data, mapped[i].size);
+#endif
+        mapped[i] = mapped[--mapped_count];
+        return;
+    }
+}
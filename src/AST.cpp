@@ -166,10 +166,155 @@ AST::AST() {
         f->return_typeString = "bool";
         global_body->add(f);
     }
+    {
+        auto f = createFunction();
+        f->is_native = true;
+        f->piece_code_index = NATIVE_flush - NATIVE_MAX;
+        f->name = NAME_OF_NATIVE(f->piece_code_index + NATIVE_MAX);
+        global_body->add(f);
+    }
+    {
+        // mode: 0 read, 1 write (truncates), 2 append
+        auto f = createFunction();
+        f->is_native = true;
+        f->piece_code_index = NATIVE_file_open - NATIVE_MAX;
+        f->name = NAME_OF_NATIVE(f->piece_code_index + NATIVE_MAX);
+        f->parameters.push_back({});
+        f->parameters.back().name = "path";
+        f->parameters.back().typeString = "char*";
+        f->parameters.push_back({});
+        f->parameters.back().name = "mode";
+        f->parameters.back().typeString = "int";
+        f->return_typeString = "int";
+        global_body->add(f);
+    }
+    {
+        auto f = createFunction();
+        f->is_native = true;
+        f->piece_code_index = NATIVE_file_close - NATIVE_MAX;
+        f->name = NAME_OF_NATIVE(f->piece_code_index + NATIVE_MAX);
+        f->parameters.push_back({});
+        f->parameters.back().name = "file";
+        f->parameters.back().typeString = "int";
+        global_body->add(f);
+    }
+    {
+        auto f = createFunction();
+        f->is_native = true;
+        f->piece_code_index = NATIVE_file_read - NATIVE_MAX;
+        f->name = NAME_OF_NATIVE(f->piece_code_index + NATIVE_MAX);
+        f->parameters.push_back({});
+        f->parameters.back().name = "file";
+        f->parameters.back().typeString = "int";
+        f->parameters.push_back({});
+        f->parameters.back().name = "buffer";
+        f->parameters.back().typeString = "void*";
+        f->parameters.push_back({});
+        f->parameters.back().name = "size";
+        f->parameters.back().typeString = "int";
+        f->return_typeString = "int";
+        global_body->add(f);
+    }
+    {
+        auto f = createFunction();
+        f->is_native = true;
+        f->piece_code_index = NATIVE_file_write - NATIVE_MAX;
+        f->name = NAME_OF_NATIVE(f->piece_code_index + NATIVE_MAX);
+        f->parameters.push_back({});
+        f->parameters.back().name = "file";
+        f->parameters.back().typeString = "int";
+        f->parameters.push_back({});
+        f->parameters.back().name = "data";
+        f->parameters.back().typeString = "void*";
+        f->parameters.push_back({});
+        f->parameters.back().name = "size";
+        f->parameters.back().typeString = "int";
+        f->return_typeString = "int";
+        global_body->add(f);
+    }
+    {
+        auto f = createFunction();
+        f->is_native = true;
+        f->piece_code_index = NATIVE_map_file - NATIVE_MAX;
+        f->name = NAME_OF_NATIVE(f->piece_code_index + NATIVE_MAX);
+        f->parameters.push_back({});
+        f->parameters.back().name = "path";
+        f->parameters.back().typeString = "char*";
+        f->parameters.push_back({});
+        f->parameters.back().name = "out_size";
+        f->parameters.back().typeString = "int*";
+        f->return_typeString = "char*";
+        global_body->add(f);
+    }
+    {
+        auto f = createFunction();
+        f->is_native = true;
+        f->piece_code_index = NATIVE_unmap_file - NATIVE_MAX;
+        f->name = NAME_OF_NATIVE(f->piece_code_index + NATIVE_MAX);
+        f->parameters.push_back({});
+        f->parameters.back().name = "data";
+        f->parameters.back().typeString = "char*";
+        global_body->add(f);
+    }
 
     creating_global_types = false;
     
 }
+ASTFunction* AST::addHostNative(const std::string& signature, int host_index) {
+    // name(a: int, b: float*): float
+    auto trim = [](std::string str) {
+        int start = 0, end = str.size();
+        while(start < end && (str[start] == ' ' || str[start] == '\t')) start++;
+        while(end > start && (str[end-1] == ' ' || str[end-1] == '\t')) end--;
+        return str.substr(start, end - start);
+    };
+    int open = signature.find('(');
+    int close = signature.find(')');
+    if(open == std::string::npos || close == std::string::npos || close < open)
+        return nullptr;
+    
+    auto f = createFunction();
+    f->is_native = true;
+    f->piece_code_index = host_native_imm(host_index);
+    f->name = trim(signature.substr(0, open));
+    
+    std::string params = signature.substr(open + 1, close - open - 1);
+    int start = 0;
+    while(trim(params).size() != 0 && start <= params.size()) {
+        int end = params.find(',', start);
+        if(end == std::string::npos)
+            end = params.size();
+        std::string param = params.substr(start, end - start);
+        int colon = param.find(':');
+        if(colon == std::string::npos) {
+            destroyFunction(f);
+            return nullptr;
+        }
+        f->parameters.push_back({});
+        f->parameters.back().name = trim(param.substr(0, colon));
+        f->parameters.back().typeString = trim(param.substr(colon + 1));
+        start = end + 1;
+    }
+    
+    std::string rest = trim(signature.substr(close + 1));
+    if(rest.size() != 0) {
+        if(rest[0] != ':') {
+            destroyFunction(f);
+            return nullptr;
+        }
+        f->return_typeString = trim(rest.substr(1));
+    }
+    
+    bool valid = f->name.size() != 0;
+    for(auto& param : f->parameters)
+        valid &= param.name.size() != 0 && param.typeString.size() != 0;
+    if(!valid) {
+        destroyFunction(f);
+        return nullptr;
+    }
+    global_body->add(f);
+    return f;
+}
 ASTExpression* AST::createExpression(ASTExpression::Kind kind) {
     ZoneScopedC(tracy::Color::RebeccaPurple);
     #ifdef ENABLE_AST_ALLOCATOR
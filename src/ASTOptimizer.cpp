@@ -0,0 +1,550 @@
+#include "ASTOptimizer.h"
+
+/*
+    Constant folding evaluates expressions made of literals, sizeof, casts
+    and constants before the function is generated and replaces them with
+    one literal.
+
+    Evaluation follows the bytecode the generator would emit for the
+    expression, including the 64-bit registers of the virtual machine, for
+    example floats only writing the low 32 bits. An expression is only
+    replaced if a literal puts the same value in the register. Operations
+    the interpreter would fail on, such as division by zero, are left alone.
+
+    Constants declared in the function are folded where they are declared,
+    uses of them evaluate the folded literal. Constants outside the function
+    are found through the scopes and evaluated without being modified since
+    other functions may be folded at the same time.
+*/
+
+struct Constant {
+    TypeId type;
+    i64 reg; // value as it would be in a register in the virtual machine
+};
+
+static float float_of(i64 reg) {
+    return *(float*)&reg;
+}
+// float instructions only write the low 32 bits
+static i64 with_float(i64 reg, float value) {
+    *(float*)&reg = value;
+    return reg;
+}
+static i64 int_to_float(i64 reg) {
+    return with_float(reg, (float)*(int*)&reg); // CAST_INT_FLOAT
+}
+static bool is_literal(ASTExpression::Kind kind) {
+    return kind == ASTExpression::LITERAL_INT || kind == ASTExpression::LITERAL_FLOAT || kind == ASTExpression::LITERAL_CHAR
+        || kind == ASTExpression::LITERAL_TRUE || kind == ASTExpression::LITERAL_FALSE;
+}
+static bool is_binary(ASTExpression::Kind kind) {
+    return (kind >= ASTExpression::ADD && kind <= ASTExpression::OR) || (kind >= ASTExpression::EQUAL && kind <= ASTExpression::GREATER_EQUAL);
+}
+
+struct ConstantFolder {
+    AST* ast;
+    ASTFunction* function;
+
+    // variables and constants declared in the bodies being folded, the statement is null for variables
+    struct Name {
+        std::string name;
+        ASTStatement* constant;
+    };
+    std::vector<Name> names;
+
+    bool evaluate(ASTExpression* expr, Constant* out);
+    bool fold(ASTExpression** expr_ptr, Constant* out);
+    void fold_reference(ASTExpression* expr);
+    void fold_body(ASTBody* body);
+
+    bool find_constant(ASTExpression* expr, Constant* out);
+    bool compute_binary(ASTExpression::Kind kind, Constant l, Constant r, Constant* out);
+    bool compute_cast(TypeId cast_type, Constant value, Constant* out);
+    ASTExpression* create_literal(Constant value);
+};
+
+// The same type rules and instructions as GeneratorContext::generateExpression
+bool ConstantFolder::compute_binary(ASTExpression::Kind kind, Constant l, Constant r, Constant* out) {
+    auto is_int = [](TypeId t) { return t == TYPE_INT || t == TYPE_CHAR; };
+    switch(kind) {
+        case ASTExpression::ADD:
+        case ASTExpression::SUB:
+        case ASTExpression::MUL:
+        case ASTExpression::DIV: {
+            bool is_float = false;
+            if(l.type == r.type) {
+                if(l.type.pointer_level() != 0 || l.type == TYPE_VOID)
+                    return false;
+                out->type = l.type;
+                is_float = l.type == TYPE_FLOAT;
+            } else if(is_int(l.type) && is_int(r.type)) {
+                out->type = TYPE_INT;
+            } else if((l.type == TYPE_INT || l.type == TYPE_FLOAT) && (r.type == TYPE_INT || r.type == TYPE_FLOAT)) {
+                out->type = TYPE_FLOAT;
+                is_float = true;
+                if(l.type == TYPE_INT) l.reg = int_to_float(l.reg);
+                if(r.type == TYPE_INT) r.reg = int_to_float(r.reg);
+            } else {
+                return false;
+            }
+            if(is_float) {
+                float a = float_of(l.reg), b = float_of(r.reg);
+                float res = kind == ASTExpression::ADD ? a + b : kind == ASTExpression::SUB ? a - b : kind == ASTExpression::MUL ? a * b : a / b;
+                out->reg = with_float(l.reg, res);
+                return true;
+            }
+            u64 a = l.reg, b = r.reg;
+            switch(kind) {
+                case ASTExpression::ADD: out->reg = a + b; break;
+                case ASTExpression::SUB: out->reg = a - b; break;
+                case ASTExpression::MUL: out->reg = a * b; break;
+                default: {
+                    if(r.reg == 0 || (l.reg == INT64_MIN && r.reg == -1))
+                        return false; // leave the error to runtime
+                    out->reg = l.reg / r.reg;
+                }
+            }
+            return true;
+        }
+        case ASTExpression::AND:
+        case ASTExpression::OR: {
+            out->type = TYPE_BOOL;
+            out->reg = kind == ASTExpression::AND ? (l.reg && r.reg) : (l.reg || r.reg);
+            return true;
+        }
+        default: {
+            // comparisons
+            if(!(is_int(l.type) || l.type == TYPE_FLOAT) || !(is_int(r.type) || r.type == TYPE_FLOAT))
+                return false;
+            bool is_float = l.type == TYPE_FLOAT || r.type == TYPE_FLOAT;
+            int operand_size = ast->sizeOfType(l.type);
+            if(is_float) {
+                if(r.type != TYPE_FLOAT) r.reg = int_to_float(r.reg);
+                if(l.type != TYPE_FLOAT) l.reg = int_to_float(l.reg);
+            }
+            #define CMP(OP) (is_float ? float_of(l.reg) OP float_of(r.reg) : operand_size == 1 ? (i8)l.reg OP (i8)r.reg : l.reg OP r.reg)
+            bool res = false;
+            switch(kind) {
+                case ASTExpression::EQUAL:         res = CMP(==); break;
+                case ASTExpression::NOT_EQUAL:     res = CMP(!=); break;
+                case ASTExpression::LESS:          res = CMP(<); break;
+                case ASTExpression::GREATER:       res = CMP(>); break;
+                case ASTExpression::LESS_EQUAL:    res = CMP(<=); break;
+                case ASTExpression::GREATER_EQUAL: res = CMP(>=); break;
+                default: Assert(false);
+            }
+            #undef CMP
+            out->type = TYPE_BOOL;
+            out->reg = res;
+            return true;
+        }
+    }
+}
+bool ConstantFolder::compute_cast(TypeId cast_type, Constant value, Constant* out) {
+    if(!cast_type.valid())
+        return false;
+    auto is_integral = [](TypeId t) { return t == TYPE_INT || t == TYPE_BOOL || t == TYPE_CHAR; };
+    out->type = cast_type;
+    out->reg = value.reg;
+    if(value.type == cast_type || (is_integral(value.type) && is_integral(cast_type)))
+        return true; // the value is not changed
+    if(value.type == TYPE_INT && cast_type == TYPE_FLOAT) {
+        out->reg = int_to_float(value.reg);
+        return true;
+    }
+    if(value.type == TYPE_FLOAT && cast_type == TYPE_INT) {
+        float f = float_of(value.reg);
+        if(!(f > -2147483649.0f && f < 2147483648.0f))
+            return false; // out of range or nan
+        *(int*)&out->reg = (int)f; // CAST_FLOAT_INT only writes the low 32 bits
+        return true;
+    }
+    return false;
+}
+
+// Evaluates without modifying the expression
+bool ConstantFolder::evaluate(ASTExpression* expr, Constant* out) {
+    switch(expr->kind()) {
+        case ASTExpression::LITERAL_INT: *out = { TYPE_INT, (i64)expr->literal_integer }; return true;
+        case ASTExpression::LITERAL_FLOAT: *out = { TYPE_FLOAT, (i64)*(int*)&expr->literal_float }; return true;
+        case ASTExpression::LITERAL_CHAR: {
+            if(expr->literal_string.size() == 0)
+                return false;
+            *out = { TYPE_CHAR, (i64)expr->literal_string[0] };
+            return true;
+        }
+        case ASTExpression::LITERAL_TRUE: *out = { TYPE_BOOL, 1 }; return true;
+        case ASTExpression::LITERAL_FALSE: *out = { TYPE_BOOL, 0 }; return true;
+        case ASTExpression::SIZEOF: {
+            if(!expr->typeId.valid())
+                return false;
+            *out = { TYPE_INT, (i64)ast->sizeOfType(expr->typeId) };
+            return true;
+        }
+        case ASTExpression::CAST: {
+            Constant value;
+            return evaluate(expr->left, &value) && compute_cast(expr->typeId, value, out);
+        }
+        case ASTExpression::NOT: {
+            Constant value;
+            if(!evaluate(expr->left, &value))
+                return false;
+            *out = { value.type, !value.reg };
+            return true;
+        }
+        default: {
+            if(!is_binary(expr->kind()))
+                return false; // identifiers in constants outside the function are not followed
+            Constant l, r;
+            return evaluate(expr->left, &l) && evaluate(expr->right, &r) && compute_binary(expr->kind(), l, r, out);
+        }
+    }
+}
+bool ConstantFolder::find_constant(ASTExpression* expr, Constant* out) {
+    for(int i=names.size()-1;i>=0;i--) {
+        if(names[i].name == expr->name) {
+            auto stmt = names[i].constant;
+            return stmt && stmt->expression && evaluate(stmt->expression, out);
+        }
+    }
+    // parameters, globals and constants in the imports
+    auto variable = ast->findVariable(expr->name, function->body->scopeId);
+    if(!variable || variable->kind != Identifier::CONST_ID || !variable->statement || !variable->statement->expression)
+        return false;
+    return evaluate(variable->statement->expression, out);
+}
+ASTExpression* ConstantFolder::create_literal(Constant value) {
+    ASTExpression* literal = nullptr;
+    if(value.type == TYPE_INT || value.type == TYPE_FLOAT) {
+        if(value.reg != (i64)(int)value.reg)
+            return nullptr; // li sign extends the immediate
+        if(value.type == TYPE_INT) {
+            literal = ast->createExpression(ASTExpression::LITERAL_INT);
+            literal->literal_integer = (int)value.reg;
+        } else {
+            literal = ast->createExpression(ASTExpression::LITERAL_FLOAT);
+            literal->literal_float = float_of(value.reg);
+        }
+    } else if(value.type == TYPE_CHAR) {
+        if(value.reg != (i64)(i8)value.reg)
+            return nullptr;
+        literal = ast->createExpression(ASTExpression::LITERAL_CHAR);
+        literal->literal_string = std::string(1, (char)value.reg);
+    } else if(value.type == TYPE_BOOL) {
+        if(value.reg != 0 && value.reg != 1)
+            return nullptr;
+        literal = ast->createExpression(value.reg ? ASTExpression::LITERAL_TRUE : ASTExpression::LITERAL_FALSE);
+    }
+    return literal;
+}
+
+// Folds the expression and its operands, returns true if the expression is constant
+bool ConstantFolder::fold(ASTExpression** expr_ptr, Constant* out) {
+    ASTExpression* expr = *expr_ptr;
+    bool constant = false;
+    switch(expr->kind()) {
+        case ASTExpression::IDENTIFIER: {
+            constant = find_constant(expr, out);
+        } break;
+        case ASTExpression::CAST: {
+            Constant value;
+            constant = fold(&expr->left, &value) && compute_cast(expr->typeId, value, out);
+        } break;
+        case ASTExpression::NOT: {
+            Constant value;
+            constant = fold(&expr->left, &value);
+            *out = { value.type, !value.reg };
+        } break;
+        case ASTExpression::ASSIGN: {
+            Constant value;
+            fold_reference(expr->left);
+            fold(&expr->right, &value);
+        } break;
+        case ASTExpression::REFER:
+        case ASTExpression::PRE_INCREMENT:
+        case ASTExpression::POST_INCREMENT:
+        case ASTExpression::PRE_DECREMENT:
+        case ASTExpression::POST_DECREMENT: {
+            fold_reference(expr->left);
+        } break;
+        case ASTExpression::MEMBER: {
+            fold_reference(expr);
+        } break;
+        case ASTExpression::INDEX: {
+            Constant value;
+            fold(&expr->left, &value);
+            fold(&expr->right, &value);
+        } break;
+        case ASTExpression::DEREF: {
+            Constant value;
+            fold(&expr->left, &value);
+        } break;
+        case ASTExpression::FUNCTION_CALL: {
+            Constant value;
+            for(auto& arg : expr->arguments)
+                fold(&arg, &value);
+        } break;
+        default: {
+            if(is_binary(expr->kind())) {
+                // both sides are folded even if one of them isn't constant
+                Constant l, r;
+                bool left_constant = fold(&expr->left, &l);
+                bool right_constant = fold(&expr->right, &r);
+                constant = left_constant && right_constant && compute_binary(expr->kind(), l, r, out);
+            } else {
+                constant = evaluate(expr, out);
+            }
+        }
+    }
+    if(!constant || is_literal(expr->kind()))
+        return constant;
+
+    ASTExpression* literal = create_literal(*out);
+    if(literal) {
+        literal->location = expr->location;
+        *expr_ptr = literal;
+        ast->destroyExpression(expr);
+    }
+    return true;
+}
+// Expressions that are generated as a reference (GeneratorContext::generateReference)
+// keep their identifiers, only the values used in them are folded.
+void ConstantFolder::fold_reference(ASTExpression* expr) {
+    Constant value;
+    switch(expr->kind()) {
+        case ASTExpression::MEMBER: fold_reference(expr->left); break;
+        case ASTExpression::INDEX: {
+            fold_reference(expr->left);
+            fold(&expr->right, &value);
+        } break;
+        case ASTExpression::DEREF: fold(&expr->left, &value); break;
+        default: break;
+    }
+}
+void ConstantFolder::fold_body(ASTBody* body) {
+    int names_before = names.size();
+    Constant value;
+    for(auto stmt : body->statements) {
+        switch(stmt->kind()) {
+            case ASTStatement::VAR_DECLARATION: {
+                // the variable exists when its expression is generated
+                names.push_back({ stmt->declaration_name, nullptr });
+                if(stmt->expression)
+                    fold(&stmt->expression, &value);
+            } break;
+            case ASTStatement::GLOBAL_DECLARATION: {
+                // the expression is generated in main which may be generated at the same time
+                names.push_back({ stmt->declaration_name, nullptr });
+            } break;
+            case ASTStatement::CONST_DECLARATION: {
+                if(stmt->expression)
+                    fold(&stmt->expression, &value);
+                names.push_back({ stmt->declaration_name, stmt });
+            } break;
+            default: {
+                if(stmt->expression)
+                    fold(&stmt->expression, &value);
+            }
+        }
+        if(stmt->body)
+            fold_body(stmt->body);
+        if(stmt->elseBody)
+            fold_body(stmt->elseBody);
+    }
+    names.resize(names_before);
+}
+
+void FoldConstants(AST* ast, ASTFunction* function) {
+    ZoneScopedC(tracy::Color::Aqua);
+    if(!function->body)
+        return;
+    ConstantFolder folder{};
+    folder.ast = ast;
+    folder.function = function;
+    folder.fold_body(function->body);
+}
+
+/*
+    Dead code is removed when every import is checked and before any
+    function is generated, nothing else is using the AST then.
+
+    Statements after return, break and continue are removed first so that
+    calls in them don't count. Functions are then marked reachable starting
+    from main and the initializers of globals, which main sets. Calls are
+    resolved with findFunction from the scope of the body they are in, the
+    same way the generator does.
+
+    Global declarations are kept wherever they are since main initializes
+    them. Statements with bodies that declare functions or structs are kept
+    as well.
+*/
+struct DeadCodeRemover {
+    AST* ast;
+    std::vector<ASTFunction*> worklist;
+
+    // keep_return is set for the body of a function, see prune
+    void prune(ASTBody* body, bool keep_return = false);
+    void mark(ASTFunction* function);
+    void mark_calls(ASTExpression* expr, ScopeId scopeId);
+    void mark_calls(ASTBody* body, bool only_globals);
+};
+
+static bool can_remove(ASTBody* body);
+static bool can_remove(ASTStatement* stmt) {
+    if(stmt->kind() == ASTStatement::GLOBAL_DECLARATION)
+        return false;
+    return (!stmt->body || can_remove(stmt->body)) && (!stmt->elseBody || can_remove(stmt->elseBody));
+}
+static bool can_remove(ASTBody* body) {
+    if(body->functions.size() != 0 || body->structures.size() != 0)
+        return false;
+    for(auto stmt : body->statements) {
+        if(!can_remove(stmt))
+            return false;
+    }
+    return true;
+}
+// Whether the statements after this one can't run, the bodies must be pruned
+static bool always_exits(ASTStatement* stmt) {
+    auto body_exits = [](ASTBody* body) {
+        return body->statements.size() != 0 && always_exits(body->statements.back());
+    };
+    switch(stmt->kind()) {
+        case ASTStatement::RETURN:
+        case ASTStatement::BREAK:
+        case ASTStatement::CONTINUE: return true;
+        case ASTStatement::IF: {
+            if(stmt->expression && stmt->expression->kind() == ASTExpression::LITERAL_TRUE && body_exits(stmt->body))
+                return true;
+            return stmt->elseBody && body_exits(stmt->body) && body_exits(stmt->elseBody);
+        }
+        default: return false;
+    }
+}
+
+void DeadCodeRemover::prune(ASTBody* body, bool keep_return) {
+    for(auto f : body->functions) {
+        if(f->body)
+            prune(f->body, true);
+    }
+    auto& statements = body->statements;
+    int head = 0;
+    bool exited = false;
+    for(int i=0;i<statements.size();i++) {
+        auto stmt = statements[i];
+        bool remove = exited;
+        bool is_if = stmt->kind() == ASTStatement::IF && stmt->expression;
+        if(!remove && is_if && stmt->expression->kind() == ASTExpression::LITERAL_TRUE && stmt->elseBody && can_remove(stmt->elseBody)) {
+            ast->destroyBody(stmt->elseBody);
+            stmt->elseBody = nullptr;
+        }
+        if(!remove && is_if && stmt->expression->kind() == ASTExpression::LITERAL_FALSE && !stmt->elseBody)
+            remove = true;
+        if(!remove && stmt->kind() == ASTStatement::WHILE && stmt->expression && stmt->expression->kind() == ASTExpression::LITERAL_FALSE)
+            remove = true;
+
+        // The generator wants a return last in functions with a return type
+        // (if true { return 7; } return r;), an unreachable one is kept.
+        if(remove && keep_return && i == statements.size() - 1 && stmt->kind() == ASTStatement::RETURN)
+            remove = false;
+
+        if(remove && can_remove(stmt)) {
+            ast->destroyStatement(stmt);
+            continue;
+        }
+        if(stmt->body)
+            prune(stmt->body);
+        if(stmt->elseBody)
+            prune(stmt->elseBody);
+        if(always_exits(stmt))
+            exited = true;
+        statements[head++] = stmt;
+    }
+    statements.resize(head);
+}
+void DeadCodeRemover::mark(ASTFunction* function) {
+    if(!function || function->reachable)
+        return;
+    function->reachable = true;
+    worklist.push_back(function);
+}
+void DeadCodeRemover::mark_calls(ASTExpression* expr, ScopeId scopeId) {
+    if(!expr)
+        return;
+    if(expr->kind() == ASTExpression::FUNCTION_CALL)
+        mark(ast->findFunction(expr->name, scopeId));
+    mark_calls(expr->left, scopeId);
+    mark_calls(expr->right, scopeId);
+    for(auto arg : expr->arguments)
+        mark_calls(arg, scopeId);
+}
+void DeadCodeRemover::mark_calls(ASTBody* body, bool only_globals) {
+    if(only_globals) {
+        for(auto f : body->functions) {
+            if(f->body)
+                mark_calls(f->body, true);
+        }
+    }
+    for(auto stmt : body->statements) {
+        if(!only_globals || stmt->kind() == ASTStatement::GLOBAL_DECLARATION)
+            mark_calls(stmt->expression, body->scopeId);
+        if(stmt->body)
+            mark_calls(stmt->body, only_globals);
+        if(stmt->elseBody)
+            mark_calls(stmt->elseBody, only_globals);
+    }
+}
+
+void RemoveDeadCode(AST* ast, bool remove_functions) {
+    ZoneScopedC(tracy::Color::Aqua);
+    DeadCodeRemover remover{};
+    remover.ast = ast;
+    for(auto imp : ast->imports) {
+        if(imp->body)
+            remover.prune(imp->body);
+    }
+    if(!remove_functions)
+        return;
+
+    std::vector<ASTFunction*> mains;
+    std::vector<ASTBody*> bodies;
+    for(auto imp : ast->imports) {
+        if(imp->body)
+            bodies.push_back(imp->body);
+    }
+    std::vector<ASTFunction*> functions;
+    while(bodies.size() > 0) {
+        auto body = bodies.back();
+        bodies.pop_back();
+        for(auto f : body->functions) {
+            functions.push_back(f);
+            if(f->name == "main" && f->body)
+                mains.push_back(f);
+            if(f->body)
+                bodies.push_back(f->body);
+        }
+        for(auto stmt : body->statements) {
+            if(stmt->body)
+                bodies.push_back(stmt->body);
+            if(stmt->elseBody)
+                bodies.push_back(stmt->elseBody);
+        }
+    }
+    if(mains.size() == 0)
+        return; // nothing to start from, keep everything
+
+    for(auto f : functions)
+        f->reachable = false;
+    for(auto f : mains)
+        remover.mark(f);
+    for(auto imp : ast->imports) {
+        if(imp->body)
+            remover.mark_calls(imp->body, true);
+    }
+    while(remover.worklist.size() > 0) {
+        auto function = remover.worklist.back();
+        remover.worklist.pop_back();
+        if(function->body)
+            remover.mark_calls(function->body, false);
+    }
+}
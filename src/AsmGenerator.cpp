@@ -0,0 +1,428 @@
+#include "AsmGenerator.h"
+#include "AST.h"
+
+#include <stdarg.h>
+
+struct HostRegister {
+    const char* names[4]; // 8, 4, 2 and 1 byte
+};
+// rax, rcx, rdx, r11 are scratch and r13 keeps rsp during native calls
+static const HostRegister host_registers[REG_COUNT] {
+    { nullptr },                        // REG_INVALID
+    { "rbx", "ebx", "bx", "bl" },       // REG_A
+    { "rsi", "esi", "si", "sil" },      // REG_B
+    { "rdi", "edi", "di", "dil" },      // REG_C
+    { "r8", "r8d", "r8w", "r8b" },      // REG_D
+    { "r9", "r9d", "r9w", "r9b" },      // REG_E
+    { "r10", "r10d", "r10w", "r10b" },  // REG_F
+    { "rsp", "esp", "sp", "spl" },      // REG_SP
+    { "rbp", "ebp", "bp", "bpl" },      // REG_BP
+    { nullptr },                        // REG_PC
+    { "r14", "r14d", "r14w", "r14b" },  // REG_T0
+    { "r15", "r15d", "r15w", "r15b" },  // REG_T1
+};
+
+struct AsmContext {
+    Bytecode* bytecode = nullptr;
+    BytecodePiece* piece = nullptr;
+    std::string output = "";
+    bool failed = false;
+
+    void emit(const char* format, ...) {
+        char buffer[256];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        output += "    ";
+        output += buffer;
+        output += "\n";
+    }
+    void label(const char* format, ...) {
+        char buffer[256];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        output += buffer;
+        output += ":\n";
+    }
+    const char* reg(Register r, int size = 8) {
+        int index = size == 8 ? 0 : size == 4 ? 1 : size == 2 ? 2 : 3;
+        if(r >= REG_COUNT || !host_registers[r].names[0]) {
+            failed = true;
+            return "rax";
+        }
+        return host_registers[r].names[index];
+    }
+    const char* size_name(int size) {
+        switch(size) {
+            case 1: return "byte";
+            case 2: return "word";
+            case 4: return "dword";
+            case 8: return "qword";
+        }
+        failed = true;
+        return "qword";
+    }
+
+    void load(Register dst, Register base, int size, int disp) {
+        if(size == 1 || size == 2)
+            emit("movzx %s, %s ptr [%s%+d]", reg(dst), size_name(size), reg(base), disp);
+        else
+            emit("mov %s, %s ptr [%s%+d]", reg(dst, size), size_name(size), reg(base), disp);
+    }
+    void store(Register base, Register src, int size, int disp) {
+        emit("mov %s ptr [%s%+d], %s", size_name(size), reg(base), disp, reg(src, size));
+    }
+    void push(Register r) {
+        if(r == REG_SP) {
+            // the interpreter pushes the decremented stack pointer
+            emit("lea rax, [rsp-8]");
+            emit("push rax");
+        } else {
+            emit("push %s", reg(r));
+        }
+    }
+    void pop(Register r) {
+        if(r == REG_SP) {
+            emit("pop rax");
+            emit("lea rsp, [rax+8]");
+        } else {
+            emit("pop %s", reg(r));
+        }
+    }
+    // floats only write the low 32 bits in the interpreter
+    void merge_low32(Register r) {
+        emit("mov rcx, %s", reg(r));
+        emit("shr rcx, 32");
+        emit("shl rcx, 32");
+        emit("or rcx, rax");
+        emit("mov %s, rcx", reg(r));
+    }
+    void jump(const char* mnemonic, int target_pc) {
+        if(target_pc < 0 || target_pc > piece->instructions.size()) {
+            failed = true;
+            return;
+        }
+        emit("%s .Lp%d_%d", mnemonic, piece->piece_index, target_pc);
+    }
+    void binary_op(Opcode opcode, Register a, Register c, ControlFlags control);
+    void instruction(Instruction inst, int imm, int pc, int next_pc);
+    void generate_piece();
+};
+
+void AsmContext::binary_op(Opcode opcode, Register a, Register c, ControlFlags control) {
+    bool is_float = control & CONTROL_FLOAT;
+    if(is_float && opcode >= INST_ADD && opcode <= INST_DIV) {
+        const char* names[] { "addss", "subss", "mulss", "divss" };
+        emit("movd xmm0, %s", reg(a, 4));
+        emit("movd xmm1, %s", reg(c, 4));
+        emit("%s xmm0, xmm1", names[opcode - INST_ADD]);
+        emit("movd eax, xmm0");
+        merge_low32(a);
+        return;
+    }
+    switch(opcode) {
+        case INST_ADD: emit("add %s, %s", reg(a), reg(c)); return;
+        case INST_SUB: emit("sub %s, %s", reg(a), reg(c)); return;
+        case INST_MUL: emit("imul %s, %s", reg(a), reg(c)); return;
+        case INST_DIV: {
+            emit("mov rax, %s", reg(a));
+            emit("cqo");
+            emit("idiv %s", reg(c));
+            emit("mov %s, rax", reg(a));
+        } return;
+        case INST_AND:
+        case INST_OR: {
+            emit("test %s, %s", reg(a), reg(a));
+            emit("setne al");
+            emit("test %s, %s", reg(c), reg(c));
+            emit("setne cl");
+            emit("%s al, cl", opcode == INST_AND ? "and" : "or");
+            emit("movzx eax, al");
+            emit("mov %s, rax", reg(a));
+        } return;
+        default: break;
+    }
+    if(opcode < INST_EQUAL || opcode > INST_GREATER_EQUAL) {
+        failed = true;
+        return;
+    }
+    if(is_float) {
+        emit("movd xmm0, %s", reg(a, 4));
+        emit("movd xmm1, %s", reg(c, 4));
+        // unordered comparisons set ZF, PF and CF which makes everything but != false
+        switch(opcode) {
+            case INST_EQUAL:         emit("ucomiss xmm0, xmm1"); emit("sete al"); emit("setnp cl"); emit("and al, cl"); break;
+            case INST_NOT_EQUAL:     emit("ucomiss xmm0, xmm1"); emit("setne al"); emit("setp cl"); emit("or al, cl"); break;
+            case INST_LESS:          emit("ucomiss xmm1, xmm0"); emit("seta al"); break;
+            case INST_LESS_EQUAL:    emit("ucomiss xmm1, xmm0"); emit("setae al"); break;
+            case INST_GREATER:       emit("ucomiss xmm0, xmm1"); emit("seta al"); break;
+            case INST_GREATER_EQUAL: emit("ucomiss xmm0, xmm1"); emit("setae al"); break;
+            default: break;
+        }
+    } else {
+        if(control & CONTROL_1B)
+            emit("cmp %s, %s", reg(a, 1), reg(c, 1));
+        else
+            emit("cmp %s, %s", reg(a), reg(c));
+        const char* set = "sete";
+        switch(opcode) {
+            case INST_EQUAL:         set = "sete"; break;
+            case INST_NOT_EQUAL:     set = "setne"; break;
+            case INST_LESS:          set = "setl"; break;
+            case INST_LESS_EQUAL:    set = "setle"; break;
+            case INST_GREATER:       set = "setg"; break;
+            case INST_GREATER_EQUAL: set = "setge"; break;
+            default: break;
+        }
+        emit("%s al", set);
+    }
+    emit("movzx eax, al");
+    emit("mov %s, rax", reg(a));
+}
+
+void AsmContext::instruction(Instruction inst, int imm, int pc, int next_pc) {
+    ControlFlags control = (ControlFlags)inst.op2;
+    int size = inst.op2;
+    int target_pc = next_pc - 1 + imm; // jumps are relative to the immediate
+    switch(inst.opcode) {
+        case INST_NOP: break;
+        case INST_HALT: emit("ud2"); break;
+        case INST_CAST: {
+            if((CastType)inst.op1 == CAST_INT_FLOAT) {
+                emit("cvtsi2ss xmm0, %s", reg(inst.op0, 4));
+                emit("movd eax, xmm0");
+                merge_low32(inst.op0);
+            } else if((CastType)inst.op1 == CAST_FLOAT_INT) {
+                emit("movd xmm0, %s", reg(inst.op0, 4));
+                emit("cvttss2si eax, xmm0");
+                merge_low32(inst.op0);
+            }
+        } break;
+        case INST_MOV_RR: emit("mov %s, %s", reg(inst.op0), reg(inst.op1)); break;
+        case INST_MOV_MR: store(inst.op0, inst.op1, size, 0); break;
+        case INST_MOV_MR_DISP: store(inst.op0, inst.op1, size, imm); break;
+        case INST_MOV_RM: load(inst.op0, inst.op1, size, 0); break;
+        case INST_MOV_RM_DISP: load(inst.op0, inst.op1, size, imm); break;
+        case INST_PUSH: push(inst.op0); break;
+        case INST_POP: pop(inst.op0); break;
+        case INST_INCR: emit("add %s, %d", reg(inst.op0), decode_incr(inst)); break;
+        case INST_LI: emit("mov %s, %d", reg(inst.op0), imm); break;
+        case INST_DATAPTR: emit("lea %s, [rip + tin_global_data%+d]", reg(inst.op0), imm); break;
+        case INST_NOT: {
+            emit("test %s, %s", reg(inst.op1), reg(inst.op1));
+            emit("sete al");
+            emit("movzx eax, al");
+            emit("mov %s, rax", reg(inst.op0));
+        } break;
+        case INST_JMP: jump("jmp", target_pc); break;
+        case INST_JZ: {
+            emit("test %s, %s", reg(inst.op0), reg(inst.op0));
+            jump("jz", target_pc);
+        } break;
+        case INST_CALL: {
+            if(imm > 0) {
+                emit("call tin_piece%d", imm - 1);
+            } else if(imm < 0) {
+                // natives read arguments at sp and write the return value at sp-24,
+                // the C function's frame has to stay below that
+                emit("mov r13, rsp");
+                emit("mov rdi, rsp");
+                emit("and rsp, -16");
+                emit("sub rsp, 32");
+                emit("call tin_native_%s", bytecode->nameOfNative(imm));
+                emit("mov rsp, r13");
+            } else {
+                failed = true; // unresolved
+            }
+        } break;
+        case INST_TAILCALL: {
+            if(imm <= 0) {
+                failed = true;
+                break;
+            }
+            // the callee pushes rbp again and gets the same frame
+            emit("pop rbp");
+            emit("jmp tin_piece%d", imm - 1);
+        } break;
+        case INST_RET: {
+            emit("pop rbp");
+            emit("ret");
+        } break;
+        case INST_MEMZERO: {
+            emit("mov rax, %s", reg(inst.op0));
+            emit("mov rcx, %s", reg(inst.op1));
+            emit("mov r11, rdi");
+            emit("mov rdi, rax");
+            emit("xor eax, eax");
+            emit("rep stosb");
+            emit("mov rdi, r11");
+        } break;
+        case INST_MEMCPY:
+        case INST_MEMCPY_IMM: {
+            // rep movsb uses rdi and rsi, they are kept in r11 and rdx meanwhile
+            emit("mov rax, %s", reg(inst.op0));
+            emit("mov rdx, %s", reg(inst.op1));
+            if(inst.opcode == INST_MEMCPY)
+                emit("mov rcx, %s", reg(inst.op2));
+            else
+                emit("mov rcx, %d", imm);
+            emit("mov r11, rdi");
+            emit("xchg rdx, rsi");
+            emit("mov rdi, rax");
+            // copy backwards when the destination overlaps the end of the source
+            emit("cmp rdi, rsi");
+            emit("jbe .Lp%d_%d_forward", piece->piece_index, pc);
+            emit("lea rax, [rsi+rcx]");
+            emit("cmp rdi, rax");
+            emit("jae .Lp%d_%d_forward", piece->piece_index, pc);
+            emit("lea rsi, [rsi+rcx-1]");
+            emit("lea rdi, [rdi+rcx-1]");
+            emit("std");
+            emit("rep movsb");
+            emit("cld");
+            emit("jmp .Lp%d_%d_copied", piece->piece_index, pc);
+            label(".Lp%d_%d_forward", piece->piece_index, pc);
+            emit("rep movsb");
+            label(".Lp%d_%d_copied", piece->piece_index, pc);
+            emit("mov rsi, rdx");
+            emit("mov rdi, r11");
+        } break;
+        case INST_PUSH_LI: {
+            emit("mov %s, %d", reg(inst.op0), imm);
+            push(inst.op0);
+        } break;
+        case INST_PUSH_RM_DISP: {
+            load(inst.op0, inst.op1, size, imm);
+            push(inst.op0);
+        } break;
+        case INST_STACK_OP: {
+            emit("mov %s, %s", reg(inst.op1), reg(inst.op0));
+            pop(inst.op0);
+            binary_op((Opcode)imm, inst.op0, inst.op1, control);
+        } break;
+        case INST_CMP_JZ: {
+            binary_op(decode_cmp_jz(inst), inst.op0, inst.op1, decode_cmp_jz_control(inst));
+            emit("test %s, %s", reg(inst.op0), reg(inst.op0));
+            jump("jz", target_pc);
+        } break;
+        default: {
+            if(inst.opcode >= INST_ADD && inst.opcode <= INST_GREATER_EQUAL) {
+                binary_op(inst.opcode, inst.op0, inst.op1, control);
+                break;
+            }
+            failed = true;
+        }
+    }
+}
+
+void AsmContext::generate_piece() {
+    auto& insts = piece->instructions;
+    output += "\n";
+    output += "# " + piece->name + "\n";
+    label("tin_piece%d", piece->piece_index);
+    // the interpreter pushes the base pointer in the call instruction
+    emit("push rbp");
+    emit("mov rbp, rsp");
+
+    int pc = 0;
+    while(pc < insts.size()) {
+        Instruction inst = insts[pc];
+        label(".Lp%d_%d", piece->piece_index, pc);
+        int next_pc = pc + 1;
+        int imm = 0;
+        if(inst.opcode >= INST_IMMEDIATES) {
+            if(next_pc >= insts.size()) {
+                failed = true;
+                return;
+            }
+            imm = *(int*)&insts[next_pc];
+            next_pc++;
+        }
+        instruction(inst, imm, pc, next_pc);
+        pc = next_pc;
+    }
+    // running off the end is an error in the interpreter too
+    label(".Lp%d_%d", piece->piece_index, (int)insts.size());
+    emit("ud2");
+}
+
+bool GenerateAssembly(Bytecode* bytecode, const std::string& path) {
+    ZoneScopedC(tracy::Color::Orange);
+    bytecode->finalize();
+
+    AsmContext context{};
+    context.bytecode = bytecode;
+    auto& out = context.output;
+
+    int main_index = -1;
+    auto& pieces = bytecode->pieces_unsafe();
+    for(int i=0;i<pieces.size();i++) {
+        if(pieces[i]->name == "main")
+            main_index = i;
+    }
+    if(main_index == -1) {
+        log_color(RED);
+        printf("Assembly: main was not found.\n");
+        log_color(NO_COLOR);
+        return false;
+    }
+
+    out += "# Generated by the tin compiler, link with runtime/tin_runtime.c\n";
+    out += ".intel_syntax noprefix\n";
+    out += ".text\n";
+    out += ".globl tin_main\n";
+    context.label("tin_main");
+    const char* saved[] { "rbx", "rbp", "r12", "r13", "r14", "r15" };
+    for(int i=0;i<6;i++)
+        context.emit("push %s", saved[i]);
+    context.emit("sub rsp, 8");
+    context.emit("call tin_piece%d", main_index);
+    context.emit("add rsp, 8");
+    for(int i=5;i>=0;i--)
+        context.emit("pop %s", saved[i]);
+    context.emit("ret");
+
+    for(int i=0;i<pieces.size();i++) {
+        context.piece = pieces[i];
+        Assert(context.piece->piece_index == i);
+        context.generate_piece();
+        if(context.failed) {
+            log_color(RED);
+            printf("Assembly: Could not lower '%s'.\n", pieces[i]->name.c_str());
+            log_color(NO_COLOR);
+            return false;
+        }
+    }
+
+    int global_size = 0;
+    u8* global_data = bytecode->copyGlobalData(&global_size);
+    out += "\n.data\n.balign 16\n";
+    context.label("tin_global_data");
+    for(int i=0;i<global_size;i+=16) {
+        std::string bytes = "    .byte ";
+        for(int j=i;j<i+16 && j<global_size;j++) {
+            if(j != i)
+                bytes += ",";
+            bytes += std::to_string(global_data[j]);
+        }
+        out += bytes + "\n";
+    }
+    if(global_size == 0)
+        out += "    .byte 0\n";
+    DELNEW_ARRAY(global_data, u8, global_size, HERE);
+    out += ".section .note.GNU-stack,\"\",@progbits\n";
+
+    std::ofstream file(path, std::ofstream::binary);
+    if(!file.is_open()) {
+        log_color(RED);
+        printf("Assembly: Could not open '%s'.\n", path.c_str());
+        log_color(NO_COLOR);
+        return false;
+    }
+    file.write(out.data(), out.length());
+    file.close();
+    return true;
+}
@@ -30,8 +30,7 @@ void BytecodePiece::emit_pop(Register r0) {
     emit({INST_POP, r0});
 }
 void BytecodePiece::emit_incr(Register reg, int imm) {
-    // Assert((imm >> 16) == 0);
-    // BUG HERE, 32 bits truncated to 16 bits
+    Assert(imm == (i16)imm); // INCR holds a signed 16-bit immediate
     emit({INST_INCR, reg, (Register)(imm&0xFF), (Register)(imm >> 8) }); // we cast to register but it's not actually registers, it's immediate values
     if(reg == REG_SP)
         virtual_sp += imm;
@@ -115,10 +114,22 @@ void BytecodePiece::emit_call(int* out_index_of_imm) {
     *out_index_of_imm = get_pc();
     emit_imm(0);
 }
+void BytecodePiece::emit_tailcall(int* out_index_of_imm) {
+    emit({INST_TAILCALL});
+    *out_index_of_imm = get_pc();
+    emit_imm(0);
+}
 DEF_EMIT0(ret,RET)
 void BytecodePiece::emit_memzero(Register reg, Register reg_size) {
     emit({INST_MEMZERO, reg, reg_size});
 }
+void BytecodePiece::emit_memcpy(Register to_reg, Register from_reg, Register reg_size) {
+    emit({INST_MEMCPY, to_reg, from_reg, reg_size});
+}
+void BytecodePiece::emit_memcpy(Register to_reg, Register from_reg, int size) {
+    emit({INST_MEMCPY_IMM, to_reg, from_reg});
+    emit_imm(size);
+}
 void BytecodePiece::fix_jump_here(int imm_index) {
     *(int*)&instructions[imm_index] = get_pc() - imm_index;
 }
@@ -155,17 +166,24 @@ const char* opcode_names[] {
     "greater_equal",    // INST_GREATER_EQUAL,
     
     "ret",              // INST_RET
-    "memzero",             // INST_CALL
+    "memzero",          // INST_MEMZERO
+    "memcpy",           // INST_MEMCPY
     
     // INSTRUCTIONS WITH IMMEDIATES
     "li",               // INST_LI
     "jmp",              // INST_JMP
     "jz",               // INST_JZ
     "call",             // INST_CALL
+    "tailcall",         // INST_TAILCALL
     "mov_mr_disp",           // INST_MOV_MR_DISP
     "mov_rm_disp",           // INST_MOV_RM_DISP
     "dataptr",           // 
+    "memcpy_imm",       // INST_MEMCPY_IMM
     
+    "push_li",          // INST_PUSH_LI
+    "push_rm_disp",     // INST_PUSH_RM_DISP
+    "stack_op",         // INST_STACK_OP
+    "cmp_jz",           // INST_CMP_JZ
 };
 const char* register_names[] {
     "invalid", // REG_INVALID
@@ -217,12 +235,16 @@ void BytecodePiece::print(Bytecode* bytecode, bool with_debug_info, int low_inde
         log_color(Color::NO_COLOR);
         
         if(inst.opcode == INST_INCR) {
-            int imm = ((i8)inst.op1) | ((i8)inst.op2<<8);
-            printf(" %s, %d", register_names[inst.op0], imm);
+            printf(" %s, %d", register_names[inst.op0], decode_incr(inst));
         } else {
+            if(inst.opcode == INST_STACK_OP)
+                printf(" %s", opcode_names[*(int*)&instructions[i+1]]);
+            if(inst.opcode == INST_CMP_JZ)
+                printf(" %s", opcode_names[decode_cmp_jz(inst)]);
             if(inst.op0) printf(" %s", register_names[inst.op0]);
             if(inst.op1) printf(", %s", register_names[inst.op1]);
-            if(inst.op2 && (inst.opcode == INST_MOV_MR || inst.opcode == INST_MOV_RM || inst.opcode == INST_MOV_MR_DISP || inst.opcode == INST_MOV_RM_DISP)) {
+            if(inst.opcode == INST_MEMCPY) printf(", %s", register_names[inst.op2]);
+            if(inst.op2 && (inst.opcode == INST_MOV_MR || inst.opcode == INST_MOV_RM || inst.opcode == INST_MOV_MR_DISP || inst.opcode == INST_MOV_RM_DISP || inst.opcode == INST_PUSH_RM_DISP)) {
                 if(inst.op2 == 1) printf(", byte");
                 if(inst.op2 == 2) printf(", word");
                 if(inst.op2 == 4) printf(", dword");
@@ -230,10 +252,10 @@ void BytecodePiece::print(Bytecode* bytecode, bool with_debug_info, int low_inde
             }
         }
         
-        if(inst.opcode == INST_LI || inst.opcode == INST_JMP || inst.opcode == INST_JZ || inst.opcode == INST_CALL || inst.opcode == INST_MOV_MR_DISP || inst.opcode == INST_MOV_RM_DISP || inst.opcode == INST_DATAPTR) {
+        if(inst.opcode >= INST_IMMEDIATES) {
             i++;
             int imm = *(int*)&instructions[i];
-            if(bytecode && inst.opcode == INST_CALL) {
+            if(bytecode && (inst.opcode == INST_CALL || inst.opcode == INST_TAILCALL)) {
                 log_color(Color::GREEN);
                 std::string fname = "unresolved";
                 if(imm == 0) {
@@ -243,7 +265,7 @@ void BytecodePiece::print(Bytecode* bytecode, bool with_debug_info, int low_inde
                             if(r.function->piece_code_index == 0) {
 
                             } else if(r.function->piece_code_index < 0) {
-                                fname = NAME_OF_NATIVE(r.function->piece_code_index + NATIVE_MAX);
+                                fname = bytecode->nameOfNative(r.function->piece_code_index);
                                 break;
                             } else {
                                 fname = bytecode->getPiece(r.function->piece_code_index - 1)->name;
@@ -252,12 +274,14 @@ void BytecodePiece::print(Bytecode* bytecode, bool with_debug_info, int low_inde
                         }
                     }
                 } else if(imm < 0) {
-                    fname = NAME_OF_NATIVE(imm + NATIVE_MAX);
+                    fname = bytecode->nameOfNative(imm);
                 } else {
                     fname = bytecode->getPiece(imm - 1)->name;
                 }
                 printf(" %s", fname.c_str());
-            } else if(inst.opcode == INST_JMP || inst.opcode == INST_JZ) {
+            } else if(inst.opcode == INST_STACK_OP) {
+                // operation was printed with the opcode
+            } else if(inst.opcode == INST_JMP || inst.opcode == INST_JZ || inst.opcode == INST_CMP_JZ) {
                 printf(", ");
                 int addr = imm + i;
                 log_color(Color::GRAY);
@@ -303,6 +327,36 @@ void Bytecode::apply_relocations() {
         }
     }
 }
+void Bytecode::finalize() {
+    MUTEX_LOCK(general_lock);
+    if(!finalized.load(std::memory_order_relaxed)) { // the lock orders it with other finalize calls
+        apply_relocations();
+        mergeData();
+        for(auto p : pieces) {
+            // the first piece wins if functions in different scopes share a name
+            if(piece_map.find(p->name) == piece_map.end())
+                piece_map[p->name] = p;
+        }
+        finalized.store(true, std::memory_order_release);
+    }
+    MUTEX_UNLOCK(general_lock);
+}
+BytecodePiece* Bytecode::findPiece(const std::string& name) {
+    if(!finalized.load(std::memory_order_acquire))
+        finalize();
+    auto pair = piece_map.find(name);
+    if(pair == piece_map.end())
+        return nullptr;
+    return pair->second;
+}
+const char* Bytecode::nameOfNative(int imm) {
+    if(imm >= -NATIVE_MAX)
+        return NAME_OF_NATIVE(imm + NATIVE_MAX);
+    int index = host_native_index(imm);
+    if(index < host_natives.size())
+        return host_natives[index].name.c_str();
+    return "unknown";
+}
 const char* native_names[] {
     "printi", // NATIVE_printi
     "printf", // NATIVE_printf
@@ -315,53 +369,146 @@ const char* native_names[] {
     "sqrt",
     "read_file",
     "write_file",
+    "flush",
+    "file_open",
+    "file_close",
+    "file_read",
+    "file_write",
+    "map_file",
+    "unmap_file",
 };
 void BytecodePiece::addRelocation(ASTFunction* func, int imm_index){
     // printf("Reloc %s, %d\n", func->name.c_str(), imm_index);
     relocations.push_back({func, imm_index});
 }
+// The segment the thread appends to, it belongs to the bytecode with data_id
+static thread_local int current_data_id = -1;
+static thread_local DataSegment* current_segment = nullptr;
+static volatile i32 data_id_counter = 0;
+
+int Bytecode::newDataId() {
+    return atomic_add(&data_id_counter, 1);
+}
 int Bytecode::appendData(int size, void* data) {
     Assert(size > 0);
-    MUTEX_LOCK(general_lock);
-    if(size + global_data_size > global_data_max) {
-        int max = global_data_max * 2 + size * 2;
-        // printf("%d - %d\n",max,global_data_max);
-        global_data = RENEW_ARRAY(global_data, global_data_max, u8, max, HERE);
-        Assert(global_data);
-        global_data_max = max;
+    Assert(("global data can't change after finalize", !finalized.load(std::memory_order_relaxed)));
+    DataSegment* segment = current_data_id == data_id ? current_segment : nullptr;
+    if(!segment || segment->size + size > segment->max) {
+        // Reserve a range of the global data for a new segment. Data larger
+        // than a quarter segment gets a segment of its own so the thread
+        // can keep filling the current one.
+        bool own_segment = size > DATA_SEGMENT_SIZE / 4;
+        auto ptr = NEW(DataSegment, HERE);
+        ptr->max = own_segment ? size : DATA_SEGMENT_SIZE;
+        ptr->offset = atomic_add(&reserved_data, ptr->max) - ptr->max;
+        ptr->data = NEW_ARRAY(u8, ptr->max, HERE);
+        Assert(ptr->data);
+        DataSegment* head;
+        do {
+            head = data_segments;
+            ptr->next = head;
+        } while(atomic_compare_swap((void* volatile*)&data_segments, head, ptr) != head);
+        
+        segment = ptr;
+        if(!own_segment) {
+            current_data_id = data_id;
+            current_segment = ptr;
+        }
     }
-    int off = global_data_size;
-    global_data_size += size;
+    int off = segment->size;
+    segment->size += size;
     if(data) {
-        memcpy(global_data + off, data, size);
+        memcpy(segment->data + off, data, size);
     } else {
-        memset(global_data + off, '_', size);
+        memset(segment->data + off, '_', size);
     }
-    MUTEX_UNLOCK(general_lock);
-    return off;
+    return segment->offset + off;
 }
 int Bytecode::appendString(const std::string& str) {
-    MUTEX_LOCK(general_lock);
-    auto pair = string_map.find(str);
-    if(pair != string_map.end()) {
-        auto ptr = pair->second;
-        MUTEX_UNLOCK(general_lock);
-        return ptr;
+    u32 hash = (u32)std::hash<std::string>{}(str);
+    auto bucket = &string_buckets[hash % STRING_BUCKETS];
+    StringEntry* entry = nullptr;
+    StringEntry* checked = nullptr; // entries from here on were already compared
+    StringEntry* head = *bucket;
+    while(true) {
+        for(auto it = head; it != checked; it = it->next) {
+            if(it->hash == hash && it->str == str) {
+                // another thread added the string after we looked, our
+                // copy stays unused in the data
+                if(entry)
+                    DELNEW(entry, StringEntry, HERE);
+                return it->offset;
+            }
+        }
+        if(!entry) {
+            entry = NEW(StringEntry, HERE);
+            entry->str = str;
+            entry->hash = hash;
+            entry->offset = appendData(str.length() + 1, (void*)str.c_str());
+        }
+        entry->next = head;
+        auto prev = (StringEntry*)atomic_compare_swap((void* volatile*)bucket, head, entry);
+        if(prev == head)
+            return entry->offset;
+        checked = head;
+        head = prev;
     }
-    MUTEX_UNLOCK(general_lock);
-    int off = appendData(str.length() + 1, (void*)str.c_str());
-    MUTEX_LOCK(general_lock);
-    string_map[str] = off;
-    MUTEX_UNLOCK(general_lock);
-    return off;
+}
+void Bytecode::mergeData() {
+    // The data ends after the last used byte, parts of reserved ranges
+    // that weren't filled are zero.
+    int size = 0;
+    for(auto seg = data_segments; seg; seg = seg->next) {
+        if(seg->offset + seg->size > size)
+            size = seg->offset + seg->size;
+    }
+    if(size > 0) {
+        global_data = NEW_ARRAY(u8, size, HERE);
+        Assert(global_data);
+        memset(global_data, 0, size);
+    }
+    global_data_size = size;
+    global_data_max = size;
+    while(data_segments) {
+        auto seg = data_segments;
+        data_segments = seg->next;
+        memcpy(global_data + seg->offset, seg->data, seg->size);
+        DELNEW_ARRAY(seg->data, u8, seg->max, HERE);
+        DELNEW(seg, DataSegment, HERE);
+    }
+}
+void Bytecode::freeData() {
+    if(global_data) {
+        DELNEW_ARRAY(global_data, u8, global_data_max, HERE);
+    }
+    global_data = nullptr;
+    global_data_max = 0;
+    global_data_size = 0;
+    while(data_segments) {
+        auto seg = data_segments;
+        data_segments = seg->next;
+        DELNEW_ARRAY(seg->data, u8, seg->max, HERE);
+        DELNEW(seg, DataSegment, HERE);
+    }
+    reserved_data = 0;
+    for(int i=0;i<STRING_BUCKETS;i++) {
+        auto entry = string_buckets[i];
+        while(entry) {
+            auto next = entry->next;
+            DELNEW(entry, StringEntry, HERE);
+            entry = next;
+        }
+        string_buckets[i] = nullptr;
+    }
+    data_id = newDataId();
 }
 u8* Bytecode::copyGlobalData(int* size) {
     Assert(size);
-    MUTEX_LOCK(general_lock);
+    if(!finalized.load(std::memory_order_acquire))
+        finalize();
     *size = global_data_size;
     auto ptr = NEW_ARRAY(u8, *size, HERE);
     Assert(ptr);
     memcpy(ptr, global_data, *size);
-    MUTEX_UNLOCK(general_lock);
     return ptr;
 }
\ No newline at end of file
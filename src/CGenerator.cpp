@@ -0,0 +1,727 @@
+#include "CGenerator.h"
+
+// Identifiers that can't be used as names in C
+static const char* c_keywords[] {
+    "auto", "break", "case", "char", "const", "continue", "default", "do", "double",
+    "else", "enum", "extern", "float", "for", "goto", "if", "inline", "int", "long",
+    "register", "restrict", "return", "short", "signed", "sizeof", "static", "struct",
+    "switch", "typedef", "union", "unsigned", "void", "volatile", "while",
+    "_Bool", "_Static_assert", "main",
+};
+
+struct CContext {
+    AST* ast = nullptr;
+    ScopeId current_scopeId = 0;
+    std::string output = "";
+    int indent = 0;
+    bool failed = false;
+
+    std::unordered_map<ASTFunction*, std::string> function_names;
+    std::unordered_map<ASTStructure*, std::string> struct_names;
+    std::unordered_map<Identifier*, std::string> global_names;
+    std::unordered_map<std::string, bool> used_names;
+
+    std::vector<ASTFunction*> functions;
+    std::vector<ASTStructure*> structures;
+    std::unordered_map<ASTStructure*, bool> emitted_structures;
+    struct Global {
+        ASTStatement* stmt;
+        ScopeId scopeId;
+        Identifier* id;
+    };
+    std::vector<Global> globals; // in the order the bytecode initializes them
+
+    void line(const std::string& text) {
+        for(int i=0;i<indent;i++)
+            output += "    ";
+        output += text;
+        output += "\n";
+    }
+    void fail(const std::string& message) {
+        if(!failed) {
+            log_color(RED);
+            printf("C backend: %s\n", message.c_str());
+            log_color(NO_COLOR);
+        }
+        failed = true;
+    }
+
+    // local variables, parameters and members use the Tin name
+    std::string local_name(const std::string& name) {
+        for(auto keyword : c_keywords) {
+            if(name == keyword)
+                return name + "_";
+        }
+        return name;
+    }
+    // functions, structures and globals may have the same name in different scopes
+    std::string unique_name(const char* prefix, const std::string& name) {
+        std::string out = prefix + name;
+        int counter = 1;
+        while(used_names.find(out) != used_names.end()) {
+            out = prefix + name + "_" + std::to_string(counter);
+            counter++;
+        }
+        used_names[out] = true;
+        return out;
+    }
+
+    std::string typeName(TypeId type);
+    void collect(AST::Import* imp);
+    void generateStruct(ASTStructure* st);
+    void generateNative(ASTFunction* function);
+    std::string functionSignature(ASTFunction* function);
+
+    TypeId generateExpression(ASTExpression* expr, std::string& out);
+    // code as the 64-bit register the bytecode would hold, see registerValue
+    std::string registerValue(ASTExpression* expr, TypeId type, const std::string& code);
+    // code converted like CAST_INT_FLOAT if it isn't a float already
+    std::string floatValue(ASTExpression* expr, TypeId type, const std::string& code);
+    void generateBody(ASTBody* body);
+};
+
+std::string CContext::typeName(TypeId type) {
+    std::string out;
+    TypeInfo* info = ast->getType(type.base());
+    if(info->ast_struct) {
+        out = struct_names[info->ast_struct];
+    } else {
+        switch(type.index()) {
+            case TYPE_VOID:  out = "void"; break;
+            case TYPE_INT:   out = "tin_int"; break;
+            case TYPE_CHAR:  out = "tin_char"; break;
+            case TYPE_BOOL:  out = "tin_bool"; break;
+            case TYPE_FLOAT: out = "tin_float"; break;
+            default: fail("Unknown type '"+ast->nameOfType(type)+"'."); out = "void";
+        }
+    }
+    for(int i=0;i<type.pointer_level();i++)
+        out += "*";
+    return out;
+}
+
+void CContext::collect(AST::Import* imp) {
+    std::vector<ASTBody*> check_bodies;
+    check_bodies.push_back(imp->body);
+    while(check_bodies.size() > 0) {
+        ASTBody* body = check_bodies.back();
+        check_bodies.pop_back();
+        for(auto st : body->structures) {
+            structures.push_back(st);
+            struct_names[st] = unique_name("st_", st->name);
+        }
+        for(auto f : body->functions) {
+            functions.push_back(f);
+            function_names[f] = unique_name("fn_", f->name);
+            if(f->body)
+                check_bodies.push_back(f->body);
+        }
+        for(auto stmt : body->statements) {
+            if(stmt->body)
+                check_bodies.push_back(stmt->body);
+            if(stmt->elseBody)
+                check_bodies.push_back(stmt->elseBody);
+
+            if(stmt->kind() != ASTStatement::GLOBAL_DECLARATION)
+                continue;
+
+            auto id = ast->findVariable(stmt->declaration_name, body->scopeId);
+            if(!id || id->kind != Identifier::GLOBAL_ID) {
+                fail("Global '"+stmt->declaration_name+"' was not checked.");
+                continue;
+            }
+            globals.push_back({ stmt, body->scopeId, id });
+            global_names[id] = unique_name("g_", stmt->declaration_name);
+        }
+    }
+}
+
+void CContext::generateStruct(ASTStructure* st) {
+    if(emitted_structures.find(st) != emitted_structures.end())
+        return;
+    emitted_structures[st] = true;
+    // members stored by value must be defined first
+    for(auto& mem : st->members) {
+        if(mem.typeId.pointer_level() != 0)
+            continue;
+        auto info = ast->getType(mem.typeId);
+        if(info->ast_struct)
+            generateStruct(info->ast_struct);
+    }
+
+    auto& name = struct_names[st];
+    line("struct " + name + " {");
+    indent++;
+    int offset = 0;
+    int padding = 0;
+    for(auto& mem : st->members) {
+        if(mem.offset > offset) {
+            line("char _pad" + std::to_string(padding++) + "[" + std::to_string(mem.offset - offset) + "];");
+        }
+        line(typeName(mem.typeId) + " " + local_name(mem.name) + ";");
+        offset = mem.offset + ast->sizeOfType(mem.typeId);
+    }
+    if(st->typeInfo->size > offset || st->members.size() == 0) {
+        int rest = st->typeInfo->size - offset;
+        line("char _pad" + std::to_string(padding++) + "[" + std::to_string(rest > 0 ? rest : 1) + "];");
+    }
+    indent--;
+    line("};");
+    if(st->typeInfo->size != 0)
+        line("_Static_assert(sizeof(" + name + ") == " + std::to_string(st->typeInfo->size) + ", \"layout of " + st->name + "\");");
+}
+
+std::string CContext::functionSignature(ASTFunction* function) {
+    std::string out = typeName(function->return_type) + " " + function_names[function] + "(";
+    for(int i=0;i<function->parameters.size();i++) {
+        auto& param = function->parameters[i];
+        if(i != 0)
+            out += ", ";
+        out += typeName(param.typeId) + " " + local_name(param.name);
+    }
+    if(function->parameters.size() == 0)
+        out += "void";
+    out += ")";
+    return out;
+}
+
+void CContext::generateNative(ASTFunction* function) {
+    // Arguments are placed where the runtime expects them, the same layout
+    // VirtualMachine::run_native_call reads.
+    std::string native = "tin_native_" + function->name;
+    line("void " + native + "(char* sp);");
+    line("static inline " + functionSignature(function) + " {");
+    indent++;
+    line("char frame[24 + " + std::to_string(function->parameters_size) + "];");
+    for(auto& param : function->parameters) {
+        auto name = local_name(param.name);
+        line("memcpy(frame + 24 + " + std::to_string(param.offset - 16) + ", &" + name + ", sizeof(" + name + "));");
+    }
+    line(native + "(frame + 24);");
+    if(function->return_type.valid()) {
+        line(typeName(function->return_type) + " ret;");
+        line("memcpy(&ret, frame, sizeof(ret));");
+        line("return ret;");
+    }
+    indent--;
+    line("}");
+}
+
+static std::string quote_string(const std::string& str) {
+    std::string out = "\"";
+    for(char chr : str) {
+        unsigned char c = chr;
+        if(c == '"' || c == '\\') {
+            out += '\\';
+            out += chr;
+        } else if(c >= 32 && c < 127 && c != '?') {
+            out += chr;
+        } else {
+            // octal escapes always use three digits so the next character isn't included
+            char buffer[8];
+            snprintf(buffer, sizeof(buffer), "\\%03o", c);
+            out += buffer;
+        }
+    }
+    out += "\"";
+    return out;
+}
+
+/*
+    Integers are computed like in the virtual machine. Values are 64-bit
+    registers (tin_reg), loads zero extend the bytes of the type and
+    arithmetic keeps all 64 bits, so an int holding -3 compares as
+    4294967293 after it was stored. Comparisons of chars use the low byte as
+    a signed value (CONTROL_1B). Casts between integer types change nothing.
+    Stores, arguments and return values truncate to the type like mov does.
+*/
+std::string CContext::registerValue(ASTExpression* expr, TypeId type, const std::string& code) {
+    if(type.pointer_level() > 0 || !(type == TYPE_INT || type == TYPE_CHAR || type == TYPE_BOOL))
+        return code;
+    bool is_load = false;
+    switch(expr->kind()) {
+        case ASTExpression::IDENTIFIER: {
+            // constants are inlined and computed like literals
+            auto variable = ast->findVariable(expr->name, current_scopeId);
+            is_load = variable && variable->kind != Identifier::CONST_ID;
+        } break;
+        case ASTExpression::MEMBER:
+        case ASTExpression::DEREF:
+        case ASTExpression::INDEX:
+        case ASTExpression::FUNCTION_CALL: // read from the return slot
+        case ASTExpression::ASSIGN:
+        case ASTExpression::PRE_INCREMENT:
+        case ASTExpression::POST_INCREMENT:
+        case ASTExpression::PRE_DECREMENT:
+        case ASTExpression::POST_DECREMENT:
+            is_load = true;
+            break;
+        default: break;
+    }
+    if(!is_load)
+        return "((tin_reg)" + code + ")";
+    if(type == TYPE_INT)
+        return "((tin_reg)(uint32_t)" + code + ")";
+    return "((tin_reg)(uint8_t)" + code + ")";
+}
+std::string CContext::floatValue(ASTExpression* expr, TypeId type, const std::string& code) {
+    if(type == TYPE_FLOAT)
+        return code;
+    return "((tin_float)(tin_int)" + registerValue(expr, type, code) + ")";
+}
+
+TypeId CContext::generateExpression(ASTExpression* expr, std::string& out) {
+    Assert(expr);
+    switch(expr->kind()) {
+        case ASTExpression::LITERAL_INT: {
+            if(expr->literal_integer < 0)
+                out = "(" + std::to_string((i64)expr->literal_integer) + ")";
+            else
+                out = std::to_string(expr->literal_integer);
+            return TYPE_INT;
+        } break;
+        case ASTExpression::LITERAL_FLOAT: {
+            // hexadecimal floats are exact
+            char buffer[64];
+            snprintf(buffer, sizeof(buffer), "%af", expr->literal_float);
+            out = std::string("((tin_float)") + buffer + ")";
+            return TYPE_FLOAT;
+        } break;
+        case ASTExpression::LITERAL_STR: {
+            out = "((tin_char*)" + quote_string(expr->literal_string) + ")";
+            TypeId type = TYPE_CHAR;
+            type.set_pointer_level(1);
+            return type;
+        } break;
+        case ASTExpression::LITERAL_CHAR: {
+            Assert(expr->literal_string.size() > 0);
+            out = "((tin_char)" + std::to_string((int)expr->literal_string[0]) + ")";
+            return TYPE_CHAR;
+        } break;
+        case ASTExpression::LITERAL_TRUE: {
+            out = "((tin_bool)1)";
+            return TYPE_BOOL;
+        } break;
+        case ASTExpression::LITERAL_FALSE: {
+            out = "((tin_bool)0)";
+            return TYPE_BOOL;
+        } break;
+        case ASTExpression::LITERAL_NULL: {
+            out = "((void*)0)";
+            TypeId p = TYPE_VOID;
+            p.set_pointer_level(1);
+            return p;
+        } break;
+        case ASTExpression::IDENTIFIER: {
+            auto variable = ast->findVariable(expr->name, current_scopeId);
+            if(!variable) {
+                fail("Variable '"+expr->name+"' does not exist.");
+                return TYPE_VOID;
+            }
+            switch(variable->kind) {
+                case Identifier::LOCAL_ID: {
+                    out = local_name(expr->name);
+                    return variable->type;
+                } break;
+                case Identifier::GLOBAL_ID: {
+                    out = global_names[variable];
+                    return variable->type;
+                } break;
+                case Identifier::CONST_ID: {
+                    Assert(variable->statement && variable->statement->expression);
+                    return generateExpression(variable->statement->expression, out);
+                } break;
+                default: Assert(false);
+            }
+            return TYPE_VOID;
+        } break;
+        case ASTExpression::FUNCTION_CALL: {
+            auto fun = ast->findFunction(expr->name, current_scopeId);
+            if(!fun) {
+                fail("Function '"+expr->name+"' does not exist.");
+                return TYPE_VOID;
+            }
+            out = function_names[fun] + "(";
+            for(int i=0;i<expr->arguments.size();i++) {
+                std::string arg;
+                TypeId type = generateExpression(expr->arguments[i], arg);
+                if(i != 0)
+                    out += ", ";
+                // void* is passed to other pointers and the other way around
+                if(i < fun->parameters.size() && type != fun->parameters[i].typeId)
+                    out += "(" + typeName(fun->parameters[i].typeId) + ")" + arg;
+                else
+                    out += arg;
+            }
+            out += ")";
+            return fun->return_type;
+        } break;
+        case ASTExpression::ADD:
+        case ASTExpression::SUB:
+        case ASTExpression::MUL:
+        case ASTExpression::DIV: {
+            std::string left, right;
+            TypeId ltype = generateExpression(expr->left, left);
+            TypeId rtype = generateExpression(expr->right, right);
+            const char* op = expr->kind() == ASTExpression::ADD ? "+" :
+                             expr->kind() == ASTExpression::SUB ? "-" :
+                             expr->kind() == ASTExpression::MUL ? "*" : "/";
+
+            // same type rules as GeneratorContext::generateExpression
+            TypeId out_type = ltype;
+            if(ltype == rtype) {
+
+            } else if((ltype == TYPE_INT && rtype.pointer_level()>0) || (rtype == TYPE_INT && ltype.pointer_level()>0)) {
+                out_type = rtype.pointer_level() ? rtype : ltype;
+            } else if((ltype == TYPE_INT || ltype == TYPE_CHAR) && (rtype == TYPE_INT || rtype == TYPE_CHAR)) {
+                out_type = TYPE_INT;
+            } else if((ltype == TYPE_INT || ltype == TYPE_FLOAT) && (rtype == TYPE_INT || rtype == TYPE_FLOAT)) {
+                out_type = TYPE_FLOAT;
+                out = "(" + floatValue(expr->left, ltype, left) + " " + op + " " + floatValue(expr->right, rtype, right) + ")";
+                return out_type;
+            } else {
+                fail("Cannot perform operation on the types '"+ast->nameOfType(ltype)+"', '"+ast->nameOfType(rtype)+"'.");
+                return TYPE_VOID;
+            }
+
+            if(out_type == TYPE_FLOAT) {
+                out = "(" + left + " " + op + " " + right + ")";
+                return out_type;
+            }
+            left = registerValue(expr->left, ltype, left);
+            right = registerValue(expr->right, rtype, right);
+            if(out_type.pointer_level() > 0) {
+                // pointer arithmetic is done in bytes, offsets are not scaled
+                out = "((" + typeName(out_type) + ")((intptr_t)" + left + " " + op + " (intptr_t)" + right + "))";
+            } else {
+                out = "(" + left + " " + op + " " + right + ")";
+            }
+            return out_type;
+        } break;
+        case ASTExpression::AND:
+        case ASTExpression::OR: {
+            // both sides are evaluated like in the bytecode
+            std::string left, right;
+            generateExpression(expr->left, left);
+            generateExpression(expr->right, right);
+            const char* op = expr->kind() == ASTExpression::AND ? "&" : "|";
+            out = "((tin_bool)(!!" + left + " " + op + " !!" + right + "))";
+            return TYPE_BOOL;
+        } break;
+        case ASTExpression::EQUAL:
+        case ASTExpression::NOT_EQUAL:
+        case ASTExpression::LESS:
+        case ASTExpression::GREATER:
+        case ASTExpression::LESS_EQUAL:
+        case ASTExpression::GREATER_EQUAL: {
+            std::string left, right;
+            TypeId ltype = generateExpression(expr->left, left);
+            TypeId rtype = generateExpression(expr->right, right);
+            if(!((ltype == TYPE_INT || ltype == TYPE_CHAR || ltype == TYPE_FLOAT) && (rtype == TYPE_INT || rtype == TYPE_CHAR || rtype == TYPE_FLOAT))) {
+                fail("Cannot perform operation on the types '"+ast->nameOfType(ltype)+"', '"+ast->nameOfType(rtype)+"'.");
+                return TYPE_VOID;
+            }
+            const char* op = nullptr;
+            switch(expr->kind()) {
+                case ASTExpression::EQUAL:         op = "=="; break;
+                case ASTExpression::NOT_EQUAL:     op = "!="; break;
+                case ASTExpression::LESS:          op = "<"; break;
+                case ASTExpression::GREATER:       op = ">"; break;
+                case ASTExpression::LESS_EQUAL:    op = "<="; break;
+                case ASTExpression::GREATER_EQUAL: op = ">="; break;
+                default: Assert(false);
+            }
+            if(ltype == TYPE_FLOAT || rtype == TYPE_FLOAT) {
+                left = floatValue(expr->left, ltype, left);
+                right = floatValue(expr->right, rtype, right);
+            } else if(ltype == TYPE_CHAR) {
+                left = "(int8_t)" + registerValue(expr->left, ltype, left);
+                right = "(int8_t)" + registerValue(expr->right, rtype, right);
+            } else {
+                left = registerValue(expr->left, ltype, left);
+                right = registerValue(expr->right, rtype, right);
+            }
+            out = "((tin_bool)(" + left + " " + op + " " + right + "))";
+            return TYPE_BOOL;
+        } break;
+        case ASTExpression::NOT: {
+            std::string left;
+            TypeId type = generateExpression(expr->left, left);
+            out = "((" + typeName(type) + ")!" + left + ")";
+            return type;
+        } break;
+        case ASTExpression::REFER: {
+            std::string left;
+            TypeId type = generateExpression(expr->left, left);
+            type.set_pointer_level(type.pointer_level() + 1);
+            out = "(&" + left + ")";
+            return type;
+        } break;
+        case ASTExpression::DEREF: {
+            std::string left;
+            TypeId type = generateExpression(expr->left, left);
+            if(type.pointer_level() == 0) {
+                fail("Cannot dereference non-pointer types.");
+                return TYPE_VOID;
+            }
+            type.set_pointer_level(type.pointer_level() - 1);
+            out = "(*" + left + ")";
+            return type;
+        } break;
+        case ASTExpression::MEMBER: {
+            std::string left;
+            TypeId type = generateExpression(expr->left, left);
+            if(type.pointer_level() > 1 || !type.valid()) {
+                fail("Member access does not work with '"+ast->nameOfType(type)+"'.");
+                return TYPE_VOID;
+            }
+            auto info = ast->getType(type.base());
+            auto mem = info->ast_struct ? info->ast_struct->findMember(expr->name) : nullptr;
+            if(!mem) {
+                fail("'"+expr->name+"' is not a member of '"+ast->nameOfType(type)+"'.");
+                return TYPE_VOID;
+            }
+            // pointers to structures are implicitly dereferenced
+            out = "(" + left + (type.pointer_level() == 1 ? "->" : ".") + local_name(mem->name) + ")";
+            return mem->typeId;
+        } break;
+        case ASTExpression::INDEX: {
+            std::string left, right;
+            TypeId ltype = generateExpression(expr->left, left);
+            TypeId rtype = generateExpression(expr->right, right);
+            if(ltype.pointer_level() == 0) {
+                fail("Index operator only works on pointers.");
+                return TYPE_VOID;
+            }
+            right = registerValue(expr->right, rtype, right);
+            ltype.set_pointer_level(ltype.pointer_level() - 1);
+            out = "(" + left + "[" + right + "])";
+            return ltype;
+        } break;
+        case ASTExpression::CAST: {
+            std::string left;
+            TypeId type = generateExpression(expr->left, left);
+            TypeId castType = expr->typeId;
+            if(!castType.valid()) {
+                fail("'"+expr->name+"' is not a type.");
+                return TYPE_VOID;
+            }
+            bool is_integer = type.pointer_level() == 0 && (type == TYPE_INT || type == TYPE_CHAR || type == TYPE_BOOL);
+            bool to_integer = castType.pointer_level() == 0 && (castType == TYPE_INT || castType == TYPE_CHAR || castType == TYPE_BOOL);
+            if(is_integer && to_integer) {
+                out = registerValue(expr->left, type, left);
+            } else if(is_integer && castType == TYPE_FLOAT) {
+                out = floatValue(expr->left, type, left);
+            } else if(type == TYPE_FLOAT && to_integer) {
+                // CAST_FLOAT_INT writes the low 32 bits of a register that held a float
+                out = "((tin_reg)(uint32_t)(tin_int)" + left + ")";
+            } else {
+                out = "((" + typeName(castType) + ")" + left + ")";
+            }
+            return castType;
+        } break;
+        case ASTExpression::SIZEOF: {
+            TypeId type = expr->typeId;
+            if(!type.valid()) {
+                fail("'"+expr->name+"' is not a type.");
+                return TYPE_INT;
+            }
+            out = std::to_string(ast->sizeOfType(type));
+            return TYPE_INT;
+        } break;
+        case ASTExpression::ASSIGN: {
+            std::string left, right;
+            TypeId rtype = generateExpression(expr->right, right);
+            TypeId ltype = generateExpression(expr->left, left);
+            if(rtype != ltype)
+                right = "(" + typeName(ltype) + ")" + right;
+            out = "(" + left + " = " + right + ")";
+            return ltype;
+        } break;
+        case ASTExpression::PRE_INCREMENT:
+        case ASTExpression::POST_INCREMENT:
+        case ASTExpression::PRE_DECREMENT:
+        case ASTExpression::POST_DECREMENT: {
+            std::string left;
+            TypeId type = generateExpression(expr->left, left);
+            switch(expr->kind()) {
+                case ASTExpression::PRE_INCREMENT:  out = "(++" + left + ")"; break;
+                case ASTExpression::POST_INCREMENT: out = "(" + left + "++)"; break;
+                case ASTExpression::PRE_DECREMENT:  out = "(--" + left + ")"; break;
+                case ASTExpression::POST_DECREMENT: out = "(" + left + "--)"; break;
+                default: Assert(false);
+            }
+            return type;
+        } break;
+        default: Assert(false);
+    }
+    return TYPE_VOID;
+}
+
+void CContext::generateBody(ASTBody* body) {
+    auto prev_scope = current_scopeId;
+    current_scopeId = body->scopeId;
+    defer {
+        current_scopeId = prev_scope;
+    };
+
+    for(auto stmt : body->statements) {
+        bool stop = false;
+        switch(stmt->kind()) {
+        case ASTStatement::EXPRESSION: {
+            std::string expr;
+            generateExpression(stmt->expression, expr);
+            line(expr + ";");
+        } break;
+        case ASTStatement::GLOBAL_DECLARATION:
+        case ASTStatement::CONST_DECLARATION: {
+            // globals are initialized in tin_main, constants are inlined where they are used
+        } break;
+        case ASTStatement::VAR_DECLARATION: {
+            TypeId type = stmt->declaration_typeId;
+            std::string declaration = typeName(type) + " " + local_name(stmt->declaration_name);
+            if(stmt->expression) {
+                std::string expr;
+                TypeId etype = generateExpression(stmt->expression, expr);
+                if(etype != type)
+                    expr = "(" + typeName(type) + ")" + expr;
+                line(declaration + " = " + expr + ";");
+            } else {
+                line(declaration + " = {0};");
+            }
+        } break;
+        case ASTStatement::WHILE:
+        case ASTStatement::IF: {
+            std::string expr;
+            generateExpression(stmt->expression, expr);
+            line(std::string(stmt->kind() == ASTStatement::WHILE ? "while" : "if") + "(" + expr + ") {");
+            indent++;
+            generateBody(stmt->body);
+            indent--;
+            if(stmt->elseBody) {
+                line("} else {");
+                indent++;
+                generateBody(stmt->elseBody);
+                indent--;
+            }
+            line("}");
+        } break;
+        case ASTStatement::BREAK: {
+            line("break;");
+            stop = true;
+        } break;
+        case ASTStatement::CONTINUE: {
+            line("continue;");
+            stop = true;
+        } break;
+        case ASTStatement::RETURN: {
+            if(stmt->expression) {
+                std::string expr;
+                generateExpression(stmt->expression, expr);
+                line("return " + expr + ";");
+            } else {
+                line("return;");
+            }
+            stop = true;
+        } break;
+        default: Assert(false);
+        }
+        if(stop)
+            break; // the rest of the statements are never executed
+    }
+}
+
+bool GenerateC(AST* ast, const std::string& path) {
+    ZoneScopedC(tracy::Color::Orange);
+    CContext context{};
+    context.ast = ast;
+    auto& out = context.output;
+
+    for(auto imp : ast->imports)
+        context.collect(imp);
+
+    ASTFunction* main_function = nullptr;
+    for(auto f : context.functions) {
+        if(f->name == "main" && f->body && !main_function)
+            main_function = f;
+    }
+    if(!main_function) {
+        log_color(RED);
+        printf("C backend: main was not found.\n");
+        log_color(NO_COLOR);
+        return false;
+    }
+
+    out += "// Generated by the tin compiler, link with runtime/tin_runtime.c\n";
+    out += "#include <stdint.h>\n";
+    out += "#include <string.h>\n\n";
+    out += "typedef int32_t tin_int;\n";
+    out += "typedef char tin_char;\n";
+    out += "typedef uint8_t tin_bool;\n";
+    out += "typedef float tin_float;\n";
+    out += "typedef int64_t tin_reg; // integers are computed in 64 bits like the registers of the virtual machine\n\n";
+
+    for(auto st : context.structures)
+        context.line("typedef struct " + context.struct_names[st] + " " + context.struct_names[st] + ";");
+    // members are placed at the offsets from GeneratorContext::generateStruct
+    context.line("#pragma pack(push, 1)");
+    for(auto st : context.structures)
+        context.generateStruct(st);
+    context.line("#pragma pack(pop)");
+    out += "\n";
+
+    for(auto& global : context.globals)
+        context.line("static " + context.typeName(global.id->type) + " " + context.global_names[global.id] + ";");
+    out += "\n";
+
+    for(auto f : context.functions) {
+        if(!f->is_native && f->reachable)
+            context.line("static " + context.functionSignature(f) + ";");
+    }
+    out += "\n";
+    for(auto f : context.functions) {
+        if(f->is_native)
+            context.generateNative(f);
+    }
+    out += "\n";
+
+    for(auto f : context.functions) {
+        if(f->is_native || !f->reachable)
+            continue; // unreachable functions weren't generated or checked
+        context.line("static " + context.functionSignature(f) + " {");
+        context.indent++;
+        context.generateBody(f->body);
+        context.indent--;
+        context.line("}");
+    }
+    out += "\n";
+
+    // globals are set before main like the <set-globals> part of the main piece
+    context.line("void tin_main(void) {");
+    context.indent++;
+    for(auto& global : context.globals) {
+        if(!global.stmt->expression)
+            continue; // zero initialized
+        context.current_scopeId = global.scopeId;
+        std::string expr;
+        context.generateExpression(global.stmt->expression, expr);
+        context.line(context.global_names[global.id] + " = " + expr + ";");
+    }
+    context.line(context.function_names[main_function] + "();");
+    context.indent--;
+    context.line("}");
+
+    if(context.failed)
+        return false;
+
+    std::ofstream file(path, std::ofstream::binary);
+    if(!file.is_open()) {
+        log_color(RED);
+        printf("C backend: Could not open '%s'.\n", path.c_str());
+        log_color(NO_COLOR);
+        return false;
+    }
+    file.write(out.data(), out.length());
+    file.close();
+    return true;
+}
@@ -15,6 +15,18 @@ u32 ThreadProc(void* arg) {
 bool CompileFile(CompilerOptions* options, Bytecode** out_bytecode) {
     Compiler compiler{};
     compiler.init();
+    compiler.options = options;
+    for(int i=0;i<options->natives.size();i++) {
+        auto f = compiler.ast->addHostNative(options->natives[i].signature, i);
+        if(!f || !options->natives[i].function) {
+            log_color(RED);
+            printf("Native function '%s' has an invalid signature or no function pointer.\n", options->natives[i].signature.c_str());
+            log_color(NO_COLOR);
+            return false;
+        }
+        compiler.bytecode->host_natives.push_back(options->natives[i]);
+        compiler.bytecode->host_natives.back().name = f->name;
+    }
     #ifdef ENABLE_MULTITHREADING
     if(options->thread_count == 1) {
         log_color(RED);
@@ -81,6 +93,10 @@ bool CompileFile(CompilerOptions* options, Bytecode** out_bytecode) {
         delete t;
     }
     threads.clear();
+
+    // Needs every piece to be generated
+    if(compiler.reporter->errors == 0)
+        InlineCalls(compiler.bytecode, options->optimization_passes, &compiler.optimization_stats);
     
     double time = StopMeasure(start_time);
 
@@ -144,14 +160,12 @@ bool CompileFile(CompilerOptions* options, Bytecode** out_bytecode) {
             printf("%.2f MB/s", bytes_per_sec / 1024.f / 1024);
         printf("\n");
     }
+    if(options->print_optimization_stats) {
+        compiler.optimization_stats.print(options->optimization_passes);
+    }
     
     if(options->run && !out_bytecode) {
-        VirtualMachine* interpreter = new VirtualMachine();
-        interpreter->bytecode = compiler.bytecode;
-        interpreter->init();
-        interpreter->execute();
-        
-        delete interpreter;
+        RunBytecode(compiler.bytecode, options);
         return nullptr;
     }
 
@@ -169,6 +183,51 @@ bool CompileFile(CompilerOptions* options, Bytecode** out_bytecode) {
     return true;
 }
 
+void RunBytecode(Bytecode* bytecode, CompilerOptions* options) {
+    // Every virtual machine has its own stack, heap and global data.
+    // The bytecode is finalized once and shared between them.
+    bytecode->finalize();
+    std::vector<VirtualMachine*> interpreters;
+    for(int i=0;i<options->vm_count;i++) {
+        VirtualMachine* interpreter = new VirtualMachine();
+        interpreter->bytecode = bytecode;
+        interpreter->enable_jit = options->jit;
+        interpreter->check_memory = !options->unchecked;
+        interpreter->stack_size = options->stack_size;
+        interpreter->init();
+        interpreters.push_back(interpreter);
+    }
+    VMProfiler profiler{};
+    if(!options->profile_output.empty())
+        interpreters[0]->profiler = &profiler; // only the first machine when there are several
+    VMStats* stats = nullptr; // large, only allocated when used
+    if(options->vm_stats) {
+        stats = new VMStats();
+        interpreters[0]->stats = stats;
+    }
+    if(interpreters.size() == 1) {
+        interpreters[0]->execute();
+    } else {
+        auto proc = [](void* arg) -> u32 {
+            ((VirtualMachine*)arg)->execute();
+            return 0;
+        };
+        std::vector<Thread> threads(interpreters.size());
+        for(int i=0;i<interpreters.size();i++)
+            threads[i].init(proc, interpreters[i]);
+        for(int i=0;i<interpreters.size();i++)
+            threads[i].join();
+    }
+    if(!options->profile_output.empty() && !profiler.write_collapsed_stacks(bytecode, options->profile_output)) {
+        log_color(RED);
+        printf("Could not write profile to '%s'\n", options->profile_output.c_str());
+        log_color(NO_COLOR);
+    }
+    for(auto interpreter : interpreters)
+        delete interpreter;
+    delete stats;
+}
+
 void Compiler::processTasks() {
 #ifdef ENABLE_HIGH_PRIORITY_PROCESS
     SetHighThreadPriority();
@@ -189,6 +248,12 @@ void Compiler::processTasks() {
         MUTEX_LOCK(tasks_lock)
         is_signaled = false;
         
+        bool checking = checks_processing != 0;
+        for(auto& task : tasks) {
+            if(task.type != TASK_GEN_FUNCTIONS)
+                checking = true;
+        }
+
         int task_index=-1;
         for(int i=0;i<tasks.size();i++) {
             auto& task = tasks[i];   
@@ -197,6 +262,8 @@ void Compiler::processTasks() {
                 // printf("Not ready %d/%d: %s\n", task.imp->deps_now, task.imp->deps_count, task.name.c_str());
                 continue; // not ready
             }
+            if(task.type == TASK_GEN_FUNCTIONS && checking)
+                continue; // calls into other imports need them checked, so does RemoveDeadCode
 
             task_index = i;
             break;
@@ -236,6 +303,15 @@ void Compiler::processTasks() {
         tasks.erase(tasks.begin() + task_index);
         
         atomic_add(&threads_processing, 1);
+        bool is_check = task.type != TASK_GEN_FUNCTIONS; // the type changes when the next step is queued
+        if(is_check)
+            checks_processing++;
+        if(task.type == TASK_GEN_FUNCTIONS && !dead_code_removed) {
+            // no other thread is working on the AST
+            if(options->remove_dead_code)
+                RemoveDeadCode(ast, options->remove_unreachable_functions);
+            dead_code_removed = true;
+        }
 
         if(tasks.size() && !is_signaled) {
             is_signaled = true;
@@ -376,8 +452,15 @@ void Compiler::processTasks() {
                 
                 int prev_pieces = bytecode->pieces_unsafe().size();
 
-                for(auto func : task.imp->body->functions)
-                    GenerateFunction(ast, func, bytecode, reporter);
+                for(auto func : task.imp->body->functions) {
+                    if(!func->reachable)
+                        continue;
+                    if(options->fold_constants)
+                        FoldConstants(ast, func);
+                    GenerateFunction(ast, func, bytecode, reporter, options->use_ir, options->ir_passes);
+                    if(!func->is_native && reporter->errors == 0)
+                        OptimizePiece(bytecode->getPiece(func->piece_code_index), options->optimization_passes, &optimization_stats);
+                }
                 
                 #ifdef DEBUG_BYTECODE
                 if(bytecode->pieces_unsafe().size() != prev_pieces) {
@@ -398,6 +481,8 @@ void Compiler::processTasks() {
         
         MUTEX_LOCK(tasks_lock);
         atomic_add(&threads_processing, -1);
+        if(is_check)
+            checks_processing--;
         if(queue_task) {
             tasks.push_back(task);
             
@@ -1,20 +1,64 @@
 #include "Generator.h"
+#include "IR.h"
 
 #define LOCATION log_color(GRAY); printf("%s:%d\n",__FILE__,__LINE__); log_color(NO_COLOR);
 #define REPORT(L, ...) LOCATION reporter->err(current_stream, L, __VA_ARGS__)
 
+// Structs with more leaves than this are kept on the stack as one block in
+// memory layout (size rounded up to 8) and moved with memcpy. Smaller structs
+// use one stack slot per leaf.
+static const int BLOCK_COPY_LEAVES = 2;
+
+// Puts reg + offset in REG_C unless the offset is zero
+static Register emit_address(BytecodePiece* piece, Register reg, int offset) {
+    if(offset == 0)
+        return reg;
+    Assert(reg != REG_C);
+    if(offset == (i16)offset) {
+        piece->emit_mov_rr(REG_C, reg);
+        piece->emit_incr(REG_C, offset);
+    } else {
+        piece->emit_li(REG_C, offset);
+        piece->emit_add(REG_C, reg);
+    }
+    return REG_C;
+}
+
+// INCR holds a 16-bit immediate, larger adjustments of the stack go through scratch
+static void emit_incr_sp(BytecodePiece* piece, int amount, Register scratch) {
+    if(amount == (i16)amount) {
+        piece->emit_incr(REG_SP, amount);
+    } else {
+        piece->emit_li(scratch, amount);
+        piece->emit_add(REG_SP, scratch);
+        piece->virtual_sp += amount;
+    }
+}
 void GeneratorContext::generatePop(Register reg, int offset, TypeId type) {
     if(type == TYPE_VOID) return;
-    int size = ast->sizeOfType(type);
     TypeInfo* info = nullptr;
     if(type.pointer_level() > 0 || (info = ast->getType(type), !info->ast_struct)) {
+        int size = ast->sizeOfType(type);
         piece->emit_pop(REG_A);
         if(reg != REG_INVALID)
             piece->emit_mov_mr_disp(reg, REG_A, size, offset);
     } else {
-        for(int i=info->ast_struct->members.size()-1;i>=0;i--) {
-            auto& mem = info->ast_struct->members[i];
-            generatePop(reg, offset + mem.offset, mem.typeId);
+        auto& leaves = info->ast_struct->leaves;
+        if(leaves.size() > BLOCK_COPY_LEAVES) {
+            int size = ast->sizeOfType(type);
+            if(reg != REG_INVALID)
+                piece->emit_memcpy(emit_address(piece, reg, offset), REG_SP, size);
+            emit_incr_sp(piece, (size + 7) & ~7, REG_D);
+            return;
+        }
+        if(reg == REG_INVALID && leaves.size() > 1) {
+            piece->emit_incr(REG_SP, leaves.size() * 8);
+            return;
+        }
+        for(int i=leaves.size()-1;i>=0;i--) {
+            piece->emit_pop(REG_A);
+            if(reg != REG_INVALID)
+                piece->emit_mov_mr_disp(reg, REG_A, leaves[i].size, offset + leaves[i].offset);
         }
     }
 }
@@ -40,15 +84,21 @@ bool GeneratorContext::performCast(TypeId ltype, TypeId rtype) {
     return false;
 }
 void GeneratorContext::generatePush(Register reg, int offset, TypeId type) {
-    int size = ast->sizeOfType(type);
     TypeInfo* info = nullptr;
     if(type.pointer_level() > 0 || (info = ast->getType(type), !info->ast_struct)) {
+        int size = ast->sizeOfType(type);
         piece->emit_mov_rm_disp(REG_A, reg, size, offset);
         piece->emit_push(REG_A);
+    } else if(info->ast_struct->leaves.size() > BLOCK_COPY_LEAVES) {
+        int size = ast->sizeOfType(type);
+        Register src = emit_address(piece, reg, offset);
+        Assert(src != REG_D);
+        emit_incr_sp(piece, -((size + 7) & ~7), REG_D);
+        piece->emit_memcpy(REG_SP, src, size);
     } else {
-        for(int i=0;i<info->ast_struct->members.size();i++) {
-            auto& mem = info->ast_struct->members[i];
-            generatePush(reg, offset + mem.offset, mem.typeId);
+        for(auto& leaf : info->ast_struct->leaves) {
+            piece->emit_mov_rm_disp(REG_A, reg, leaf.size, offset + leaf.offset);
+            piece->emit_push(REG_A);
         }
     }
 }
@@ -217,6 +267,79 @@ TypeId GeneratorContext::generateReference(ASTExpression* expr) {
     piece->emit_push(REG_B); // push pointer
     return type;
 }
+bool GeneratorContext::generateArguments(ASTExpression* expr, ASTFunction* fun) {
+    Assert(fun->reachable); // RemoveDeadCode marks every function that is called
+    piece->emit_incr(REG_SP, -fun->parameters_size);
+    int arg_offset = piece->virtual_sp;
+
+    std::vector<TypeId> argument_types;
+    for(int i=0;i<expr->arguments.size(); i++) {
+        auto arg = expr->arguments[i];
+        auto type = generateExpression(arg);
+        argument_types.push_back(type);
+    }
+
+    if(fun->parameters.size() != argument_types.size()) {
+        REPORT(expr->location, std::string() + "The function call has " + std::to_string(argument_types.size()) + " arguments but the function '"+expr->name+"' requires " + std::to_string(fun->parameters.size()) + ".");
+        return false;
+    }
+    bool fail=false;
+    auto pvoid = TypeId::Make(TYPE_VOID, 1);
+    for(int i=0;i<argument_types.size();i++) {
+        auto& ltype = fun->parameters[i].typeId;
+        auto& rtype = argument_types[i];
+        // TODO: Auto casting?
+        if(ltype == rtype) {
+
+        } else if((ltype == pvoid && rtype.pointer_level() == 1) || (ltype.pointer_level() == 1 && rtype == pvoid) ) {
+
+        } else {
+            fail = true;
+            REPORT(expr->location, std::string() + "The "+std::to_string(i)+" argument is of type '"+ast->nameOfType(argument_types[i])+"' but the parameter '" + fun->parameters[i].name + "' requires '" + ast->nameOfType(fun->parameters[i].typeId) + "'.");
+        }
+    }
+    if(fail)
+        return false;
+
+    int arg_diff = piece->virtual_sp - arg_offset;
+
+    piece->emit_mov_rr(REG_B, REG_SP);
+    for(int i=fun->parameters.size()-1;i>=0; i--) {
+        auto& param = fun->parameters[i];
+        
+        generatePop(REG_B, param.offset - 16 - arg_diff, param.typeId);
+    }
+    return true;
+}
+ASTFunction* GeneratorContext::findTailCallee(ASTExpression* expr) {
+    // main returns to the virtual machine and a taken address may point into the frame
+    if(expr->kind() != ASTExpression::FUNCTION_CALL || takes_address || function->name == "main")
+        return nullptr;
+    auto fun = ast->findFunction(expr->name, current_scopeId);
+    if(!fun || fun->is_native || !function->return_type.valid() || !(fun->return_type == function->return_type))
+        return nullptr;
+    // the arguments are copied over our parameters, mistakes are reported by a normal call
+    if(fun->parameters_size > function->parameters_size || fun->parameters.size() != expr->arguments.size())
+        return nullptr;
+    return fun;
+}
+bool GeneratorContext::generateTailCall(ASTExpression* expr, ASTFunction* fun) {
+    if(!generateArguments(expr, fun))
+        return false;
+    if(fun->parameters_size != 0)
+        piece->emit_memcpy(emit_address(piece, REG_BP, 16), REG_SP, fun->parameters_size);
+    // sp is at bp like before ret, the return value is written by the callee
+    piece->emit_incr(REG_SP, fun->parameters_size - current_frameOffset);
+    if(fun == function) {
+        piece->emit_jmp(0);
+    } else {
+        int relocation_index = 0;
+        piece->emit_tailcall(&relocation_index);
+        piece->addRelocation(fun, relocation_index);
+    }
+    tail_call_end_pc = piece->get_pc();
+    return true;
+}
 TypeId GeneratorContext::generateExpression(ASTExpression* expr) {
     ZoneScopedC(tracy::Color::Blue2);
     Assert(expr);
@@ -299,47 +422,9 @@ TypeId GeneratorContext::generateExpression(ASTExpression* expr) {
                 return TYPE_VOID;
             }
 
-            piece->emit_incr(REG_SP, -fun->parameters_size);
-            int arg_offset = piece->virtual_sp;
-
-            std::vector<TypeId> argument_types;
-            for(int i=0;i<expr->arguments.size(); i++) {
-                auto arg = expr->arguments[i];
-                auto type = generateExpression(arg);
-                argument_types.push_back(type);
-            }
-
-            if(fun->parameters.size() != argument_types.size()) {
-                REPORT(expr->location, std::string() + "The function call has " + std::to_string(argument_types.size()) + " arguments but the function '"+expr->name+"' requires " + std::to_string(fun->parameters.size()) + ".");
-                return TYPE_VOID;
-            }
-            bool fail=false;
-            auto pvoid = TypeId::Make(TYPE_VOID, 1);
-            for(int i=0;i<argument_types.size();i++) {
-                auto& ltype = fun->parameters[i].typeId;
-                auto& rtype = argument_types[i];
-                // TODO: Auto casting?
-                if(ltype == rtype) {
-
-                } else if((ltype == pvoid && rtype.pointer_level() == 1) || (ltype.pointer_level() == 1 && rtype == pvoid) ) {
-
-                } else {
-                    fail = true;
-                    REPORT(expr->location, std::string() + "The "+std::to_string(i)+" argument is of type '"+ast->nameOfType(argument_types[i])+"' but the parameter '" + fun->parameters[i].name + "' requires '" + ast->nameOfType(fun->parameters[i].typeId) + "'.");
-                }
-            }
-            if(fail)
+            if(!generateArguments(expr, fun))
                 return TYPE_VOID;
 
-            int arg_diff = piece->virtual_sp - arg_offset;
-
-            piece->emit_mov_rr(REG_B, REG_SP);
-            for(int i=fun->parameters.size()-1;i>=0; i--) {
-                auto& param = fun->parameters[i];
-                
-                generatePop(REG_B, param.offset - 16 - arg_diff, param.typeId);
-            }
-
             // piece->emit_mov_rm_disp(REG_A, REG_B, 4, 16);
             // piece->emit_mov_rm_disp(REG_A, REG_B, 8, 24);
             // piece->emit_mov_rm_disp(REG_A, REG_B, 8, 32);
@@ -382,7 +467,7 @@ TypeId GeneratorContext::generateExpression(ASTExpression* expr) {
             
             if(expr->kind() == ASTExpression::ADD || expr->kind() == ASTExpression::SUB || expr->kind() == ASTExpression::MUL || expr->kind() == ASTExpression::DIV) {
                 if(ltype == rtype) {
-                    
+                    is_float = ltype == TYPE_FLOAT;
                 } else if((ltype == TYPE_INT && rtype.pointer_level()>0) || (rtype == TYPE_INT && ltype.pointer_level()>0)) {
                     if(rtype.pointer_level())
                         out_type = rtype;
@@ -411,6 +496,7 @@ TypeId GeneratorContext::generateExpression(ASTExpression* expr) {
             } else if(expr->kind() == ASTExpression::NOT_EQUAL || expr->kind() == ASTExpression::EQUAL || expr->kind() == ASTExpression::LESS || expr->kind() == ASTExpression::GREATER || expr->kind() == ASTExpression::LESS_EQUAL || expr->kind() == ASTExpression::GREATER_EQUAL) {
                 if((ltype == TYPE_INT || ltype == TYPE_CHAR || ltype == TYPE_FLOAT) && (rtype == TYPE_INT || rtype == TYPE_CHAR || rtype == TYPE_FLOAT)) {
                     out_type = TYPE_BOOL;
+                    is_float = ltype == TYPE_FLOAT || rtype == TYPE_FLOAT;
                 } else {
                     if(reporter->errors == 0 || (ltype != TYPE_VOID && rtype != TYPE_VOID)) {
                         REPORT(expr->location, "Cannot perform operation on the types '"+ast->nameOfType(ltype)+"', '"+ast->nameOfType(rtype)+"'.");
@@ -519,7 +605,7 @@ TypeId GeneratorContext::generateExpression(ASTExpression* expr) {
         }
         case ASTExpression::CAST: {
             TypeId type = generateExpression(expr->left);
-            TypeId castType = ast->convertFullType(expr->name, current_scopeId);
+            TypeId castType = expr->typeId;
             
             if(type == castType) {
                 return castType; // casting to the same type is okay, unnecessary, but okay
@@ -553,7 +639,7 @@ TypeId GeneratorContext::generateExpression(ASTExpression* expr) {
             break;   
         }
         case ASTExpression::SIZEOF: {
-            TypeId type = ast->convertFullType(expr->name, current_scopeId);
+            TypeId type = expr->typeId;
             if(!type.valid()) {
                 REPORT(expr->location, "'"+expr->name+"' is not a type.");
                 return TYPE_INT;
@@ -697,7 +783,7 @@ bool GeneratorContext::generateBody(ASTBody* body) {
             generatePop(REG_INVALID, 0, type);
         } break;   
         case ASTStatement::GLOBAL_DECLARATION: {
-            auto type = ast->convertFullType(stmt->declaration_type, current_scopeId);
+            auto type = stmt->declaration_typeId;
             if(!type.valid()) {
                 REPORT(stmt->location, "Invalid type '"+stmt->declaration_type+"'.");
                 // failure = true;
@@ -718,7 +804,7 @@ bool GeneratorContext::generateBody(ASTBody* body) {
             }
         } break;
         case ASTStatement::CONST_DECLARATION: {
-            auto type = ast->convertFullType(stmt->declaration_type, current_scopeId);
+            auto type = stmt->declaration_typeId;
             if(!type.valid()) {
                 REPORT(stmt->location, "Type in declaration is not a valid type.");
                 return false;
@@ -732,7 +818,7 @@ bool GeneratorContext::generateBody(ASTBody* body) {
             variable->statement = stmt;
         } break;
         case ASTStatement::VAR_DECLARATION: {
-            auto type = ast->convertFullType(stmt->declaration_type, current_scopeId);
+            auto type = stmt->declaration_typeId;
             if(!type.valid()) {
                 REPORT(stmt->location, "Invalid type in declaration.");
                 return false;
@@ -858,25 +944,31 @@ bool GeneratorContext::generateBody(ASTBody* body) {
             }
         } break;
         case ASTStatement::RETURN: {
-            if(stmt->expression) {
-                if(!function->return_type.valid()) {
-                    REPORT(stmt->location, "Function does not have a return value but you specified one here.");
+            ASTFunction* tail_callee = stmt->expression ? findTailCallee(stmt->expression) : nullptr;
+            if(tail_callee) {
+                if(!generateTailCall(stmt->expression, tail_callee))
                     return false;
-                }
-                auto type = generateExpression(stmt->expression);
+            } else {
+                if(stmt->expression) {
+                    if(!function->return_type.valid()) {
+                        REPORT(stmt->location, "Function does not have a return value but you specified one here.");
+                        return false;
+                    }
+                    auto type = generateExpression(stmt->expression);
                 
-                if(!performCast(type, function->return_type)) {
-                    REPORT(stmt->location, "Type '"+ast->nameOfType(type)+"' in return statement does not match return type '"+ast->nameOfType(function->return_type)+"' of the function.");
-                    return false;
-                }
+                    if(!performCast(type, function->return_type)) {
+                        REPORT(stmt->location, "Type '"+ast->nameOfType(type)+"' in return statement does not match return type '"+ast->nameOfType(function->return_type)+"' of the function.");
+                        return false;
+                    }
                 
-                // piece->emit_mov_rr(REG_B, REG_BP);
-                generatePop(REG_BP, function->return_offset, type);
-            }
-            if(current_frameOffset != 0) {
-                piece->emit_incr(REG_SP, - (current_frameOffset));
+                    // piece->emit_mov_rr(REG_B, REG_BP);
+                    generatePop(REG_BP, function->return_offset, type);
+                }
+                if(current_frameOffset != 0) {
+                    piece->emit_incr(REG_SP, - (current_frameOffset));
+                }
+                piece->emit_ret();
             }
-            piece->emit_ret();
             
             stop = true; // return statement makes the rest of the statments useless
             if(stop)
@@ -956,6 +1048,22 @@ bool GeneratorContext::generateStruct(ASTStructure* astStruct) {
 
     offset = (offset + (alignment-1)) & ~(alignment-1);
 
+    // flatten the layout so that pushing and popping the struct doesn't need to recurse
+    astStruct->leaves.clear();
+    astStruct->member_index.clear();
+    for(int j=0;j<astStruct->members.size();j++) {
+        auto& mem = astStruct->members[j];
+        astStruct->member_index.emplace(mem.name, j); // the first member wins if names repeat
+        TypeInfo* info = nullptr;
+        if(mem.typeId.pointer_level() > 0 || (info = ast->getType(mem.typeId), !info->ast_struct)) {
+            astStruct->leaves.push_back({ mem.offset, ast->sizeOfType(mem.typeId) });
+        } else {
+            Assert(info->ast_struct->complete);
+            for(auto& leaf : info->ast_struct->leaves)
+                astStruct->leaves.push_back({ mem.offset + leaf.offset, leaf.size });
+        }
+    }
+
     astStruct->typeInfo->size = offset;
     astStruct->complete = true;
     return true;
@@ -993,6 +1101,35 @@ bool CheckStructs(AST* ast, AST::Import* imp, Reporter* reporter, bool* changed,
     return !failure;
 }
 
+void GeneratorContext::resolveTypes(ASTExpression* expr, ScopeId scopeId) {
+    if(!expr)
+        return;
+    if(expr->kind() == ASTExpression::CAST || expr->kind() == ASTExpression::SIZEOF)
+        expr->typeId = ast->convertFullType(expr->name, scopeId);
+    
+    resolveTypes(expr->left, scopeId);
+    resolveTypes(expr->right, scopeId);
+    for(auto arg : expr->arguments)
+        resolveTypes(arg, scopeId);
+}
+void GeneratorContext::resolveTypes(ASTBody* body) {
+    for(auto stmt : body->statements) {
+        switch(stmt->kind()) {
+        case ASTStatement::VAR_DECLARATION:
+        case ASTStatement::GLOBAL_DECLARATION:
+        case ASTStatement::CONST_DECLARATION:
+            stmt->declaration_typeId = ast->convertFullType(stmt->declaration_type, body->scopeId);
+            break;
+        default: break;
+        }
+        resolveTypes(stmt->expression, body->scopeId);
+        if(stmt->body)
+            resolveTypes(stmt->body);
+        if(stmt->elseBody)
+            resolveTypes(stmt->elseBody);
+    }
+}
+
 bool CheckFunction(AST* ast, AST::Import* imp, ASTFunction* function, Reporter* reporter) {
     ZoneScopedC(tracy::Color::Green3);
     GeneratorContext context{};
@@ -1042,6 +1179,10 @@ bool CheckFunction(AST* ast, AST::Import* imp, ASTFunction* function, Reporter*
             function->return_offset = -size;
         }
     }
+    
+    // types in the body are resolved here, errors are reported when generating
+    if(function->body)
+        context.resolveTypes(function->body);
     return true;
 }
 bool CheckGlobals(AST* ast, AST::Import* imp, Bytecode* bytecode, Reporter* reporter) {
@@ -1072,10 +1213,31 @@ bool CheckGlobals(AST* ast, AST::Import* imp, Bytecode* bytecode, Reporter* repo
             // if(stmt->elseBody) {
             //     check_bodies.push_back(stmt->elseBody);
             // }
+            if(stmt->kind() == ASTStatement::CONST_DECLARATION) {
+                // like constants in functions, the expression is generated where the constant is used
+                auto type = ast->convertFullType(stmt->declaration_type, current_scopeId);
+                stmt->declaration_typeId = type;
+                context.resolveTypes(stmt->expression, current_scopeId);
+                if(!type.valid()) {
+                    REPORT(stmt->location, "Type in declaration is not a valid type.");
+                    failure = true;
+                    break;
+                }
+                auto id = ast->addVariable(Identifier::CONST_ID, stmt->declaration_name, current_scopeId, type, 0);
+                if(!id) {
+                    REPORT(stmt->location, std::string() + "Constant '" + stmt->declaration_name + "' is already declared as a variable or constant.");
+                    failure = true;
+                    break;
+                }
+                id->statement = stmt;
+                continue;
+            }
             if(stmt->kind() != ASTStatement::GLOBAL_DECLARATION)
                 continue;
             
             auto type = ast->convertFullType(stmt->declaration_type, current_scopeId);
+            stmt->declaration_typeId = type;
+            context.resolveTypes(stmt->expression, current_scopeId);
             if(!type.valid()) {
                 REPORT(stmt->location, "Invalid type '"+stmt->declaration_type+"'.");
                 failure = true;
@@ -1096,7 +1258,26 @@ bool CheckGlobals(AST* ast, AST::Import* imp, Bytecode* bytecode, Reporter* repo
     }
     return !failure;
 }
-void GenerateFunction(AST* ast, ASTFunction* function, Bytecode* bytecode, Reporter* reporter) {
+static bool has_refer(ASTExpression* expr) {
+    if(!expr)
+        return false;
+    if(expr->kind() == ASTExpression::REFER || has_refer(expr->left) || has_refer(expr->right))
+        return true;
+    for(auto arg : expr->arguments) {
+        if(has_refer(arg))
+            return true;
+    }
+    return false;
+}
+static bool has_refer(ASTBody* body) {
+    for(auto stmt : body->statements) {
+        if(has_refer(stmt->expression) || (stmt->body && has_refer(stmt->body)) || (stmt->elseBody && has_refer(stmt->elseBody)))
+            return true;
+    }
+    return false;
+}
+
+void GenerateFunction(AST* ast, ASTFunction* function, Bytecode* bytecode, Reporter* reporter, bool use_ir, u32 ir_passes) {
     ZoneScopedC(tracy::Color::Blue2);
     if(function->is_native)
         return; // native funcs can't be generated
@@ -1111,8 +1292,10 @@ void GenerateFunction(AST* ast, ASTFunction* function, Bytecode* bytecode, Repor
     function->piece_code_index = context.piece->piece_index;
     
     context.piece->name = function->name;
+    context.piece->function = function;
     context.piece->virtual_sp = 0;
     context.current_stream = function->origin_stream;
+    context.takes_address = has_refer(function->body);
     auto current_stream = context.current_stream;
 
     if(function->name == "main") {
@@ -1182,10 +1365,24 @@ void GenerateFunction(AST* ast, ASTFunction* function, Bytecode* bytecode, Repor
         // function->return_offset = -size;
     }
     
+    if(use_ir && !context.takes_address) {
+        IRFunction* ir = BuildIR(&context);
+        if(ir) {
+            OptimizeIR(ir, ir_passes);
+            #ifdef DEBUG_IR
+            ir->print();
+            #endif
+            LowerIR(ir, &context);
+            delete ir;
+            return;
+        }
+    }
+    
     context.generateBody(function->body);
  
     // Emit ret instruction if the user forgot the return statement
-    if(context.piece->instructions.size() > 0 && context.piece->instructions.back().opcode != INST_RET) {
+    if(context.piece->instructions.size() > 0 && context.piece->instructions.back().opcode != INST_RET
+        && context.tail_call_end_pc != context.piece->get_pc()) {
         if(function->return_type != TYPE_VOID) {
             REPORT(function->location, "Missing return statement. They are mandatory if the function has a return type.");
         }
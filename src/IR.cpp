@@ -0,0 +1,2228 @@
+#include "IR.h"
+#include "Generator.h"
+
+const char* ir_op_names[] {
+    "const",    // IR_CONST
+    "param",    // IR_PARAM
+    "dataptr",  // IR_DATAPTR
+    "load",     // IR_LOAD
+    "store",    // IR_STORE
+    "binary",   // IR_BINARY
+    "not",      // IR_NOT
+    "cast",     // IR_CAST
+    "trunc",    // IR_TRUNC
+    "phi",      // IR_PHI
+    "call",     // IR_CALL
+    "jump",     // IR_JUMP
+    "branch",   // IR_BRANCH
+    "return",   // IR_RETURN
+    "tailcall", // IR_TAILCALL
+};
+
+IRFunction::~IRFunction() {
+    for(auto inst : insts)
+        delete inst;
+    for(auto block : blocks)
+        delete block;
+    for(auto block : dropped_blocks)
+        delete block;
+}
+IRInst* IRFunction::create(IROp op, TypeId type) {
+    auto inst = new IRInst();
+    inst->id = insts.size();
+    inst->op = op;
+    inst->type = type;
+    insts.push_back(inst);
+    return inst;
+}
+IRBlock* IRFunction::createBlock() {
+    auto block = new IRBlock();
+    block->id = next_block_id++;
+    blocks.push_back(block);
+    return block;
+}
+void IRFunction::addEdge(IRBlock* from, IRBlock* to) {
+    from->succs.push_back(to);
+    to->preds.push_back(from);
+}
+static IRInst* final_value(IRInst* v) {
+    while(v->replaced_by)
+        v = v->replaced_by;
+    return v;
+}
+void IRFunction::resolve() {
+    for(auto block : blocks) {
+        for(auto inst : block->insts) {
+            for(auto& arg : inst->args)
+                arg = final_value(arg);
+        }
+    }
+    // blocks control can't reach, their edges and the phi arguments of those edges
+    std::vector<bool> reachable(next_block_id, false);
+    std::vector<IRBlock*> stack;
+    stack.push_back(blocks[0]);
+    reachable[blocks[0]->id] = true;
+    while(stack.size()) {
+        auto block = stack.back();
+        stack.pop_back();
+        for(auto succ : block->succs) {
+            if(!reachable[succ->id]) {
+                reachable[succ->id] = true;
+                stack.push_back(succ);
+            }
+        }
+    }
+    int head = 0;
+    for(int i=0;i<blocks.size();i++) {
+        auto block = blocks[i];
+        if(reachable[block->id]) {
+            blocks[head++] = block;
+            continue;
+        }
+        for(auto succ : block->succs) {
+            for(int k=0;k<succ->preds.size();k++) {
+                if(succ->preds[k] != block)
+                    continue;
+                succ->preds.erase(succ->preds.begin() + k);
+                for(auto inst : succ->insts) {
+                    if(inst->op == IR_PHI)
+                        inst->args.erase(inst->args.begin() + k);
+                }
+                k--;
+            }
+        }
+        for(auto inst : block->insts)
+            inst->removed = true;
+        block->insts.clear();
+        block->succs.clear();
+        dropped_blocks.push_back(block);
+    }
+    blocks.resize(head);
+    for(auto block : blocks) {
+        int count = 0;
+        for(auto inst : block->insts) {
+            if(!inst->removed)
+                block->insts[count++] = inst;
+        }
+        block->insts.resize(count);
+    }
+}
+void IRFunction::analyze() {
+    // reverse postorder, successors are visited last to first so that the
+    // first successor (then and loop bodies) is laid out right after its block
+    std::vector<IRBlock*> post;
+    std::vector<bool> visited(next_block_id, false);
+    std::vector<std::pair<IRBlock*, int>> stack;
+    stack.push_back({blocks[0], (int)blocks[0]->succs.size() - 1});
+    visited[blocks[0]->id] = true;
+    while(stack.size()) {
+        auto& top = stack.back();
+        if(top.second < 0) {
+            post.push_back(top.first);
+            stack.pop_back();
+            continue;
+        }
+        auto succ = top.first->succs[top.second--];
+        if(!visited[succ->id]) {
+            visited[succ->id] = true;
+            stack.push_back({succ, (int)succ->succs.size() - 1});
+        }
+    }
+    order.assign(post.rbegin(), post.rend());
+    for(auto block : blocks) {
+        block->rpo = -1;
+        block->idom = nullptr;
+        block->loop_depth = 0;
+    }
+    for(int i=0;i<order.size();i++)
+        order[i]->rpo = i;
+
+    // dominators, "A Simple, Fast Dominance Algorithm" by Cooper, Harvey and Kennedy
+    auto entry = order[0];
+    entry->idom = entry;
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(int i=1;i<order.size();i++) {
+            auto block = order[i];
+            IRBlock* idom = nullptr;
+            for(auto pred : block->preds) {
+                if(pred->rpo == -1 || !pred->idom)
+                    continue;
+                if(!idom) {
+                    idom = pred;
+                    continue;
+                }
+                auto a = pred, b = idom;
+                while(a != b) {
+                    while(a->rpo > b->rpo) a = a->idom;
+                    while(b->rpo > a->rpo) b = b->idom;
+                }
+                idom = a;
+            }
+            if(idom != block->idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+    entry->idom = nullptr;
+
+    // natural loops of the back edges
+    std::vector<bool> in_loop(next_block_id);
+    std::vector<IRBlock*> work;
+    for(auto latch : order) {
+        for(auto header : latch->succs) {
+            if(!dominates(header, latch))
+                continue;
+            in_loop.assign(next_block_id, false);
+            in_loop[header->id] = true;
+            header->loop_depth++;
+            work.push_back(latch);
+            while(work.size()) {
+                auto block = work.back();
+                work.pop_back();
+                if(in_loop[block->id])
+                    continue;
+                in_loop[block->id] = true;
+                block->loop_depth++;
+                for(auto pred : block->preds)
+                    work.push_back(pred);
+            }
+        }
+    }
+}
+bool IRFunction::dominates(IRBlock* a, IRBlock* b) {
+    while(b) {
+        if(a == b)
+            return true;
+        b = b->idom;
+    }
+    return false;
+}
+void IRFunction::print() {
+    log_color(GOLD);
+    printf("%s (IR)\n", function->name.c_str());
+    log_color(NO_COLOR);
+    for(auto block : blocks) {
+        printf(" block%d:", block->id);
+        if(block->preds.size()) {
+            printf(" preds");
+            for(auto pred : block->preds)
+                printf(" block%d", pred->id);
+        }
+        if(block->loop_depth)
+            printf(" (loop depth %d)", block->loop_depth);
+        printf("\n");
+        for(auto inst : block->insts) {
+            if(inst->type.valid() || inst->op == IR_CONST)
+                printf("  %%%d = ", inst->id);
+            else
+                printf("  ");
+            if(inst->op == IR_BINARY)
+                printf("%s", opcode_names[inst->opcode]);
+            else
+                printf("%s", ir_op_names[inst->op]);
+            if(inst->op == IR_BINARY && inst->control)
+                printf(".%d", (int)inst->control);
+            if(inst->size)
+                printf(" %dB", (int)inst->size);
+            if(inst->op == IR_CONST || inst->op == IR_PARAM || inst->op == IR_DATAPTR || inst->op == IR_CAST
+                || ((inst->op == IR_LOAD || inst->op == IR_STORE) && inst->imm != 0))
+                printf(" %lld", (long long)inst->imm);
+            if(inst->callee)
+                printf(" %s", inst->callee->name.c_str());
+            for(auto arg : inst->args)
+                printf(" %%%d", arg->id);
+            for(auto succ : block->succs) {
+                if(inst->is_terminator() && inst->op != IR_RETURN && inst->op != IR_TAILCALL)
+                    printf(" block%d", succ->id);
+            }
+            printf("\n");
+        }
+    }
+}
+
+/*
+    Builds SSA directly from the AST with the algorithm from "Simple and
+    Efficient Construction of Static Single Assignment Form" by Braun et al.
+    A block is sealed when all of its predecessors are known, variables
+    read in unsealed blocks (loop headers) get phis that are completed
+    when the block is sealed.
+
+    The type rules are the ones in GeneratorContext::generateExpression.
+    Anything the generator would report or that the IR doesn't cover makes
+    the builder give up, the generator then does its usual thing.
+*/
+struct IRBuilder {
+    GeneratorContext* gen = nullptr;
+    AST* ast = nullptr;
+    ASTFunction* function = nullptr;
+    IRFunction* ir = nullptr;
+    IRBlock* block = nullptr; // null after return, break and continue
+    ASTStatement* stmt = nullptr;
+    ScopeId scopeId = 0;
+
+    struct Value {
+        IRInst* inst = nullptr; // null if the expression isn't supported
+        TypeId type;
+    };
+    struct Variable {
+        TypeId type;
+        int size;
+    };
+    std::vector<Variable> variables;
+    struct Name {
+        std::string name;
+        ScopeId scopeId;
+        int variable; // index into variables
+        ASTStatement* constant; // the declaration if it's a constant
+    };
+    std::vector<Name> names; // locals, parameters and constants in the scopes we are in, innermost last
+    std::vector<Name> declared; // registered in the AST when the function is done, see finish
+
+    // per block id
+    std::vector<std::unordered_map<int, IRInst*>> defs;
+    std::vector<bool> sealed;
+    std::vector<std::vector<std::pair<int, IRInst*>>> incomplete_phis;
+
+    struct Loop {
+        IRBlock* header;
+        IRBlock* exit;
+    };
+    std::vector<Loop> loops;
+
+    Value unsupported(const char* what) {
+        #ifdef DEBUG_IR
+        printf("IR: %s is not supported in %s\n", what, function->name.c_str());
+        #endif
+        return {};
+    }
+
+    IRBlock* newBlock() {
+        auto b = ir->createBlock();
+        defs.resize(ir->next_block_id);
+        sealed.resize(ir->next_block_id, false);
+        incomplete_phis.resize(ir->next_block_id);
+        return b;
+    }
+    IRInst* emit(IROp op, TypeId type, std::vector<IRInst*> args = {}) {
+        auto inst = ir->create(op, type);
+        inst->args = std::move(args);
+        inst->block = block;
+        inst->stmt = stmt;
+        block->insts.push_back(inst);
+        return inst;
+    }
+    IRInst* constant(int value, TypeId type) {
+        auto inst = emit(IR_CONST, type);
+        inst->imm = value;
+        return inst;
+    }
+    IRInst* binary(Opcode opcode, u8 control, IRInst* a, IRInst* b, TypeId type) {
+        auto inst = emit(IR_BINARY, type, { a, b });
+        inst->opcode = opcode;
+        inst->control = control;
+        return inst;
+    }
+    IRInst* load(IRInst* address, int size, int offset, TypeId type) {
+        auto inst = emit(IR_LOAD, type, { address });
+        inst->size = size;
+        inst->imm = offset;
+        return inst;
+    }
+    IRInst* truncate(IRInst* value, int size, TypeId type) {
+        if(size >= 8)
+            return value;
+        auto inst = emit(IR_TRUNC, type, { value });
+        inst->size = size;
+        return inst;
+    }
+    IRInst* cast(IRInst* value, CastType cast_type, TypeId type) {
+        auto inst = emit(IR_CAST, type, { value });
+        inst->imm = cast_type;
+        return inst;
+    }
+    void jump(IRBlock* to) {
+        emit(IR_JUMP, TYPE_VOID);
+        ir->addEdge(block, to);
+    }
+    void branch(IRInst* cond, IRBlock* on_true, IRBlock* on_false) {
+        emit(IR_BRANCH, TYPE_VOID, { cond });
+        ir->addEdge(block, on_true);
+        ir->addEdge(block, on_false);
+    }
+
+    // SSA construction
+    IRInst* newPhi(IRBlock* b, int variable) {
+        auto phi = ir->create(IR_PHI, variables[variable].type);
+        phi->block = b;
+        b->insts.insert(b->insts.begin(), phi);
+        return phi;
+    }
+    void writeVariable(int variable, IRBlock* b, IRInst* value) {
+        defs[b->id][variable] = value;
+    }
+    IRInst* readVariable(int variable, IRBlock* b) {
+        auto pair = defs[b->id].find(variable);
+        if(pair != defs[b->id].end())
+            return final_value(pair->second);
+        IRInst* value = nullptr;
+        if(!sealed[b->id]) {
+            value = newPhi(b, variable);
+            incomplete_phis[b->id].push_back({variable, value});
+        } else if(b->preds.size() == 1) {
+            value = readVariable(variable, b->preds[0]);
+        } else if(b->preds.size() == 0) {
+            // declarations write the variable before any read, only reachable in broken code
+            value = ir->create(IR_CONST, variables[variable].type);
+            value->block = ir->blocks[0];
+            ir->blocks[0]->insts.insert(ir->blocks[0]->insts.begin(), value);
+        } else {
+            auto phi = newPhi(b, variable);
+            writeVariable(variable, b, phi);
+            value = addPhiOperands(variable, phi);
+        }
+        writeVariable(variable, b, value);
+        return value;
+    }
+    IRInst* addPhiOperands(int variable, IRInst* phi) {
+        for(auto pred : phi->block->preds)
+            phi->args.push_back(readVariable(variable, pred));
+        return tryRemoveTrivialPhi(phi);
+    }
+    IRInst* tryRemoveTrivialPhi(IRInst* phi) {
+        IRInst* same = nullptr;
+        for(auto arg : phi->args) {
+            arg = final_value(arg);
+            if(arg == same || arg == phi)
+                continue;
+            if(same)
+                return phi;
+            same = arg;
+        }
+        if(!same)
+            return phi; // only refers to itself, resolve leaves it for DCE
+        phi->replaced_by = same;
+        phi->removed = true;
+        return same;
+    }
+    void seal(IRBlock* b) {
+        for(auto& pair : incomplete_phis[b->id])
+            addPhiOperands(pair.first, pair.second);
+        incomplete_phis[b->id].clear();
+        sealed[b->id] = true;
+    }
+
+    bool is_scalar(TypeId type) {
+        if(!type.valid())
+            return false;
+        if(type.pointer_level() > 0)
+            return true;
+        auto info = ast->getType(type);
+        return !info->ast_struct && info->size > 0;
+    }
+    bool is_integer(TypeId type) {
+        return type == TYPE_INT || type == TYPE_CHAR || type == TYPE_BOOL;
+    }
+    // same rules as GeneratorContext::performCast, an int isn't converted
+    // to a float because the integer case comes first there
+    bool performCast(Value* value, TypeId type) {
+        if(value->type == type)
+            return true;
+        if(value->type.pointer_level() > 0 && type.pointer_level() > 0)
+            return true;
+        if(is_integer(value->type))
+            return true;
+        if(value->type == TYPE_FLOAT && type == TYPE_INT) {
+            value->inst = cast(value->inst, CAST_FLOAT_INT, type);
+            return true;
+        }
+        return false;
+    }
+    // arguments and assignments need the same type or void* with another pointer
+    bool matches(TypeId ltype, TypeId rtype) {
+        auto pvoid = TypeId::Make(TYPE_VOID, 1);
+        return ltype == rtype || (ltype == pvoid && rtype.pointer_level() == 1) || (ltype.pointer_level() == 1 && rtype == pvoid);
+    }
+    Name* findName(const std::string& name) {
+        for(int i=names.size()-1;i>=0;i--) {
+            if(names[i].name == name)
+                return &names[i];
+        }
+        return nullptr;
+    }
+    bool declare(const std::string& name, int variable, ASTStatement* constant) {
+        for(int i=names.size()-1;i>=0 && names[i].scopeId == scopeId;i--) {
+            if(names[i].name == name)
+                return false;
+        }
+        names.push_back({ name, scopeId, variable, constant });
+        declared.push_back({ name, scopeId, variable, constant });
+        return true;
+    }
+
+    // A place that can be assigned, a variable or memory at base + offset
+    struct Reference {
+        TypeId type;
+        int variable = -1;
+        IRInst* base = nullptr;
+        int offset = 0;
+    };
+    bool reference(ASTExpression* expr, Reference* out);
+    Value expression(ASTExpression* expr);
+    bool arguments(ASTExpression* expr, ASTFunction* fun, std::vector<IRInst*>* out);
+    bool statement(ASTStatement* stmt, bool* stop);
+    bool body(ASTBody* body);
+};
+
+bool IRBuilder::reference(ASTExpression* expr, Reference* out) {
+    if(expr->kind() == ASTExpression::DEREF) {
+        Value value = expression(expr->left);
+        if(!value.inst || value.type.pointer_level() == 0)
+            return unsupported("dereference"), false;
+        out->type = value.type;
+        out->type.set_pointer_level(value.type.pointer_level() - 1);
+        out->base = value.inst;
+        return true;
+    }
+    std::vector<ASTExpression*> exprs;
+    while(expr) {
+        if(expr->kind() != ASTExpression::IDENTIFIER && expr->kind() != ASTExpression::MEMBER && expr->kind() != ASTExpression::INDEX)
+            return unsupported("reference"), false;
+        exprs.push_back(expr);
+        expr = expr->left;
+    }
+    Reference ref{};
+    // the pointer stored at the reference
+    auto read_pointer = [&]() {
+        if(ref.variable != -1)
+            return readVariable(ref.variable, block);
+        return load(ref.base, 8, ref.offset, ref.type);
+    };
+    for(int i=exprs.size()-1;i>=0;i--) {
+        auto expr = exprs[i];
+        switch(expr->kind()) {
+            case ASTExpression::IDENTIFIER: {
+                if(i != exprs.size()-1)
+                    return unsupported("reference"), false;
+                auto name = findName(expr->name);
+                if(name) {
+                    if(name->constant)
+                        return unsupported("reference to constant"), false;
+                    ref.variable = name->variable;
+                    ref.type = variables[name->variable].type;
+                    break;
+                }
+                auto variable = ast->findVariable(expr->name, scopeId);
+                if(!variable || variable->kind != Identifier::GLOBAL_ID)
+                    return unsupported("reference"), false;
+                ref.base = emit(IR_DATAPTR, TypeId::Make(variable->type.index(), variable->type.pointer_level() + 1));
+                ref.base->imm = variable->offset;
+                ref.type = variable->type;
+            } break;
+            case ASTExpression::MEMBER: {
+                ASTStructure* ast_struct = nullptr;
+                if(ref.type.pointer_level() <= 1)
+                    ast_struct = ast->getType(ref.type.base())->ast_struct;
+                if(!ast_struct)
+                    return unsupported("member access"), false;
+                auto mem = ast_struct->findMember(expr->name);
+                if(!mem)
+                    return unsupported("member access"), false;
+                if(ref.type.pointer_level() == 0) {
+                    if(ref.variable != -1)
+                        return unsupported("struct variable"), false;
+                    ref.offset += mem->offset;
+                } else {
+                    // implicit dereference
+                    ref.base = read_pointer();
+                    ref.variable = -1;
+                    ref.offset = mem->offset;
+                }
+                ref.type = mem->typeId;
+            } break;
+            case ASTExpression::INDEX: {
+                if(ref.type.pointer_level() == 0)
+                    return unsupported("index"), false;
+                IRInst* pointer = read_pointer();
+                Value index = expression(expr->right);
+                if(!index.inst || index.type != TYPE_INT)
+                    return unsupported("index"), false;
+                TypeId elem_type = ref.type;
+                elem_type.set_pointer_level(elem_type.pointer_level() - 1);
+                IRInst* scaled = binary(INST_MUL, CONTROL_NONE, index.inst, constant(ast->sizeOfType(elem_type), TYPE_INT), TYPE_INT);
+                ref.base = binary(INST_ADD, CONTROL_NONE, pointer, scaled, ref.type);
+                ref.variable = -1;
+                ref.offset = 0;
+                ref.type = elem_type;
+            } break;
+            default: Assert(false);
+        }
+    }
+    *out = ref;
+    return true;
+}
+bool IRBuilder::arguments(ASTExpression* expr, ASTFunction* fun, std::vector<IRInst*>* out) {
+    if(fun->parameters.size() != expr->arguments.size() || !fun->reachable)
+        return unsupported("call"), false;
+    if(fun->return_type.valid() && !is_scalar(fun->return_type))
+        return unsupported("struct return value"), false;
+    for(int i=0;i<expr->arguments.size();i++) {
+        auto& param = fun->parameters[i];
+        if(!is_scalar(param.typeId))
+            return unsupported("struct argument"), false;
+        Value arg = expression(expr->arguments[i]);
+        if(!arg.inst || !matches(param.typeId, arg.type))
+            return unsupported("argument"), false;
+        out->push_back(arg.inst);
+    }
+    return true;
+}
+IRBuilder::Value IRBuilder::expression(ASTExpression* expr) {
+    Assert(expr);
+    switch(expr->kind()) {
+        case ASTExpression::LITERAL_INT: {
+            return { constant(expr->literal_integer, TYPE_INT), TYPE_INT };
+        } break;
+        case ASTExpression::LITERAL_FLOAT: {
+            return { constant(*(int*)&expr->literal_float, TYPE_FLOAT), TYPE_FLOAT };
+        } break;
+        case ASTExpression::LITERAL_STR: {
+            TypeId type = TypeId::Make(TYPE_CHAR, 1);
+            auto inst = emit(IR_DATAPTR, type);
+            inst->imm = gen->bytecode->appendString(expr->literal_string);
+            return { inst, type };
+        } break;
+        case ASTExpression::LITERAL_CHAR: {
+            if(expr->literal_string.size() == 0)
+                return unsupported("empty character");
+            return { constant(expr->literal_string[0], TYPE_CHAR), TYPE_CHAR };
+        } break;
+        case ASTExpression::LITERAL_TRUE: {
+            return { constant(1, TYPE_BOOL), TYPE_BOOL };
+        } break;
+        case ASTExpression::LITERAL_FALSE: {
+            return { constant(0, TYPE_BOOL), TYPE_BOOL };
+        } break;
+        case ASTExpression::LITERAL_NULL: {
+            TypeId type = TypeId::Make(TYPE_VOID, 1);
+            return { constant(0, type), type };
+        } break;
+        case ASTExpression::SIZEOF: {
+            if(!expr->typeId.valid())
+                return unsupported("sizeof");
+            return { constant(ast->sizeOfType(expr->typeId), TYPE_INT), TYPE_INT };
+        } break;
+        case ASTExpression::IDENTIFIER: {
+            ASTStatement* constant_stmt = nullptr;
+            auto name = findName(expr->name);
+            if(name && !name->constant) {
+                auto& variable = variables[name->variable];
+                return { readVariable(name->variable, block), variable.type };
+            }
+            if(name) {
+                constant_stmt = name->constant;
+            } else {
+                auto variable = ast->findVariable(expr->name, scopeId);
+                if(!variable)
+                    return unsupported("unknown variable");
+                if(variable->kind == Identifier::GLOBAL_ID) {
+                    if(!is_scalar(variable->type))
+                        return unsupported("struct global");
+                    auto address = emit(IR_DATAPTR, TypeId::Make(variable->type.index(), variable->type.pointer_level() + 1));
+                    address->imm = variable->offset;
+                    return { load(address, ast->sizeOfType(variable->type), 0, variable->type), variable->type };
+                }
+                if(variable->kind != Identifier::CONST_ID)
+                    return unsupported("variable");
+                constant_stmt = variable->statement;
+            }
+            if(!constant_stmt || !constant_stmt->expression || !constant_stmt->expression->isConst())
+                return unsupported("constant");
+            return expression(constant_stmt->expression);
+        } break;
+        case ASTExpression::FUNCTION_CALL: {
+            auto fun = ast->findFunction(expr->name, scopeId);
+            if(!fun)
+                return unsupported("unknown function");
+            std::vector<IRInst*> args;
+            if(!arguments(expr, fun, &args))
+                return {};
+            auto call = emit(IR_CALL, fun->return_type, std::move(args));
+            call->callee = fun;
+            if(fun->return_type.valid())
+                call->size = ast->sizeOfType(fun->return_type);
+            return { call, fun->return_type };
+        } break;
+        case ASTExpression::ADD:
+        case ASTExpression::SUB:
+        case ASTExpression::MUL:
+        case ASTExpression::DIV:
+        case ASTExpression::AND:
+        case ASTExpression::OR:
+        case ASTExpression::EQUAL:
+        case ASTExpression::NOT_EQUAL:
+        case ASTExpression::LESS:
+        case ASTExpression::GREATER:
+        case ASTExpression::LESS_EQUAL:
+        case ASTExpression::GREATER_EQUAL: {
+            Value left = expression(expr->left);
+            if(!left.inst)
+                return {};
+            Value right = expression(expr->right);
+            if(!right.inst)
+                return {};
+            TypeId ltype = left.type;
+            TypeId rtype = right.type;
+            if(!is_scalar(ltype) || !is_scalar(rtype))
+                return unsupported("operands");
+
+            TypeId out_type = ltype;
+            bool is_float = false;
+            auto kind = expr->kind();
+            if(kind == ASTExpression::ADD || kind == ASTExpression::SUB || kind == ASTExpression::MUL || kind == ASTExpression::DIV) {
+                if(ltype == rtype) {
+                    is_float = ltype == TYPE_FLOAT;
+                } else if((ltype == TYPE_INT && rtype.pointer_level()>0) || (rtype == TYPE_INT && ltype.pointer_level()>0)) {
+                    out_type = rtype.pointer_level() ? rtype : ltype;
+                } else if((ltype == TYPE_INT || ltype == TYPE_CHAR) && (rtype == TYPE_INT || rtype == TYPE_CHAR)) {
+                    out_type = TYPE_INT;
+                } else if((ltype == TYPE_INT || ltype == TYPE_FLOAT) && (rtype == TYPE_INT || rtype == TYPE_FLOAT)) {
+                    out_type = TYPE_FLOAT;
+                    is_float = true;
+                } else {
+                    return unsupported("operand types");
+                }
+            } else if(kind == ASTExpression::AND || kind == ASTExpression::OR) {
+                out_type = TYPE_BOOL;
+            } else {
+                if((ltype == TYPE_INT || ltype == TYPE_CHAR || ltype == TYPE_FLOAT) && (rtype == TYPE_INT || rtype == TYPE_CHAR || rtype == TYPE_FLOAT)) {
+                    out_type = TYPE_BOOL;
+                    is_float = ltype == TYPE_FLOAT || rtype == TYPE_FLOAT;
+                } else {
+                    return unsupported("operand types");
+                }
+            }
+
+            TypeId operand_type = ltype;
+            IRInst* b = right.inst;
+            if(is_float && (rtype == TYPE_INT || rtype == TYPE_CHAR)) {
+                b = cast(b, CAST_INT_FLOAT, TYPE_FLOAT);
+                operand_type = TYPE_FLOAT;
+            }
+            IRInst* a = left.inst;
+            if(is_float && (ltype == TYPE_INT || ltype == TYPE_CHAR)) {
+                a = cast(a, CAST_INT_FLOAT, TYPE_FLOAT);
+                operand_type = TYPE_FLOAT;
+            }
+            u8 control = is_float ? CONTROL_FLOAT : CONTROL_NONE;
+            Opcode opcode = INST_NOP;
+            switch(kind) {
+                case ASTExpression::ADD: opcode = INST_ADD; break;
+                case ASTExpression::SUB: opcode = INST_SUB; break;
+                case ASTExpression::MUL: opcode = INST_MUL; break;
+                case ASTExpression::DIV: opcode = INST_DIV; break;
+                case ASTExpression::AND: opcode = INST_AND; control = CONTROL_NONE; break;
+                case ASTExpression::OR:  opcode = INST_OR;  control = CONTROL_NONE; break;
+                case ASTExpression::EQUAL:         opcode = INST_EQUAL; break;
+                case ASTExpression::NOT_EQUAL:     opcode = INST_NOT_EQUAL; break;
+                case ASTExpression::LESS:          opcode = INST_LESS; break;
+                case ASTExpression::GREATER:       opcode = INST_GREATER; break;
+                case ASTExpression::LESS_EQUAL:    opcode = INST_LESS_EQUAL; break;
+                case ASTExpression::GREATER_EQUAL: opcode = INST_GREATER_EQUAL; break;
+                default: Assert(false);
+            }
+            if(opcode >= INST_EQUAL)
+                control |= ast->getType(operand_type)->size;
+            return { binary(opcode, control, a, b, out_type), out_type };
+        } break;
+        case ASTExpression::NOT: {
+            Value value = expression(expr->left);
+            if(!value.inst || !is_scalar(value.type))
+                return unsupported("not");
+            return { emit(IR_NOT, value.type, { value.inst }), value.type };
+        } break;
+        case ASTExpression::REFER: {
+            return unsupported("reference");
+        } break;
+        case ASTExpression::DEREF: {
+            Value value = expression(expr->left);
+            if(!value.inst || value.type.pointer_level() == 0)
+                return unsupported("dereference");
+            TypeId type = value.type;
+            type.set_pointer_level(type.pointer_level() - 1);
+            if(!is_scalar(type))
+                return unsupported("dereference");
+            // generateExpression pushes with the size of the pointer
+            return { load(value.inst, 8, 0, type), type };
+        } break;
+        case ASTExpression::MEMBER: {
+            Reference ref{};
+            if(!reference(expr, &ref))
+                return {};
+            if(!is_scalar(ref.type) || ref.variable != -1)
+                return unsupported("member");
+            return { load(ref.base, ast->sizeOfType(ref.type), ref.offset, ref.type), ref.type };
+        } break;
+        case ASTExpression::INDEX: {
+            Value index = expression(expr->right);
+            if(!index.inst)
+                return {};
+            Value pointer = expression(expr->left);
+            if(!pointer.inst)
+                return {};
+            if(pointer.type.pointer_level() == 0 || index.type != TYPE_INT)
+                return unsupported("index");
+            TypeId elem_type = pointer.type;
+            elem_type.set_pointer_level(elem_type.pointer_level() - 1);
+            if(!is_scalar(elem_type))
+                return unsupported("index");
+            IRInst* scaled = binary(INST_MUL, CONTROL_NONE, index.inst, constant(ast->sizeOfType(elem_type), TYPE_INT), TYPE_INT);
+            IRInst* address = binary(INST_ADD, CONTROL_NONE, pointer.inst, scaled, pointer.type);
+            return { load(address, ast->sizeOfType(elem_type), 0, elem_type), elem_type };
+        } break;
+        case ASTExpression::CAST: {
+            Value value = expression(expr->left);
+            if(!value.inst)
+                return {};
+            TypeId type = value.type;
+            TypeId cast_type = expr->typeId;
+            if(!is_scalar(type) || !is_scalar(cast_type))
+                return unsupported("cast");
+            if(type == cast_type)
+                return value;
+            if(type.pointer_level() > 0 && cast_type.pointer_level() > 0)
+                return { value.inst, cast_type };
+            if(is_integer(type) && is_integer(cast_type))
+                return { value.inst, cast_type };
+            if(type == TYPE_INT && cast_type == TYPE_FLOAT)
+                return { cast(value.inst, CAST_INT_FLOAT, cast_type), cast_type };
+            if(type == TYPE_FLOAT && cast_type == TYPE_INT)
+                return { cast(value.inst, CAST_FLOAT_INT, cast_type), cast_type };
+            return unsupported("cast");
+        } break;
+        case ASTExpression::ASSIGN: {
+            Value value = expression(expr->right);
+            if(!value.inst)
+                return {};
+            Reference ref{};
+            if(!reference(expr->left, &ref))
+                return {};
+            if(!is_scalar(ref.type) || !matches(ref.type, value.type))
+                return unsupported("assignment");
+            int size = ast->sizeOfType(ref.type);
+            if(ref.variable != -1) {
+                IRInst* stored = truncate(value.inst, size, ref.type);
+                writeVariable(ref.variable, block, stored);
+                return { stored, ref.type };
+            }
+            auto store = emit(IR_STORE, TYPE_VOID, { ref.base, value.inst });
+            store->size = size;
+            store->imm = ref.offset;
+            // generateExpression loads the value again
+            return { truncate(value.inst, size, ref.type), ref.type };
+        } break;
+        case ASTExpression::PRE_INCREMENT:
+        case ASTExpression::POST_INCREMENT:
+        case ASTExpression::POST_DECREMENT: {
+            Reference ref{};
+            if(!reference(expr->left, &ref))
+                return {};
+            if(ref.type != TYPE_INT)
+                return unsupported("increment");
+            IRInst* old_value = nullptr;
+            if(ref.variable != -1)
+                old_value = readVariable(ref.variable, block);
+            else
+                old_value = load(ref.base, 4, ref.offset, TYPE_INT);
+            int amount = expr->kind() == ASTExpression::POST_DECREMENT ? -1 : 1;
+            IRInst* new_value = binary(INST_ADD, CONTROL_NONE, old_value, constant(amount, TYPE_INT), TYPE_INT);
+            if(ref.variable != -1) {
+                writeVariable(ref.variable, block, truncate(new_value, 4, TYPE_INT));
+            } else {
+                auto store = emit(IR_STORE, TYPE_VOID, { ref.base, new_value });
+                store->size = 4;
+                store->imm = ref.offset;
+            }
+            if(expr->kind() == ASTExpression::PRE_INCREMENT)
+                return { new_value, TYPE_INT };
+            return { old_value, TYPE_INT };
+        } break;
+        default: break;
+    }
+    // PRE_DECREMENT is left to the generator, it emits an increment
+    return unsupported("expression");
+}
+bool IRBuilder::statement(ASTStatement* stmt, bool* stop) {
+    this->stmt = stmt;
+    switch(stmt->kind()) {
+        case ASTStatement::EXPRESSION: {
+            Value value = expression(stmt->expression);
+            if(!value.inst)
+                return false;
+        } break;
+        case ASTStatement::GLOBAL_DECLARATION: {
+            return unsupported("global declaration in a function"), false;
+        } break;
+        case ASTStatement::CONST_DECLARATION: {
+            if(!stmt->declaration_typeId.valid() || !declare(stmt->declaration_name, -1, stmt))
+                return unsupported("constant declaration"), false;
+        } break;
+        case ASTStatement::VAR_DECLARATION: {
+            TypeId type = stmt->declaration_typeId;
+            if(!is_scalar(type))
+                return unsupported("variable type"), false;
+            int variable = variables.size();
+            int size = ast->sizeOfType(type);
+            variables.push_back({ type, size });
+            if(!declare(stmt->declaration_name, variable, nullptr))
+                return unsupported("variable declared twice"), false;
+            // zeroed like the memory the generator clears, the expression may read the variable
+            writeVariable(variable, block, constant(0, type));
+            if(stmt->expression) {
+                Value value = expression(stmt->expression);
+                if(!value.inst || !is_scalar(value.type) || !performCast(&value, type))
+                    return unsupported("variable initializer"), false;
+                writeVariable(variable, block, truncate(value.inst, size, type));
+            }
+        } break;
+        case ASTStatement::WHILE: {
+            IRBlock* header = newBlock();
+            jump(header);
+            block = header;
+            Value cond = expression(stmt->expression);
+            if(!cond.inst || !is_integer(cond.type))
+                return unsupported("while condition"), false;
+            IRBlock* body_block = newBlock();
+            IRBlock* exit = newBlock();
+            branch(cond.inst, body_block, exit);
+            seal(body_block);
+
+            loops.push_back({ header, exit });
+            block = body_block;
+            if(!body(stmt->body))
+                return false;
+            this->stmt = stmt;
+            if(block)
+                jump(header);
+            loops.pop_back();
+            seal(header);
+            seal(exit);
+            block = exit;
+        } break;
+        case ASTStatement::BREAK:
+        case ASTStatement::CONTINUE: {
+            if(loops.size() == 0)
+                return unsupported("break outside loop"), false;
+            jump(stmt->kind() == ASTStatement::BREAK ? loops.back().exit : loops.back().header);
+            block = nullptr;
+            *stop = true;
+        } break;
+        case ASTStatement::IF: {
+            Value cond = expression(stmt->expression);
+            if(!cond.inst || !is_integer(cond.type))
+                return unsupported("if condition"), false;
+            IRBlock* then_block = newBlock();
+            IRBlock* else_block = stmt->elseBody ? newBlock() : nullptr;
+            IRBlock* join = newBlock();
+            branch(cond.inst, then_block, else_block ? else_block : join);
+            seal(then_block);
+            block = then_block;
+            if(!body(stmt->body))
+                return false;
+            this->stmt = stmt;
+            if(block)
+                jump(join);
+            if(else_block) {
+                seal(else_block);
+                block = else_block;
+                if(!body(stmt->elseBody))
+                    return false;
+                this->stmt = stmt;
+                if(block)
+                    jump(join);
+            }
+            seal(join);
+            block = join->preds.size() ? join : nullptr;
+        } break;
+        case ASTStatement::RETURN: {
+            ASTFunction* tail_callee = stmt->expression ? gen->findTailCallee(stmt->expression) : nullptr;
+            if(tail_callee) {
+                std::vector<IRInst*> args;
+                if(!arguments(stmt->expression, tail_callee, &args))
+                    return false;
+                auto call = emit(IR_TAILCALL, TYPE_VOID, std::move(args));
+                call->callee = tail_callee;
+            } else if(stmt->expression) {
+                if(!function->return_type.valid())
+                    return unsupported("return value"), false;
+                Value value = expression(stmt->expression);
+                if(!value.inst || !is_scalar(value.type) || !performCast(&value, function->return_type))
+                    return unsupported("return value"), false;
+                // the generator writes the size of the expression, the caller reads the size of the return type
+                int size = ast->sizeOfType(value.type);
+                if(size != ast->sizeOfType(function->return_type))
+                    return unsupported("return value"), false;
+                auto ret = emit(IR_RETURN, TYPE_VOID, { value.inst });
+                ret->size = size;
+            } else {
+                if(function->return_type.valid())
+                    return unsupported("missing return value"), false;
+                emit(IR_RETURN, TYPE_VOID);
+            }
+            block = nullptr;
+            *stop = true;
+        } break;
+        default: Assert(false);
+    }
+    return true;
+}
+bool IRBuilder::body(ASTBody* body) {
+    auto prev_scope = scopeId;
+    int prev_names = names.size();
+    scopeId = body->scopeId;
+    gen->current_scopeId = scopeId;
+    for(int i=0;i<body->statements.size();i++) {
+        bool stop = false;
+        if(!statement(body->statements[i], &stop))
+            return false;
+        if(!block) {
+            // the generator keeps going after an if where both branches return
+            if(!stop && i+1 < body->statements.size())
+                return unsupported("statements after returning branches"), false;
+            break;
+        }
+    }
+    names.resize(prev_names);
+    scopeId = prev_scope;
+    gen->current_scopeId = scopeId;
+    return true;
+}
+
+IRFunction* BuildIR(GeneratorContext* context) {
+    ZoneScopedC(tracy::Color::Blue2);
+    auto function = context->function;
+    IRBuilder builder{};
+    builder.gen = context;
+    builder.ast = context->ast;
+    builder.function = function;
+    builder.ir = new IRFunction();
+    builder.ir->function = function;
+    auto prev_scope = context->current_scopeId;
+
+    auto entry = builder.newBlock();
+    builder.seal(entry);
+    builder.block = entry;
+    builder.scopeId = function->body->scopeId;
+    bool success = true;
+    for(auto& param : function->parameters) {
+        if(!builder.is_scalar(param.typeId)) {
+            builder.unsupported("struct parameter");
+            success = false;
+            break;
+        }
+        int variable = builder.variables.size();
+        int size = builder.ast->sizeOfType(param.typeId);
+        builder.variables.push_back({ param.typeId, size });
+        // registered in the AST by CheckFunction
+        builder.names.push_back({ param.name, builder.scopeId, variable, nullptr });
+        auto inst = builder.emit(IR_PARAM, param.typeId);
+        inst->imm = param.offset;
+        inst->size = size;
+        builder.writeVariable(variable, entry, inst);
+    }
+    success = success && builder.body(function->body);
+    if(success && builder.block) {
+        if(function->return_type.valid()) {
+            // the generator reports the missing return statement
+            builder.unsupported("missing return statement");
+            success = false;
+        } else {
+            builder.stmt = nullptr;
+            builder.emit(IR_RETURN, TYPE_VOID);
+        }
+    }
+    context->current_scopeId = prev_scope;
+    if(!success) {
+        delete builder.ir;
+        return nullptr;
+    }
+
+    // locals and constants are looked up in the scopes later, by the C backend for example
+    for(auto& name : builder.declared) {
+        if(name.constant) {
+            auto id = builder.ast->addVariable(Identifier::CONST_ID, name.name, name.scopeId, name.constant->declaration_typeId, 0);
+            if(id)
+                id->statement = name.constant;
+        } else {
+            builder.ast->addVariable(Identifier::LOCAL_ID, name.name, name.scopeId, builder.variables[name.variable].type, 0);
+        }
+    }
+
+    auto ir = builder.ir;
+    // phis that turned out to have one value
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(auto block : ir->blocks) {
+            for(auto inst : block->insts) {
+                if(inst->op != IR_PHI || inst->removed)
+                    continue;
+                if(builder.tryRemoveTrivialPhi(inst) != inst)
+                    changed = true;
+            }
+        }
+    }
+    ir->resolve();
+    return ir;
+}
+
+/*
+    Optimization passes
+*/
+static bool is_commutative(IRInst* inst) {
+    if(inst->op != IR_BINARY)
+        return false;
+    switch(inst->opcode) {
+        // float results keep the upper bits of op0
+        case INST_ADD: case INST_MUL: return !(inst->control & CONTROL_FLOAT);
+        case INST_AND: case INST_OR: case INST_EQUAL: case INST_NOT_EQUAL: return true;
+        default: return false;
+    }
+}
+// Whether the instruction only computes a value from its arguments and can't fail
+static bool is_pure(IRInst* inst) {
+    switch(inst->op) {
+        case IR_CONST: case IR_DATAPTR: case IR_NOT: case IR_CAST: case IR_TRUNC: case IR_PARAM: return true;
+        // integer division by zero traps
+        case IR_BINARY: return inst->opcode != INST_DIV || (inst->control & CONTROL_FLOAT);
+        default: return false;
+    }
+}
+// Whether the value is zero extended from size bytes
+static bool fits(IRInst* v, int size, std::vector<IRInst*>* visiting) {
+    if(size >= 8)
+        return true;
+    switch(v->op) {
+        case IR_CONST: return v->imm >= 0 && v->imm < (1ll << (size * 8));
+        case IR_PARAM:
+        case IR_LOAD:
+        case IR_TRUNC: return v->size <= size;
+        case IR_CALL: return v->size != 0 && v->size <= size;
+        case IR_NOT: return true;
+        case IR_BINARY: return v->opcode == INST_AND || v->opcode == INST_OR || (v->opcode >= INST_EQUAL && v->opcode <= INST_GREATER_EQUAL);
+        case IR_PHI: {
+            for(auto p : *visiting) {
+                if(p == v)
+                    return true; // holds around the loop if it holds for the other arguments
+            }
+            visiting->push_back(v);
+            bool yes = true;
+            for(auto arg : v->args) {
+                if(!fits(arg, size, visiting)) {
+                    yes = false;
+                    break;
+                }
+            }
+            visiting->pop_back();
+            return yes;
+        }
+        default: return false;
+    }
+}
+
+static void strength_reduction(IRFunction* ir) {
+    std::vector<IRInst*> visiting;
+    for(auto block : ir->blocks) {
+        for(auto inst : block->insts) {
+            for(auto& arg : inst->args)
+                arg = final_value(arg);
+            if(inst->op == IR_TRUNC) {
+                if(fits(inst->args[0], inst->size, &visiting))
+                    inst->replaced_by = inst->args[0];
+                continue;
+            }
+            if(inst->op != IR_BINARY || (inst->control & CONTROL_FLOAT))
+                continue;
+            auto a = inst->args[0], b = inst->args[1];
+            if(is_commutative(inst) && a->op == IR_CONST)
+                std::swap(a, b);
+            if(b->op != IR_CONST)
+                continue;
+            switch(inst->opcode) {
+                case INST_ADD:
+                case INST_SUB: {
+                    if(b->imm == 0)
+                        inst->replaced_by = a;
+                } break;
+                case INST_MUL: {
+                    if(b->imm == 1)
+                        inst->replaced_by = a;
+                    else if(b->imm == 0)
+                        inst->replaced_by = b;
+                    else if(b->imm == 2)
+                        inst->opcode = INST_ADD, inst->args = { a, a };
+                } break;
+                case INST_DIV: {
+                    if(b->imm == 1)
+                        inst->replaced_by = a;
+                } break;
+                default: break;
+            }
+        }
+    }
+    for(auto block : ir->blocks) {
+        for(auto inst : block->insts) {
+            if(inst->replaced_by)
+                inst->removed = true;
+        }
+    }
+    ir->resolve();
+}
+
+static void global_value_numbering(IRFunction* ir) {
+    ir->analyze();
+    std::vector<std::vector<IRBlock*>> children(ir->next_block_id);
+    for(auto block : ir->order) {
+        if(block->idom)
+            children[block->idom->id].push_back(block);
+    }
+    std::unordered_map<std::string, IRInst*> table;
+    std::vector<std::string> added; // keys in the order they were added, removed when leaving the block
+    int memory_version = 0;
+    auto key_of = [&](IRInst* inst, std::string* key) {
+        // an integer division that is computed again traps the first time if it does
+        if(inst->op != IR_BINARY && inst->op != IR_LOAD && (!is_pure(inst) || inst->op == IR_PARAM))
+            return false;
+        key->clear();
+        char buffer[64];
+        int version = inst->op == IR_LOAD ? memory_version : 0;
+        snprintf(buffer, sizeof(buffer), "%d %d %d %d %lld %d", (int)inst->op, (int)inst->opcode, (int)inst->control, (int)inst->size, (long long)inst->imm, version);
+        *key = buffer;
+        int a = inst->args.size() > 0 ? final_value(inst->args[0])->id : -1;
+        int b = inst->args.size() > 1 ? final_value(inst->args[1])->id : -1;
+        if(is_commutative(inst) && a > b)
+            std::swap(a, b);
+        snprintf(buffer, sizeof(buffer), " %d %d", a, b);
+        *key += buffer;
+        return true;
+    };
+    struct Visit {
+        IRBlock* block;
+        int added_before;
+        bool entered;
+    };
+    std::vector<Visit> stack;
+    stack.push_back({ ir->order[0], 0, false });
+    std::string key;
+    while(stack.size()) {
+        auto& visit = stack.back();
+        if(visit.entered) {
+            for(int i=visit.added_before;i<added.size();i++)
+                table.erase(added[i]);
+            added.resize(visit.added_before);
+            stack.pop_back();
+            continue;
+        }
+        visit.entered = true;
+        visit.added_before = added.size();
+        auto block = visit.block;
+        memory_version++; // loads are only reused within the block
+        for(auto inst : block->insts) {
+            if(inst->op == IR_STORE || inst->op == IR_CALL) {
+                memory_version++;
+                continue;
+            }
+            if(!key_of(inst, &key))
+                continue;
+            auto pair = table.find(key);
+            if(pair != table.end()) {
+                inst->replaced_by = pair->second;
+                inst->removed = true;
+            } else {
+                table[key] = inst;
+                added.push_back(key);
+            }
+        }
+        for(auto child : children[block->id])
+            stack.push_back({ child, 0, false });
+    }
+    ir->resolve();
+}
+
+struct IRLoop {
+    IRBlock* header;
+    std::vector<bool> body; // by block id
+    int size;
+    IRBlock* preheader; // the only block outside the loop that jumps to the header, null if there are more
+    bool writes_memory; // stores or calls in the loop
+};
+// Natural loops of the back edges with inner loops first
+static std::vector<IRLoop> find_loops(IRFunction* ir) {
+    ir->analyze();
+    std::vector<IRLoop> loops;
+    std::vector<IRBlock*> work;
+    for(auto latch : ir->order) {
+        for(auto header : latch->succs) {
+            if(!ir->dominates(header, latch))
+                continue;
+            IRLoop* loop = nullptr;
+            for(auto& l : loops) {
+                if(l.header == header)
+                    loop = &l;
+            }
+            if(!loop) {
+                loops.push_back({ header, std::vector<bool>(ir->next_block_id, false), 1, nullptr, false });
+                loop = &loops.back();
+                loop->body[header->id] = true;
+            }
+            work.push_back(latch);
+            while(work.size()) {
+                auto block = work.back();
+                work.pop_back();
+                if(loop->body[block->id])
+                    continue;
+                loop->body[block->id] = true;
+                loop->size++;
+                for(auto pred : block->preds)
+                    work.push_back(pred);
+            }
+        }
+    }
+    for(auto& loop : loops) {
+        int outside_preds = 0;
+        for(auto pred : loop.header->preds) {
+            if(!loop.body[pred->id]) {
+                loop.preheader = pred;
+                outside_preds++;
+            }
+        }
+        if(outside_preds != 1 || loop.preheader->succs.size() != 1)
+            loop.preheader = nullptr;
+        for(auto block : ir->order) {
+            if(!loop.body[block->id])
+                continue;
+            for(auto inst : block->insts) {
+                if(inst->op == IR_STORE || inst->op == IR_CALL)
+                    loop.writes_memory = true;
+            }
+        }
+    }
+    std::sort(loops.begin(), loops.end(), [](const IRLoop& a, const IRLoop& b) { return a.size < b.size; });
+    return loops;
+}
+static bool is_invariant(IRLoop& loop, IRInst* inst) {
+    for(auto arg : inst->args) {
+        if(loop.body[arg->block->id])
+            return false;
+    }
+    return true;
+}
+static void move_to_preheader(IRLoop& loop, IRInst* inst) {
+    auto& insts = inst->block->insts;
+    insts.erase(std::find(insts.begin(), insts.end(), inst));
+    loop.preheader->insts.insert(loop.preheader->insts.end() - 1, inst);
+    inst->block = loop.preheader;
+}
+
+static void loop_invariant_code_motion(IRFunction* ir) {
+    // inner loops first, what they hoist may be invariant in the outer loop
+    auto loops = find_loops(ir);
+    for(auto& loop : loops) {
+        if(!loop.preheader)
+            continue;
+        // The header runs every time the loop is entered so its loads can be
+        // done once before if nothing in the loop writes memory. They stop at
+        // the first instruction that may fail to keep errors in order.
+        if(!loop.writes_memory) {
+            auto header = loop.header;
+            for(int i=0;i<header->insts.size();i++) {
+                auto inst = header->insts[i];
+                if(inst->op == IR_PHI || is_pure(inst))
+                    continue;
+                if(inst->op != IR_LOAD || !is_invariant(loop, inst))
+                    break;
+                move_to_preheader(loop, inst);
+                i--;
+            }
+        }
+        for(auto block : ir->order) {
+            if(!loop.body[block->id])
+                continue;
+            for(int i=0;i<block->insts.size();i++) {
+                auto inst = block->insts[i];
+                if(!is_pure(inst) || inst->op == IR_PARAM || !is_invariant(loop, inst))
+                    continue;
+                move_to_preheader(loop, inst);
+                i--;
+            }
+        }
+    }
+}
+
+/*
+    Induction variables, values that change by a constant every iteration.
+
+    'while i < n { ... i++; }' truncates i + 1 to 4 bytes which is never
+    needed when n fits in 4 bytes, without the truncation i is a plain
+    addition that the addresses can follow.
+
+    An address 'p + i * size' where p doesn't change in the loop becomes a
+    phi of its own that starts at 'p + init * size' and is incremented by
+    'step * size' next to every increment of i.
+*/
+static IRInst* insert_after(IRFunction* ir, IRInst* after, IROp op, TypeId type, std::vector<IRInst*> args) {
+    auto inst = ir->create(op, type);
+    inst->args = std::move(args);
+    inst->block = after->block;
+    inst->stmt = after->stmt;
+    auto& insts = after->block->insts;
+    auto at = std::find(insts.begin(), insts.end(), after) + 1;
+    while(at != insts.end() && (*at)->op == IR_PHI)
+        at++;
+    insts.insert(at, inst);
+    return inst;
+}
+static IRInst* constant_step(IRInst* next, IRInst* phi) {
+    if(next->op != IR_BINARY || next->opcode != INST_ADD || next->control != CONTROL_NONE)
+        return nullptr;
+    if(next->args[0] == phi && next->args[1]->op == IR_CONST)
+        return next->args[1];
+    if(next->args[1] == phi && next->args[0]->op == IR_CONST)
+        return next->args[0];
+    return nullptr;
+}
+static void induction_variables(IRFunction* ir) {
+    auto loops = find_loops(ir);
+    std::vector<IRInst*> visiting;
+    for(auto& loop : loops) {
+        if(!loop.preheader)
+            continue;
+        auto header = loop.header;
+        auto branch = header->terminator();
+        if(branch->op != IR_BRANCH || !loop.body[header->succs[0]->id] || loop.body[header->succs[1]->id])
+            continue;
+        IRBlock* body_entry = header->succs[0];
+
+        // i < n where both fit in 4 bytes, i + 1 can't overflow in the body
+        auto cond = branch->args[0];
+        IRInst* counter = nullptr;
+        if(cond->op == IR_BINARY && cond->control == 4) {
+            if(cond->opcode == INST_LESS && fits(cond->args[1], 4, &visiting))
+                counter = cond->args[0];
+            else if(cond->opcode == INST_GREATER && fits(cond->args[0], 4, &visiting))
+                counter = cond->args[1];
+        }
+        if(counter && counter->op == IR_PHI && counter->block == header && fits(counter, 4, &visiting)) {
+            for(int k=0;k<header->preds.size();k++) {
+                auto arg = counter->args[k];
+                if(arg->op != IR_TRUNC || arg->size != 4 || !ir->dominates(body_entry, arg->block))
+                    continue;
+                auto step = constant_step(arg->args[0], counter);
+                if(step && step->imm == 1)
+                    arg->replaced_by = arg->args[0];
+            }
+            for(auto& arg : counter->args)
+                arg = final_value(arg);
+        }
+
+        std::vector<IRInst*> phis;
+        for(auto inst : header->insts) {
+            if(inst->op == IR_PHI)
+                phis.push_back(inst);
+        }
+        for(auto phi : phis) {
+            // every other value comes from an addition to the phi
+            int init_index = -1;
+            bool induction = true;
+            for(int k=0;k<header->preds.size();k++) {
+                if(header->preds[k] == loop.preheader)
+                    init_index = k;
+                else if(!constant_step(phi->args[k], phi))
+                    induction = false;
+            }
+            if(!induction || init_index == -1)
+                continue;
+            // how many times the phi a value is, 0 if it isn't a multiple
+            auto scale_of = [&](IRInst* v) -> i64 {
+                if(v == phi)
+                    return 1;
+                if(v->op != IR_BINARY || v->control != CONTROL_NONE)
+                    return 0;
+                if(v->opcode == INST_ADD && v->args[0] == phi && v->args[1] == phi)
+                    return 2; // from strength reduction
+                if(v->opcode == INST_MUL && v->args[0] == phi && v->args[1]->op == IR_CONST)
+                    return v->args[1]->imm;
+                if(v->opcode == INST_MUL && v->args[1] == phi && v->args[0]->op == IR_CONST)
+                    return v->args[0]->imm;
+                return 0;
+            };
+            struct Address {
+                IRInst* address;
+                IRInst* base;
+                i64 scale;
+            };
+            std::vector<Address> addresses;
+            for(auto block : ir->order) {
+                if(!loop.body[block->id])
+                    continue;
+                for(auto inst : block->insts) {
+                    if(inst->op != IR_BINARY || inst->opcode != INST_ADD || inst->control != CONTROL_NONE || inst->type.pointer_level() == 0)
+                        continue;
+                    for(int side=0;side<2;side++) {
+                        i64 scale = scale_of(inst->args[side]);
+                        IRInst* base = inst->args[1-side];
+                        if(scale != 0 && !loop.body[base->block->id]) {
+                            addresses.push_back({ inst, base, scale });
+                            break;
+                        }
+                    }
+                }
+            }
+            for(auto& addr : addresses) {
+                bool fits_immediate = true;
+                for(int k=0;k<header->preds.size();k++) {
+                    if(k != init_index) {
+                        i64 amount = constant_step(phi->args[k], phi)->imm * addr.scale;
+                        fits_immediate = fits_immediate && amount == (i64)(int)amount;
+                    }
+                }
+                if(!fits_immediate)
+                    continue;
+                auto address = addr.address;
+
+                auto scale = ir->create(IR_CONST, TYPE_INT);
+                scale->imm = addr.scale;
+                auto start = ir->create(IR_BINARY, TYPE_INT);
+                start->opcode = INST_MUL;
+                start->args = { phi->args[init_index], scale };
+                auto start_address = ir->create(IR_BINARY, address->type);
+                start_address->opcode = INST_ADD;
+                start_address->args = { addr.base, start };
+                for(auto inst : { scale, start, start_address }) {
+                    inst->block = loop.preheader;
+                    inst->stmt = address->stmt;
+                    loop.preheader->insts.insert(loop.preheader->insts.end() - 1, inst);
+                }
+
+                auto pointer = ir->create(IR_PHI, address->type);
+                pointer->block = header;
+                header->insts.insert(header->insts.begin(), pointer);
+                for(int k=0;k<header->preds.size();k++) {
+                    if(k == init_index) {
+                        pointer->args.push_back(start_address);
+                        continue;
+                    }
+                    auto next = phi->args[k];
+                    auto amount = ir->create(IR_CONST, TYPE_INT);
+                    amount->imm = constant_step(next, phi)->imm * addr.scale;
+                    amount->block = loop.preheader;
+                    loop.preheader->insts.insert(loop.preheader->insts.end() - 1, amount);
+                    auto increment = insert_after(ir, next, IR_BINARY, address->type, { pointer, amount });
+                    increment->opcode = INST_ADD;
+                    pointer->args.push_back(increment);
+                }
+                address->replaced_by = pointer;
+            }
+        }
+        for(auto block : ir->blocks) {
+            for(auto inst : block->insts) {
+                if(inst->replaced_by)
+                    inst->removed = true;
+            }
+        }
+        ir->resolve();
+    }
+}
+
+static void dead_code_elimination(IRFunction* ir) {
+    std::vector<bool> live(ir->insts.size(), false);
+    std::vector<IRInst*> work;
+    for(auto block : ir->blocks) {
+        for(auto inst : block->insts) {
+            // loads stay, they are checked and may fail like in the generated code
+            if(!is_pure(inst) && inst->op != IR_PHI) {
+                live[inst->id] = true;
+                work.push_back(inst);
+            }
+        }
+    }
+    while(work.size()) {
+        auto inst = work.back();
+        work.pop_back();
+        for(auto arg : inst->args) {
+            if(!live[arg->id]) {
+                live[arg->id] = true;
+                work.push_back(arg);
+            }
+        }
+    }
+    for(auto block : ir->blocks) {
+        for(auto inst : block->insts) {
+            if(!live[inst->id])
+                inst->removed = true;
+        }
+    }
+    ir->resolve();
+}
+
+void OptimizeIR(IRFunction* ir, u32 passes) {
+    ZoneScopedC(tracy::Color::Blue2);
+    if(passes & IR_PASS_STRENGTH)
+        strength_reduction(ir);
+    if(passes & IR_PASS_GVN)
+        global_value_numbering(ir);
+    if(passes & IR_PASS_LICM)
+        loop_invariant_code_motion(ir);
+    if(passes & IR_PASS_INDUCTION)
+        induction_variables(ir);
+    if(passes & IR_PASS_DCE)
+        dead_code_elimination(ir);
+}
+
+/*
+    Lowering
+
+    Critical edges are split so that the copies into phis can be placed at
+    the end of the predecessor. Blocks are laid out in reverse postorder and
+    every value gets one live interval over the layout, loops extend the
+    intervals of the values they use.
+
+    A, D and the frame slot for truncation are scratch. B, C, E and F are
+    given to values with linear scan, F last since InlineCalls skips pieces
+    that use it.
+*/
+struct IRLocation {
+    enum Kind : u8 {
+        NONE, // the value isn't used
+        REG,
+        SLOT, // bp + offset with size bytes
+        CONST,
+        DATAPTR,
+    };
+    Kind kind = NONE;
+    Register reg = REG_INVALID;
+    u8 size = 8;
+    int offset = 0;
+    i64 imm = 0;
+
+    bool operator ==(const IRLocation& l) const {
+        if(kind != l.kind)
+            return false;
+        if(kind == REG) return reg == l.reg;
+        if(kind == SLOT) return offset == l.offset;
+        return false; // constants are never the destination of a copy
+    }
+};
+static const Register allocatable_registers[] { REG_B, REG_C, REG_E, REG_F };
+
+struct IRLowering {
+    IRFunction* ir = nullptr;
+    GeneratorContext* gen = nullptr;
+    BytecodePiece* piece = nullptr;
+    std::vector<IRLocation> locs; // by instruction id
+    int trunc_slot = 0;
+    int frame_offset = 0; // sp - bp in the body
+    std::vector<int> block_pc; // by block id
+    std::vector<std::pair<int, IRBlock*>> forward_jumps; // immediate index and target
+
+    void emit_binary(Opcode opcode, Register a, Register b, u8 control) {
+        bool is_float = control & CONTROL_FLOAT;
+        int size = control & ~CONTROL_FLOAT;
+        switch(opcode) {
+            case INST_ADD: piece->emit_add(a, b, is_float); break;
+            case INST_SUB: piece->emit_sub(a, b, is_float); break;
+            case INST_MUL: piece->emit_mul(a, b, is_float); break;
+            case INST_DIV: piece->emit_div(a, b, is_float); break;
+            case INST_AND: piece->emit_and(a, b); break;
+            case INST_OR:  piece->emit_or(a, b); break;
+            case INST_EQUAL:         piece->emit_eq(a, b, size, is_float); break;
+            case INST_NOT_EQUAL:     piece->emit_neq(a, b, size, is_float); break;
+            case INST_LESS:          piece->emit_less(a, b, size, is_float); break;
+            case INST_GREATER:       piece->emit_greater(a, b, size, is_float); break;
+            case INST_LESS_EQUAL:    piece->emit_less_equal(a, b, size, is_float); break;
+            case INST_GREATER_EQUAL: piece->emit_greater_equal(a, b, size, is_float); break;
+            default: Assert(false);
+        }
+    }
+    void emit_incr_sp(int amount) {
+        if(amount == 0)
+            return;
+        if(amount == (i16)amount) {
+            piece->emit_incr(REG_SP, amount);
+        } else {
+            piece->emit_li(REG_A, amount);
+            piece->emit_add(REG_SP, REG_A);
+        }
+    }
+    void load(Register reg, const IRLocation& l) {
+        switch(l.kind) {
+            case IRLocation::REG: {
+                if(l.reg != reg)
+                    piece->emit_mov_rr(reg, l.reg);
+            } break;
+            case IRLocation::SLOT: piece->emit_mov_rm_disp(reg, REG_BP, l.size, l.offset); break;
+            case IRLocation::CONST: piece->emit_li(reg, (int)l.imm); break;
+            case IRLocation::DATAPTR: piece->emit_dataptr(reg, (int)l.imm); break;
+            default: Assert(false);
+        }
+    }
+    // The register with the value, scratch is used unless it's in one already
+    Register use(IRInst* v, Register scratch) {
+        auto& l = locs[v->id];
+        if(l.kind == IRLocation::REG)
+            return l.reg;
+        load(scratch, l);
+        return scratch;
+    }
+    // The register to compute the value in
+    Register target(IRInst* v) {
+        auto& l = locs[v->id];
+        return l.kind == IRLocation::REG ? l.reg : REG_A;
+    }
+    // Moves the value computed in reg to its location
+    void define(IRInst* v, Register reg) {
+        auto& l = locs[v->id];
+        if(l.kind == IRLocation::SLOT)
+            piece->emit_mov_mr_disp(REG_BP, reg, l.size, l.offset);
+        else if(l.kind == IRLocation::REG && l.reg != reg)
+            piece->emit_mov_rr(l.reg, reg);
+    }
+    void move(const IRLocation& dst, const IRLocation& src) {
+        if(dst.kind == IRLocation::REG) {
+            load(dst.reg, src);
+        } else {
+            Register reg = src.kind == IRLocation::REG ? src.reg : REG_D;
+            if(src.kind != IRLocation::REG)
+                load(REG_D, src);
+            piece->emit_mov_mr_disp(REG_BP, reg, dst.size, dst.offset);
+        }
+    }
+    void jump_to(IRBlock* target, IRBlock* next) {
+        if(target == next)
+            return;
+        if(block_pc[target->id] != -1) {
+            piece->emit_jmp(block_pc[target->id]);
+        } else {
+            int imm = 0;
+            piece->emit_jmp(&imm);
+            forward_jumps.push_back({ imm, target });
+        }
+    }
+    // the copies into the phis of succ, they happen at the same time
+    void phi_copies(IRBlock* block, IRBlock* succ) {
+        int index = 0;
+        while(succ->preds[index] != block)
+            index++;
+        struct Move {
+            IRLocation dst;
+            IRLocation src;
+        };
+        std::vector<Move> moves;
+        for(auto inst : succ->insts) {
+            if(inst->op != IR_PHI)
+                break;
+            auto& dst = locs[inst->id];
+            auto& src = locs[inst->args[index]->id];
+            if(dst.kind != IRLocation::NONE && !(dst == src))
+                moves.push_back({ dst, src });
+        }
+        while(moves.size()) {
+            bool progress = false;
+            for(int i=0;i<moves.size();i++) {
+                bool blocked = false;
+                for(int j=0;j<moves.size();j++) {
+                    if(j != i && moves[j].src == moves[i].dst)
+                        blocked = true;
+                }
+                if(blocked)
+                    continue;
+                move(moves[i].dst, moves[i].src);
+                moves.erase(moves.begin() + i);
+                progress = true;
+                break;
+            }
+            if(progress)
+                continue;
+            // a cycle, keep what the first move overwrites in A
+            IRLocation saved = moves[0].dst;
+            IRLocation temp{};
+            temp.kind = IRLocation::REG;
+            temp.reg = REG_A;
+            move(temp, saved);
+            for(auto& m : moves) {
+                if(m.src == saved)
+                    m.src = temp;
+            }
+        }
+    }
+
+    void allocate();
+    void lower(IRInst* inst, IRBlock* next);
+};
+
+static void split_critical_edges(IRFunction* ir) {
+    int count = ir->blocks.size();
+    for(int i=0;i<count;i++) {
+        auto block = ir->blocks[i];
+        if(block->succs.size() < 2)
+            continue;
+        for(auto& succ : block->succs) {
+            if(succ->preds.size() < 2)
+                continue;
+            auto middle = ir->createBlock();
+            auto jump = ir->create(IR_JUMP);
+            jump->block = middle;
+            jump->stmt = block->insts.back()->stmt;
+            middle->insts.push_back(jump);
+            middle->preds.push_back(block);
+            middle->succs.push_back(succ);
+            for(auto& pred : succ->preds) {
+                if(pred == block) {
+                    pred = middle;
+                    break;
+                }
+            }
+            succ = middle;
+        }
+    }
+}
+
+void IRLowering::allocate() {
+    int value_count = ir->insts.size();
+    locs.assign(value_count, IRLocation{});
+    std::vector<int> uses(value_count, 0);
+    for(auto block : ir->order) {
+        for(auto inst : block->insts) {
+            for(auto arg : inst->args)
+                uses[arg->id]++;
+        }
+    }
+    auto tracked = [&](IRInst* v) {
+        return v->op != IR_CONST && v->op != IR_DATAPTR && uses[v->id] > 0;
+    };
+
+    // positions in the layout, phis are defined at the start of their block
+    std::vector<int> pos(value_count, 0);
+    std::vector<int> block_start(ir->next_block_id), block_end(ir->next_block_id);
+    std::vector<int> calls;
+    int p = 0;
+    for(auto block : ir->order) {
+        block_start[block->id] = p;
+        p += 2;
+        for(auto inst : block->insts) {
+            if(inst->op == IR_PHI) {
+                pos[inst->id] = block_start[block->id];
+                continue;
+            }
+            pos[inst->id] = p;
+            if(inst->op == IR_CALL)
+                calls.push_back(p);
+            p += 2;
+        }
+        block_end[block->id] = pos[block->insts.back()->id];
+    }
+
+    // liveness at the end of each block
+    int words = (value_count + 63) / 64;
+    std::vector<std::vector<u64>> live_in(ir->next_block_id, std::vector<u64>(words, 0));
+    std::vector<std::vector<u64>> live_out(ir->next_block_id, std::vector<u64>(words, 0));
+    #define SET(S, V) (S[(V) / 64] |= 1ull << ((V) % 64))
+    #define HAS(S, V) ((S[(V) / 64] >> ((V) % 64)) & 1)
+    std::vector<std::vector<u64>> gen_set(ir->next_block_id, std::vector<u64>(words, 0));
+    std::vector<std::vector<u64>> kill_set(ir->next_block_id, std::vector<u64>(words, 0));
+    for(auto block : ir->order) {
+        auto& gen_bits = gen_set[block->id];
+        auto& kill_bits = kill_set[block->id];
+        for(auto inst : block->insts) {
+            if(inst->op != IR_PHI) {
+                for(auto arg : inst->args) {
+                    if(tracked(arg) && !HAS(kill_bits, arg->id))
+                        SET(gen_bits, arg->id);
+                }
+            }
+            SET(kill_bits, inst->id);
+        }
+    }
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(int i=ir->order.size()-1;i>=0;i--) {
+            auto block = ir->order[i];
+            auto& out = live_out[block->id];
+            for(auto succ : block->succs) {
+                auto& in = live_in[succ->id];
+                for(int w=0;w<words;w++)
+                    out[w] |= in[w];
+                int index = 0;
+                while(succ->preds[index] != block)
+                    index++;
+                for(auto inst : succ->insts) {
+                    if(inst->op != IR_PHI)
+                        break;
+                    auto arg = inst->args[index];
+                    if(tracked(arg))
+                        SET(out, arg->id);
+                }
+            }
+            auto& in = live_in[block->id];
+            auto& gen_bits = gen_set[block->id];
+            auto& kill_bits = kill_set[block->id];
+            for(int w=0;w<words;w++) {
+                u64 bits = gen_bits[w] | (out[w] & ~kill_bits[w]);
+                if(bits != in[w]) {
+                    in[w] = bits;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // one interval per value
+    std::vector<int> start(value_count, INT32_MAX), end(value_count, -1);
+    for(auto block : ir->order) {
+        for(auto inst : block->insts) {
+            if(!tracked(inst))
+                continue;
+            start[inst->id] = std::min(start[inst->id], pos[inst->id]);
+            end[inst->id] = std::max(end[inst->id], pos[inst->id]);
+            if(inst->op == IR_PHI) {
+                // written at the end of the predecessors
+                for(auto pred : block->preds) {
+                    start[inst->id] = std::min(start[inst->id], block_end[pred->id]);
+                    end[inst->id] = std::max(end[inst->id], block_end[pred->id]);
+                }
+            }
+        }
+    }
+    for(auto block : ir->order) {
+        for(auto inst : block->insts) {
+            for(int i=0;i<inst->args.size();i++) {
+                auto arg = inst->args[i];
+                if(!tracked(arg))
+                    continue;
+                int at = inst->op == IR_PHI ? block_end[block->preds[i]->id] : pos[inst->id];
+                end[arg->id] = std::max(end[arg->id], at);
+            }
+        }
+        auto& out = live_out[block->id];
+        for(int v=0;v<value_count;v++) {
+            if(HAS(out, v))
+                end[v] = std::max(end[v], block_end[block->id]);
+        }
+    }
+    #undef SET
+    #undef HAS
+
+    std::vector<IRInst*> values;
+    for(auto block : ir->order) {
+        for(auto inst : block->insts) {
+            if(inst->op == IR_CONST || inst->op == IR_DATAPTR) {
+                locs[inst->id].kind = inst->op == IR_CONST ? IRLocation::CONST : IRLocation::DATAPTR;
+                locs[inst->id].imm = inst->imm;
+                Assert(inst->imm == (i64)(int)inst->imm);
+            } else if(tracked(inst)) {
+                values.push_back(inst);
+            }
+        }
+    }
+    std::sort(values.begin(), values.end(), [&](IRInst* a, IRInst* b) {
+        if(start[a->id] != start[b->id])
+            return start[a->id] < start[b->id];
+        return a->id < b->id;
+    });
+
+    int next_slot = gen->current_frameOffset;
+    auto spill = [&](IRInst* v) {
+        next_slot -= 8;
+        auto& l = locs[v->id];
+        l.kind = IRLocation::SLOT;
+        l.offset = next_slot;
+        l.size = v->op == IR_TRUNC ? v->size : 8;
+    };
+    // linear scan, values live across a call are kept in the frame since calls clobber every register
+    struct Active {
+        IRInst* value;
+        Register reg;
+    };
+    std::vector<Active> active;
+    for(auto v : values) {
+        int s = start[v->id], e = end[v->id];
+        for(int i=0;i<active.size();i++) {
+            if(end[active[i].value->id] <= s) {
+                active.erase(active.begin() + i);
+                i--;
+            }
+        }
+        bool crosses_call = false;
+        for(auto c : calls) {
+            if(s < c && c < e) {
+                crosses_call = true;
+                break;
+            }
+        }
+        if(crosses_call) {
+            spill(v);
+            continue;
+        }
+        Register free_reg = REG_INVALID;
+        for(auto reg : allocatable_registers) {
+            bool taken = false;
+            for(auto& a : active) {
+                if(a.reg == reg)
+                    taken = true;
+            }
+            if(!taken) {
+                free_reg = reg;
+                break;
+            }
+        }
+        if(free_reg != REG_INVALID) {
+            locs[v->id].kind = IRLocation::REG;
+            locs[v->id].reg = free_reg;
+            active.push_back({ v, free_reg });
+            continue;
+        }
+        // the value that is needed for the longest is kept in memory
+        int furthest = 0;
+        for(int i=1;i<active.size();i++) {
+            if(end[active[i].value->id] > end[active[furthest].value->id])
+                furthest = i;
+        }
+        if(end[active[furthest].value->id] > e) {
+            auto victim = active[furthest];
+            spill(victim.value);
+            locs[v->id].kind = IRLocation::REG;
+            locs[v->id].reg = victim.reg;
+            active[furthest] = { v, victim.reg };
+        } else {
+            spill(v);
+        }
+    }
+    // A value computed at the end of a loop for a phi (i + 1) goes in the
+    // register of the phi if the phi isn't used after it, the copy then disappears
+    for(auto block : ir->order) {
+        for(auto phi : block->insts) {
+            if(phi->op != IR_PHI)
+                break;
+            if(locs[phi->id].kind != IRLocation::REG)
+                continue;
+            for(int k=0;k<block->preds.size();k++) {
+                auto pred = block->preds[k];
+                auto v = phi->args[k];
+                // only in the loop where nothing else has the register of the phi
+                if(v->block != pred || v->op == IR_PHI || pred->succs.size() != 1 || !tracked(v) || start[phi->id] > pos[v->id])
+                    continue;
+                bool used_after = false;
+                bool after = false;
+                for(auto inst : pred->insts) {
+                    for(auto arg : inst->args)
+                        used_after = used_after || (after && arg == phi);
+                    after = after || inst == v;
+                }
+                for(auto other : block->insts) {
+                    if(other->op != IR_PHI)
+                        break;
+                    used_after = used_after || other->args[k] == phi;
+                }
+                if(!used_after)
+                    locs[v->id] = locs[phi->id];
+            }
+        }
+    }
+    for(auto v : values) {
+        if(v->op == IR_TRUNC && locs[v->id].kind == IRLocation::REG) {
+            next_slot -= 8;
+            trunc_slot = next_slot;
+            break;
+        }
+    }
+    frame_offset = next_slot;
+}
+
+void IRLowering::lower(IRInst* inst, IRBlock* next) {
+    switch(inst->op) {
+        case IR_CONST:
+        case IR_DATAPTR:
+        case IR_PHI: break;
+        case IR_PARAM: {
+            if(locs[inst->id].kind == IRLocation::NONE)
+                break;
+            Register reg = target(inst);
+            piece->emit_mov_rm_disp(reg, REG_BP, inst->size, inst->imm);
+            define(inst, reg);
+        } break;
+        case IR_LOAD: {
+            Register base = use(inst->args[0], REG_D);
+            Register reg = target(inst);
+            piece->emit_mov_rm_disp(reg, base, inst->size, inst->imm);
+            define(inst, reg);
+        } break;
+        case IR_STORE: {
+            Register base = use(inst->args[0], REG_D);
+            Register value = use(inst->args[1], REG_A);
+            piece->emit_mov_mr_disp(base, value, inst->size, inst->imm);
+        } break;
+        case IR_BINARY: {
+            Register reg = target(inst);
+            IRInst* a = inst->args[0];
+            IRInst* b = inst->args[1];
+            auto& la = locs[a->id];
+            auto& lb = locs[b->id];
+            if(is_commutative(inst) && lb.kind == IRLocation::REG && lb.reg == reg && !(la.kind == IRLocation::REG && la.reg == reg)) {
+                std::swap(a, b);
+            }
+            auto& rb_loc = locs[b->id];
+            if((inst->opcode == INST_ADD || inst->opcode == INST_SUB) && inst->control == CONTROL_NONE && rb_loc.kind == IRLocation::CONST) {
+                i64 amount = inst->opcode == INST_ADD ? rb_loc.imm : -rb_loc.imm;
+                if(amount == (i16)amount) {
+                    load(reg, locs[a->id]);
+                    piece->emit_incr(reg, amount);
+                    define(inst, reg);
+                    break;
+                }
+            }
+            Register rb = REG_INVALID;
+            if(rb_loc.kind == IRLocation::REG) {
+                rb = rb_loc.reg;
+                if(rb == reg && a != b) {
+                    piece->emit_mov_rr(REG_D, rb);
+                    rb = REG_D;
+                }
+            } else {
+                rb = use(b, REG_D);
+            }
+            load(reg, locs[a->id]);
+            emit_binary(inst->opcode, reg, rb, inst->control);
+            define(inst, reg);
+        } break;
+        case IR_NOT: {
+            Register reg = target(inst);
+            Register ra = use(inst->args[0], REG_D);
+            piece->emit_not(reg, ra);
+            define(inst, reg);
+        } break;
+        case IR_CAST: {
+            Register reg = target(inst);
+            load(reg, locs[inst->args[0]->id]);
+            piece->emit_cast(reg, (CastType)inst->imm);
+            define(inst, reg);
+        } break;
+        case IR_TRUNC: {
+            auto& l = locs[inst->id];
+            if(l.kind == IRLocation::NONE)
+                break;
+            Register reg = target(inst);
+            load(reg, locs[inst->args[0]->id]);
+            if(l.kind == IRLocation::REG) {
+                // through memory like a variable
+                piece->emit_mov_mr_disp(REG_BP, reg, inst->size, trunc_slot);
+                piece->emit_mov_rm_disp(reg, REG_BP, inst->size, trunc_slot);
+            } else {
+                define(inst, reg); // the slot has the size of the value
+            }
+        } break;
+        case IR_CALL: {
+            auto fun = inst->callee;
+            emit_incr_sp(-fun->parameters_size);
+            for(int i=0;i<inst->args.size();i++) {
+                auto& param = fun->parameters[i];
+                Register reg = use(inst->args[i], REG_A);
+                piece->emit_mov_mr_disp(REG_SP, reg, gen->ast->sizeOfType(param.typeId), param.offset - 16);
+            }
+            int relocation_index = 0;
+            piece->emit_call(&relocation_index);
+            piece->addRelocation(fun, relocation_index);
+            bool has_value = locs[inst->id].kind != IRLocation::NONE;
+            Register reg = target(inst);
+            if(has_value)
+                piece->emit_mov_rm_disp(reg, REG_SP, inst->size, fun->return_offset - 16);
+            emit_incr_sp(fun->parameters_size);
+            if(has_value)
+                define(inst, reg);
+        } break;
+        case IR_JUMP: {
+            auto succ = inst->block->succs[0];
+            phi_copies(inst->block, succ);
+            jump_to(succ, next);
+        } break;
+        case IR_BRANCH: {
+            auto block = inst->block;
+            Register cond = use(inst->args[0], REG_A);
+            auto on_false = block->succs[1];
+            if(block_pc[on_false->id] != -1) {
+                piece->emit_jz(cond, block_pc[on_false->id]);
+            } else {
+                int imm = 0;
+                piece->emit_jz(cond, &imm);
+                forward_jumps.push_back({ imm, on_false });
+            }
+            jump_to(block->succs[0], next);
+        } break;
+        case IR_RETURN: {
+            if(inst->args.size()) {
+                Register reg = use(inst->args[0], REG_A);
+                piece->emit_mov_mr_disp(REG_BP, reg, inst->size, ir->function->return_offset);
+            }
+            emit_incr_sp(-frame_offset);
+            piece->emit_ret();
+        } break;
+        case IR_TAILCALL: {
+            auto fun = inst->callee;
+            for(int i=0;i<inst->args.size();i++) {
+                auto& param = fun->parameters[i];
+                Register reg = use(inst->args[i], REG_A);
+                piece->emit_mov_mr_disp(REG_BP, reg, gen->ast->sizeOfType(param.typeId), param.offset);
+            }
+            // sp is at bp like before ret, the return value is written by the callee
+            emit_incr_sp(-frame_offset);
+            if(fun == ir->function) {
+                piece->emit_jmp(0);
+            } else {
+                int relocation_index = 0;
+                piece->emit_tailcall(&relocation_index);
+                piece->addRelocation(fun, relocation_index);
+            }
+        } break;
+        default: Assert(false);
+    }
+}
+
+void LowerIR(IRFunction* ir, GeneratorContext* context) {
+    ZoneScopedC(tracy::Color::Blue2);
+    split_critical_edges(ir);
+    ir->analyze();
+
+    IRLowering lowering{};
+    lowering.ir = ir;
+    lowering.gen = context;
+    lowering.piece = context->piece;
+    lowering.allocate();
+    auto piece = context->piece;
+
+    lowering.emit_incr_sp(lowering.frame_offset - context->current_frameOffset);
+    lowering.block_pc.assign(ir->next_block_id, -1);
+    ASTStatement* last_stmt = nullptr;
+    for(int i=0;i<ir->order.size();i++) {
+        auto block = ir->order[i];
+        auto next = i+1 < ir->order.size() ? ir->order[i+1] : nullptr;
+        lowering.block_pc[block->id] = piece->get_pc();
+        for(auto inst : block->insts) {
+            #ifndef DISABLE_DEBUG_LINES
+            if(inst->stmt && inst->stmt != last_stmt) {
+                auto stream = context->current_stream;
+                piece->push_line(stream->getToken(inst->stmt->location)->line, stream->getline(inst->stmt->location));
+                last_stmt = inst->stmt;
+            }
+            #endif
+            lowering.lower(inst, next);
+        }
+    }
+    for(auto& jump : lowering.forward_jumps) {
+        int target_pc = lowering.block_pc[jump.second->id];
+        Assert(target_pc != -1);
+        *(int*)&piece->instructions[jump.first] = target_pc - jump.first;
+    }
+    context->current_frameOffset = 0;
+}
@@ -0,0 +1,570 @@
+#include "JIT.h"
+#include "VirtualMachine.h"
+
+JitExit JitCode::run(i64* registers, int pc) {
+    if(pc < 0 || pc >= entry_points.size() || !entry_points[pc])
+        return JIT_EXIT_INTERPRET;
+    typedef int (*JitFunc)(i64* registers, void* entry);
+    return (JitExit)((JitFunc)memory)(registers, entry_points[pc]);
+}
+void JitFree(JitCode* code) {
+    if(!code)
+        return;
+    if(code->memory)
+        FreeExecutable(code->memory, code->memory_size);
+    DELNEW(code, JitCode, HERE);
+}
+
+#ifndef JIT_SUPPORTED
+
+JitCode* JitCompile(VirtualMachine* vm, BytecodePiece* piece) {
+    return nullptr;
+}
+
+#else
+
+void jit_native_call(VirtualMachine* vm, int type) {
+    if(type < 0)
+        vm->run_host_call(host_native_index(type - NATIVE_MAX));
+    else
+        vm->run_native_call((NativeCalls)type); // machine code can't stop, a native given bad memory only returns its error value
+}
+static void jit_memzero(void* ptr, i64 size) {
+    memset(ptr, 0, size);
+}
+static void jit_memcpy(void* dst, void* src, i64 size) {
+    memmove(dst, src, size);
+}
+
+enum X64Reg : u8 {
+    RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+    NO_HOST_REG = 0xFF,
+};
+enum X64Cond : u8 {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+    CC_P = 0xA, CC_NP = 0xB, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF,
+};
+
+// rax, rcx, rdx and r11 are scratch registers, rbp points to the VM registers
+static const X64Reg host_of[REG_COUNT] {
+    NO_HOST_REG, // REG_INVALID
+    RBX,         // REG_A
+    RSI,         // REG_B
+    RDI,         // REG_C
+    R8,          // REG_D
+    R9,          // REG_E
+    R10,         // REG_F
+    R12,         // REG_SP
+    R13,         // REG_BP
+    NO_HOST_REG, // REG_PC
+    R14,         // REG_T0
+    R15,         // REG_T1
+};
+#ifdef OS_WINDOWS
+static const X64Reg ARG0 = RCX, ARG1 = RDX, ARG2 = R8;
+#else
+static const X64Reg ARG0 = RDI, ARG1 = RSI, ARG2 = RDX;
+#endif
+// callee saved registers on both Windows and System V, pushed in this order
+static const X64Reg saved_regs[] { RBX, RBP, RSI, RDI, R12, R13, R14, R15 };
+static const int SAVED_REG_COUNT = sizeof(saved_regs)/sizeof(*saved_regs);
+// keeps the host stack aligned and gives Windows its shadow space
+static const int FRAME_SPACE = 40;
+
+struct X64Builder {
+    std::vector<u8> code;
+    struct Fixup {
+        int pos; // position of rel32
+        int target_pc;
+    };
+    std::vector<Fixup> fixups;
+
+    int pos() { return code.size(); }
+    void emit1(u8 b) { code.push_back(b); }
+    void emit4(u32 v) { for(int i=0;i<4;i++) emit1(v >> (i*8)); }
+    void emit8(u64 v) { for(int i=0;i<8;i++) emit1(v >> (i*8)); }
+    void patch4(int at, u32 v) { for(int i=0;i<4;i++) code[at + i] = v >> (i*8); }
+
+    void rex(bool w, int reg, int rm, bool force = false) {
+        u8 r = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+        if(r != 0x40 || force)
+            emit1(r);
+    }
+    void modrm_rr(int reg, int rm) {
+        emit1(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+    // [base + disp32]
+    void modrm_mem(int reg, int base, int disp) {
+        emit1(0x80 | ((reg & 7) << 3) | (base & 7));
+        if((base & 7) == RSP)
+            emit1(0x24); // sib, no index
+        emit4(disp);
+    }
+    // <opcode> r/m64, r64
+    void op_rr(u8 opcode, X64Reg dst, X64Reg src) {
+        rex(true, src, dst);
+        emit1(opcode);
+        modrm_rr(src, dst);
+    }
+    void mov_rr(X64Reg dst, X64Reg src) {
+        if(dst != src)
+            op_rr(0x89, dst, src);
+    }
+    void mov_ri(X64Reg dst, i64 imm) {
+        if(imm == (i64)(i32)imm) {
+            rex(true, 0, dst);
+            emit1(0xC7);
+            modrm_rr(0, dst);
+            emit4(imm);
+        } else {
+            rex(true, 0, dst);
+            emit1(0xB8 + (dst & 7));
+            emit8(imm);
+        }
+    }
+    // zero extends like the interpreter
+    void load(int size, X64Reg dst, X64Reg base, int disp) {
+        switch(size) {
+            case 1: rex(true, dst, base); emit1(0x0F); emit1(0xB6); break;
+            case 2: rex(true, dst, base); emit1(0x0F); emit1(0xB7); break;
+            case 4: rex(false, dst, base); emit1(0x8B); break;
+            case 8: rex(true, dst, base); emit1(0x8B); break;
+        }
+        modrm_mem(dst, base, disp);
+    }
+    void store(int size, X64Reg base, int disp, X64Reg src) {
+        switch(size) {
+            case 1: rex(false, src, base, true); emit1(0x88); break;
+            case 2: emit1(0x66); rex(false, src, base); emit1(0x89); break;
+            case 4: rex(false, src, base); emit1(0x89); break;
+            case 8: rex(true, src, base); emit1(0x89); break;
+        }
+        modrm_mem(src, base, disp);
+    }
+    void add_ri(X64Reg dst, i32 imm) {
+        rex(true, 0, dst);
+        emit1(0x81);
+        modrm_rr(0, dst);
+        emit4(imm);
+    }
+    void test_rr(X64Reg a) { op_rr(0x85, a, a); }
+    void setcc_al(X64Cond cc) { emit1(0x0F); emit1(0x90 | cc); emit1(0xC0); }
+    void setcc_cl(X64Cond cc) { emit1(0x0F); emit1(0x90 | cc); emit1(0xC1); }
+    void movzx_eax_al() { emit1(0x0F); emit1(0xB6); emit1(0xC0); }
+    // movd xmm, r32
+    void movd_xmm_r(int xmm, X64Reg src) { emit1(0x66); rex(false, xmm, src); emit1(0x0F); emit1(0x6E); modrm_rr(xmm, src); }
+    // movd eax, xmm0
+    void movd_eax_xmm0() { emit1(0x66); emit1(0x0F); emit1(0x7E); emit1(0xC0); }
+    // 0F <opcode> xmm, xmm with optional F3 prefix
+    void sse(bool f3, u8 opcode, int dst, int src) { if(f3) emit1(0xF3); emit1(0x0F); emit1(opcode); modrm_rr(dst, src); }
+
+    void jmp_to(int target) {
+        emit1(0xE9);
+        emit4(target - (pos() + 4));
+    }
+    void jcc_to(X64Cond cc, int target) {
+        emit1(0x0F); emit1(0x80 | cc);
+        emit4(target - (pos() + 4));
+    }
+    void jmp_pc(int target_pc) {
+        emit1(0xE9);
+        fixups.push_back({pos(), target_pc});
+        emit4(0);
+    }
+    void jcc_pc(X64Cond cc, int target_pc) {
+        emit1(0x0F); emit1(0x80 | cc);
+        fixups.push_back({pos(), target_pc});
+        emit4(0);
+    }
+    void call_abs(void* func) {
+        mov_ri(RAX, (i64)func);
+        emit1(0xFF); emit1(0xD0); // call rax
+    }
+    void push(X64Reg r) { rex(false, 0, r); emit1(0x50 + (r & 7)); }
+    void pop(X64Reg r) { rex(false, 0, r); emit1(0x58 + (r & 7)); }
+};
+
+struct JitCompiler {
+    VirtualMachine* vm = nullptr;
+    BytecodePiece* piece = nullptr;
+    X64Builder b{};
+
+    int exit_label = 0;     // expects exit code in eax and pc in edx
+    int overflow_label = 0;
+
+    bool compile(JitCode* out);
+    bool compile_instruction(Instruction inst, int imm, int pc, int next_pc);
+
+    void spill() {
+        for(int r=0;r<REG_COUNT;r++) {
+            if(host_of[r] != NO_HOST_REG)
+                b.store(8, RBP, r * 8, host_of[r]);
+        }
+    }
+    void reload() {
+        for(int r=0;r<REG_COUNT;r++) {
+            if(host_of[r] != NO_HOST_REG)
+                b.load(8, host_of[r], RBP, r * 8);
+        }
+    }
+    void exit_at(int pc) {
+        b.emit1(0xBA); b.emit4(pc);                 // mov edx, pc
+        b.emit1(0xB8); b.emit4(JIT_EXIT_INTERPRET); // mov eax, code
+        b.jmp_to(exit_label);
+    }
+    void check_stack_low() {
+        b.mov_ri(RAX, (i64)vm->stack);
+        b.op_rr(0x39, R12, RAX); // cmp r12, rax
+        b.jcc_to(CC_B, overflow_label);
+    }
+    void check_stack_high() {
+        b.mov_ri(RAX, (i64)vm->stack + vm->stack_max);
+        b.op_rr(0x39, R12, RAX);
+        b.jcc_to(CC_A, overflow_label);
+    }
+    void push(X64Reg r) {
+        b.add_ri(R12, -8);
+        check_stack_low();
+        b.store(8, R12, 0, r);
+    }
+    void pop(X64Reg r) {
+        b.load(8, r, R12, 0);
+        b.add_ri(R12, 8);
+        check_stack_high();
+    }
+    // replaces the low 32 bits of dst with eax, floats only write 32 bits in the interpreter
+    void merge_low32(X64Reg dst) {
+        b.mov_rr(RCX, dst);
+        b.emit1(0x48); b.emit1(0xC1); b.emit1(0xE9); b.emit1(32); // shr rcx, 32
+        b.emit1(0x48); b.emit1(0xC1); b.emit1(0xE1); b.emit1(32); // shl rcx, 32
+        b.op_rr(0x09, RCX, RAX); // or rcx, rax
+        b.mov_rr(dst, RCX);
+    }
+    bool binary_op(Opcode opcode, X64Reg a, X64Reg c, ControlFlags control);
+};
+
+bool JitCompiler::binary_op(Opcode opcode, X64Reg a, X64Reg c, ControlFlags control) {
+    bool is_float = control & CONTROL_FLOAT;
+    if(is_float && opcode >= INST_ADD && opcode <= INST_DIV) {
+        u8 sse_op = 0;
+        switch(opcode) {
+            case INST_ADD: sse_op = 0x58; break;
+            case INST_SUB: sse_op = 0x5C; break;
+            case INST_MUL: sse_op = 0x59; break;
+            case INST_DIV: sse_op = 0x5E; break;
+            default: break;
+        }
+        b.movd_xmm_r(0, a);
+        b.movd_xmm_r(1, c);
+        b.sse(true, sse_op, 0, 1);
+        b.movd_eax_xmm0();
+        merge_low32(a);
+        return true;
+    }
+    switch(opcode) {
+        case INST_ADD: b.op_rr(0x01, a, c); return true;
+        case INST_SUB: b.op_rr(0x29, a, c); return true;
+        case INST_MUL: {
+            b.rex(true, a, c); b.emit1(0x0F); b.emit1(0xAF); b.modrm_rr(a, c); // imul a, c
+        } return true;
+        case INST_DIV: {
+            b.mov_rr(RAX, a);
+            b.emit1(0x48); b.emit1(0x99); // cqo
+            b.rex(true, 0, c); b.emit1(0xF7); b.modrm_rr(7, c); // idiv c
+            b.mov_rr(a, RAX);
+        } return true;
+        case INST_AND:
+        case INST_OR: {
+            b.test_rr(a);
+            b.setcc_al(CC_NE);
+            b.test_rr(c);
+            b.setcc_cl(CC_NE);
+            b.emit1(opcode == INST_AND ? 0x20 : 0x08); b.emit1(0xC8); // and/or al, cl
+            b.movzx_eax_al();
+            b.mov_rr(a, RAX);
+        } return true;
+        default: break;
+    }
+    if(opcode < INST_EQUAL || opcode > INST_GREATER_EQUAL)
+        return false;
+
+    if(is_float) {
+        b.movd_xmm_r(0, a);
+        b.movd_xmm_r(1, c);
+        // unordered comparisons set ZF, PF and CF which makes everything but != false
+        switch(opcode) {
+            case INST_EQUAL: {
+                b.sse(false, 0x2E, 0, 1); // ucomiss xmm0, xmm1
+                b.setcc_al(CC_E);
+                b.setcc_cl(CC_NP);
+                b.emit1(0x20); b.emit1(0xC8);
+            } break;
+            case INST_NOT_EQUAL: {
+                b.sse(false, 0x2E, 0, 1);
+                b.setcc_al(CC_NE);
+                b.setcc_cl(CC_P);
+                b.emit1(0x08); b.emit1(0xC8);
+            } break;
+            case INST_LESS:          b.sse(false, 0x2E, 1, 0); b.setcc_al(CC_A); break;
+            case INST_LESS_EQUAL:    b.sse(false, 0x2E, 1, 0); b.setcc_al(CC_AE); break;
+            case INST_GREATER:       b.sse(false, 0x2E, 0, 1); b.setcc_al(CC_A); break;
+            case INST_GREATER_EQUAL: b.sse(false, 0x2E, 0, 1); b.setcc_al(CC_AE); break;
+            default: break;
+        }
+    } else {
+        if(control & CONTROL_1B) {
+            b.rex(false, c, a, true); b.emit1(0x38); b.modrm_rr(c, a); // cmp a8, c8
+        } else {
+            b.op_rr(0x39, a, c); // cmp a, c
+        }
+        X64Cond cc = CC_E;
+        switch(opcode) {
+            case INST_EQUAL:         cc = CC_E; break;
+            case INST_NOT_EQUAL:     cc = CC_NE; break;
+            case INST_LESS:          cc = CC_L; break;
+            case INST_LESS_EQUAL:    cc = CC_LE; break;
+            case INST_GREATER:       cc = CC_G; break;
+            case INST_GREATER_EQUAL: cc = CC_GE; break;
+            default: break;
+        }
+        b.setcc_al(cc);
+    }
+    b.movzx_eax_al();
+    b.mov_rr(a, RAX);
+    return true;
+}
+
+bool JitCompiler::compile_instruction(Instruction inst, int imm, int pc, int next_pc) {
+    X64Reg r0 = inst.op0 < REG_COUNT ? host_of[inst.op0] : NO_HOST_REG;
+    X64Reg r1 = inst.op1 < REG_COUNT ? host_of[inst.op1] : NO_HOST_REG;
+    ControlFlags control = (ControlFlags)inst.op2;
+    int size = inst.op2;
+    bool valid_size = size == 1 || size == 2 || size == 4 || size == 8;
+    int target_pc = next_pc - 1 + imm; // jumps are relative to the immediate
+    bool valid_target = target_pc >= 0 && target_pc <= piece->instructions.size();
+
+    #define NEED(E) if(!(E)) return false;
+    switch(inst.opcode) {
+        case INST_NOP: break;
+        case INST_CAST: {
+            NEED(r0 != NO_HOST_REG)
+            if((CastType)inst.op1 == CAST_INT_FLOAT) {
+                b.emit1(0xF3); b.rex(false, 0, r0); b.emit1(0x0F); b.emit1(0x2A); b.modrm_rr(0, r0); // cvtsi2ss xmm0, r32
+                b.movd_eax_xmm0();
+                merge_low32(r0);
+            } else if((CastType)inst.op1 == CAST_FLOAT_INT) {
+                b.movd_xmm_r(0, r0);
+                b.emit1(0xF3); b.emit1(0x0F); b.emit1(0x2C); b.emit1(0xC0); // cvttss2si eax, xmm0
+                merge_low32(r0);
+            }
+        } break;
+        case INST_MOV_RR: {
+            NEED(r0 != NO_HOST_REG && r1 != NO_HOST_REG)
+            b.mov_rr(r0, r1);
+        } break;
+        case INST_MOV_MR:
+        case INST_MOV_MR_DISP: {
+            NEED(r0 != NO_HOST_REG && r1 != NO_HOST_REG && valid_size)
+            b.store(size, r0, inst.opcode == INST_MOV_MR ? 0 : imm, r1);
+        } break;
+        case INST_MOV_RM:
+        case INST_MOV_RM_DISP: {
+            NEED(r0 != NO_HOST_REG && r1 != NO_HOST_REG && valid_size)
+            b.load(size, r0, r1, inst.opcode == INST_MOV_RM ? 0 : imm);
+        } break;
+        case INST_PUSH: {
+            NEED(r0 != NO_HOST_REG)
+            push(r0);
+        } break;
+        case INST_POP: {
+            NEED(r0 != NO_HOST_REG)
+            pop(r0);
+        } break;
+        case INST_INCR: {
+            NEED(r0 != NO_HOST_REG)
+            int value = decode_incr(inst);
+            b.add_ri(r0, value);
+            if(inst.op0 == REG_SP) {
+                if(value < 0) check_stack_low();
+                else check_stack_high();
+            }
+        } break;
+        case INST_LI: {
+            NEED(r0 != NO_HOST_REG)
+            b.mov_ri(r0, imm);
+        } break;
+        case INST_DATAPTR: {
+            NEED(r0 != NO_HOST_REG)
+            b.mov_ri(r0, (i64)(vm->global_data + imm));
+        } break;
+        case INST_JMP: {
+            NEED(valid_target)
+            b.jmp_pc(target_pc);
+        } break;
+        case INST_JZ: {
+            NEED(r0 != NO_HOST_REG && valid_target)
+            b.test_rr(r0);
+            b.jcc_pc(CC_E, target_pc);
+        } break;
+        case INST_CALL: {
+            if(imm >= 0) {
+                // the interpreter sets up frames for other pieces
+                exit_at(pc);
+                break;
+            }
+            spill();
+            b.mov_ri(ARG0, (i64)vm);
+            b.mov_ri(ARG1, imm + NATIVE_MAX);
+            b.call_abs((void*)&jit_native_call);
+            reload();
+        } break;
+        case INST_MEMZERO: {
+            NEED(r0 != NO_HOST_REG && r1 != NO_HOST_REG)
+            spill();
+            b.load(8, ARG0, RBP, inst.op0 * 8);
+            b.load(8, ARG1, RBP, inst.op1 * 8);
+            b.call_abs((void*)&jit_memzero);
+            reload();
+        } break;
+        case INST_MEMCPY:
+        case INST_MEMCPY_IMM: {
+            NEED(r0 != NO_HOST_REG && r1 != NO_HOST_REG)
+            NEED(inst.opcode == INST_MEMCPY_IMM || (inst.op2 < REG_COUNT && host_of[inst.op2] != NO_HOST_REG))
+            spill();
+            b.load(8, ARG0, RBP, inst.op0 * 8);
+            b.load(8, ARG1, RBP, inst.op1 * 8);
+            if(inst.opcode == INST_MEMCPY)
+                b.load(8, ARG2, RBP, inst.op2 * 8);
+            else
+                b.mov_ri(ARG2, imm);
+            b.call_abs((void*)&jit_memcpy);
+            reload();
+        } break;
+        case INST_PUSH_LI: {
+            NEED(r0 != NO_HOST_REG)
+            b.mov_ri(r0, imm);
+            push(r0);
+        } break;
+        case INST_PUSH_RM_DISP: {
+            NEED(r0 != NO_HOST_REG && r1 != NO_HOST_REG && valid_size)
+            b.load(size, r0, r1, imm);
+            push(r0);
+        } break;
+        case INST_STACK_OP: {
+            NEED(r0 != NO_HOST_REG && r1 != NO_HOST_REG)
+            b.mov_rr(r1, r0);
+            pop(r0);
+            NEED(binary_op((Opcode)imm, r0, r1, control))
+        } break;
+        case INST_CMP_JZ: {
+            NEED(r0 != NO_HOST_REG && r1 != NO_HOST_REG && valid_target)
+            NEED(binary_op(decode_cmp_jz(inst), r0, r1, decode_cmp_jz_control(inst)))
+            b.test_rr(r0);
+            b.jcc_pc(CC_E, target_pc);
+        } break;
+        case INST_NOT: {
+            NEED(r0 != NO_HOST_REG && r1 != NO_HOST_REG)
+            b.test_rr(r1);
+            b.setcc_al(CC_E);
+            b.movzx_eax_al();
+            b.mov_rr(r0, RAX);
+        } break;
+        default: {
+            if(inst.opcode >= INST_ADD && inst.opcode <= INST_GREATER_EQUAL) {
+                NEED(r0 != NO_HOST_REG && r1 != NO_HOST_REG)
+                NEED(binary_op(inst.opcode, r0, r1, control))
+                break;
+            }
+            // ret, halt and anything new is left to the interpreter
+            exit_at(pc);
+        }
+    }
+    #undef NEED
+    return true;
+}
+
+bool JitCompiler::compile(JitCode* out) {
+    auto& insts = piece->instructions;
+
+    // entry, registers in the first argument and machine code to start at in the second
+    for(int i=0;i<SAVED_REG_COUNT;i++)
+        b.push(saved_regs[i]);
+    b.add_ri(RSP, -FRAME_SPACE);
+    b.mov_rr(RAX, ARG1);
+    b.mov_rr(RBP, ARG0);
+    reload();
+    b.emit1(0xFF); b.emit1(0xE0); // jmp rax
+
+    exit_label = b.pos();
+    spill();
+    b.store(8, RBP, REG_PC * 8, RDX);
+    b.add_ri(RSP, FRAME_SPACE);
+    for(int i=SAVED_REG_COUNT-1;i>=0;i--)
+        b.pop(saved_regs[i]);
+    b.emit1(0xC3); // ret
+
+    overflow_label = b.pos();
+    b.emit1(0x31); b.emit1(0xD2); // xor edx, edx
+    b.emit1(0xB8); b.emit4(JIT_EXIT_STACK_OVERFLOW);
+    b.jmp_to(exit_label);
+
+    std::vector<int> offset_of_pc(insts.size() + 1, -1);
+    int pc = 0;
+    while(pc < insts.size()) {
+        Instruction inst = insts[pc];
+        offset_of_pc[pc] = b.pos();
+        int next_pc = pc + 1;
+        int imm = 0;
+        if(inst.opcode >= INST_IMMEDIATES) {
+            if(next_pc >= insts.size())
+                return false;
+            imm = *(int*)&insts[next_pc];
+            next_pc++;
+        }
+        if(!compile_instruction(inst, imm, pc, next_pc))
+            return false;
+        pc = next_pc;
+    }
+    // falling or jumping off the end is reported by the interpreter
+    offset_of_pc[insts.size()] = b.pos();
+    exit_at(insts.size());
+
+    for(auto& f : b.fixups) {
+        int target = offset_of_pc[f.target_pc];
+        if(target == -1)
+            return false; // jump into an immediate
+        b.patch4(f.pos, target - (f.pos + 4));
+    }
+
+    out->memory_size = b.code.size();
+    out->memory = (u8*)AllocateExecutable(out->memory_size);
+    if(!out->memory)
+        return false;
+    memcpy(out->memory, b.code.data(), b.code.size());
+    if(!ProtectExecutable(out->memory, out->memory_size))
+        return false;
+
+    out->entry_points.resize(insts.size(), nullptr);
+    for(int i=0;i<insts.size();i++) {
+        if(offset_of_pc[i] != -1)
+            out->entry_points[i] = out->memory + offset_of_pc[i];
+    }
+    return true;
+}
+
+JitCode* JitCompile(VirtualMachine* vm, BytecodePiece* piece) {
+    ZoneScopedC(tracy::Color::Orange);
+    JitCompiler compiler{};
+    compiler.vm = vm;
+    compiler.piece = piece;
+
+    JitCode* code = NEW(JitCode, HERE);
+    if(!compiler.compile(code)) {
+        JitFree(code);
+        return nullptr;
+    }
+    return code;
+}
+
+#endif
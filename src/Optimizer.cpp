@@ -0,0 +1,856 @@
+#include "Optimizer.h"
+#include "AST.h"
+
+/*
+    The optimizer decodes a piece into a list of nodes where jumps refer to
+    other nodes instead of relative offsets. Passes mark nodes as removed or
+    rewrite them in place, the list is compacted after each pass and
+    encoded back into the piece at the end. Relocations and debug lines
+    follow the nodes they belong to.
+
+    The generator never keeps values in registers across calls and returns,
+    only the stack and base pointer survive them. The passes rely on this.
+*/
+
+const char* optimization_pass_names[] {
+    "jump-threading",   // OPT_JUMP_THREADING
+    "push-pop",         // OPT_PUSH_POP
+    "copy-propagation", // OPT_COPY_PROPAGATION
+    "constant-fold",    // OPT_CONSTANT_FOLD
+    "dead-store",       // OPT_DEAD_STORE
+    "merge-incr",       // OPT_MERGE_INCR
+    "superinstructions", // OPT_SUPERINSTRUCTIONS
+    "inline",           // OPT_INLINE
+};
+OptimizationPass FindOptimizationPass(const char* name) {
+    for(int i=0;i<OPT_PASS_COUNT;i++) {
+        if(!strcmp(name, optimization_pass_names[i]))
+            return (OptimizationPass)(1 << i);
+    }
+    return OPT_NONE;
+}
+
+#define BIT(R) (1u << (R))
+static const u32 GENERAL_REGS = BIT(REG_A) | BIT(REG_B) | BIT(REG_C) | BIT(REG_D) | BIT(REG_E) | BIT(REG_F) | BIT(REG_T0) | BIT(REG_T1);
+static const u32 ALL_REGS = GENERAL_REGS | BIT(REG_SP) | BIT(REG_BP);
+
+struct OptNode {
+    Instruction inst;
+    int imm = 0;
+    int target = -1; // node index for jz and jmp, nodes.size() is the end of the piece
+    int line = -1;
+    ASTFunction* reloc = nullptr;
+    bool removed = false;
+};
+
+struct BytecodeOptimizer {
+    BytecodePiece* piece = nullptr;
+    std::vector<OptNode> nodes;
+    std::vector<bool> is_target; // size is nodes.size()+1
+
+    bool decode();
+    void encode();
+    void compact();
+    void find_targets();
+
+    int count() { return nodes.size(); }
+
+    bool jump_threading();
+    bool push_pop();
+    bool copy_propagation();
+    bool constant_fold();
+    bool dead_store();
+    bool merge_incr();
+    bool superinstructions();
+};
+
+static bool has_imm(Opcode op) {
+    return op >= INST_IMMEDIATES;
+}
+static bool is_compare(Opcode op) {
+    return op >= INST_EQUAL && op <= INST_GREATER_EQUAL;
+}
+static bool is_binary_op(Opcode op) {
+    return (op >= INST_ADD && op <= INST_OR) || is_compare(op);
+}
+static bool is_jump(Opcode op) {
+    return op == INST_JMP || op == INST_JZ || op == INST_CMP_JZ;
+}
+// Whether control can continue to the next node
+static bool falls_through(Opcode op) {
+    return op != INST_JMP && op != INST_RET && op != INST_TAILCALL && op != INST_HALT;
+}
+static void describe(const OptNode& n, u32* out_reads, u32* out_writes) {
+    u32 reads = 0, writes = 0;
+    const Instruction& inst = n.inst;
+    switch(inst.opcode) {
+        case INST_CAST: reads = BIT(inst.op0); writes = BIT(inst.op0); break;
+        case INST_MOV_RR: reads = BIT(inst.op1); writes = BIT(inst.op0); break;
+        case INST_MOV_MR:
+        case INST_MOV_MR_DISP: reads = BIT(inst.op0) | BIT(inst.op1); break;
+        case INST_MOV_RM:
+        case INST_MOV_RM_DISP: reads = BIT(inst.op1); writes = BIT(inst.op0); break;
+        case INST_PUSH: reads = BIT(inst.op0) | BIT(REG_SP); writes = BIT(REG_SP); break;
+        case INST_POP: reads = BIT(REG_SP); writes = BIT(inst.op0) | BIT(REG_SP); break;
+        case INST_INCR: reads = BIT(inst.op0); writes = BIT(inst.op0); break;
+        case INST_NOT: reads = BIT(inst.op1); writes = BIT(inst.op0); break;
+        case INST_RET: reads = BIT(REG_SP) | BIT(REG_BP); writes = BIT(REG_SP) | BIT(REG_BP); break;
+        case INST_MEMZERO: reads = BIT(inst.op0) | BIT(inst.op1); break;
+        case INST_MEMCPY: reads = BIT(inst.op0) | BIT(inst.op1) | BIT(inst.op2); break;
+        case INST_MEMCPY_IMM: reads = BIT(inst.op0) | BIT(inst.op1); break;
+        case INST_LI: writes = BIT(inst.op0); break;
+        case INST_JZ: reads = BIT(inst.op0); break;
+        case INST_CALL: reads = BIT(REG_SP) | BIT(REG_BP); writes = GENERAL_REGS; break;
+        case INST_TAILCALL: reads = BIT(REG_SP) | BIT(REG_BP); break;
+        case INST_DATAPTR: writes = BIT(inst.op0); break;
+        case INST_HALT: reads = ALL_REGS; break;
+        case INST_PUSH_LI: reads = BIT(REG_SP); writes = BIT(inst.op0) | BIT(REG_SP); break;
+        case INST_PUSH_RM_DISP: reads = BIT(inst.op1) | BIT(REG_SP); writes = BIT(inst.op0) | BIT(REG_SP); break;
+        case INST_STACK_OP: reads = BIT(inst.op0) | BIT(REG_SP); writes = BIT(inst.op0) | BIT(inst.op1) | BIT(REG_SP); break;
+        case INST_CMP_JZ: reads = BIT(inst.op0) | BIT(inst.op1); writes = BIT(inst.op0); break;
+        default: {
+            if(is_binary_op(inst.opcode)) {
+                reads = BIT(inst.op0) | BIT(inst.op1);
+                writes = BIT(inst.op0);
+            }
+        }
+    }
+    *out_reads = reads & ALL_REGS;
+    *out_writes = writes & ALL_REGS;
+}
+// Instructions whose only effect is writing to a general register
+static bool is_pure(const OptNode& n) {
+    Opcode op = n.inst.opcode;
+    if(!(BIT(n.inst.op0) & GENERAL_REGS))
+        return false;
+    return op == INST_LI || op == INST_MOV_RR || op == INST_DATAPTR || op == INST_CAST
+        || op == INST_INCR || op == INST_NOT || is_binary_op(op);
+}
+static bool references_sp(const OptNode& n) {
+    u32 reads, writes;
+    describe(n, &reads, &writes);
+    return ((reads | writes) & BIT(REG_SP)) || n.inst.opcode == INST_RET || n.inst.opcode == INST_CALL || n.inst.opcode == INST_TAILCALL;
+}
+
+bool BytecodeOptimizer::decode() {
+    auto& insts = piece->instructions;
+    std::unordered_map<int, ASTFunction*> reloc_map;
+    for(auto& r : piece->relocations)
+        reloc_map[r.index_of_immediate] = r.function;
+
+    std::vector<int> node_of_pc(insts.size() + 1, -1);
+    nodes.clear();
+    nodes.reserve(insts.size());
+    int pc = 0;
+    while(pc < insts.size()) {
+        OptNode n{};
+        n.inst = insts[pc];
+        #ifndef DISABLE_DEBUG_LINES
+        if(pc < piece->line_of_instruction.size())
+            n.line = piece->line_of_instruction[pc];
+        #endif
+        node_of_pc[pc] = nodes.size();
+        pc++;
+        if(has_imm(n.inst.opcode)) {
+            if(pc >= insts.size())
+                return false; // truncated piece, leave it alone
+            n.imm = *(int*)&insts[pc];
+            if(is_jump(n.inst.opcode)) {
+                n.target = pc + n.imm; // pc for now, converted to node index below
+            } else if(n.inst.opcode == INST_CALL || n.inst.opcode == INST_TAILCALL) {
+                auto pair = reloc_map.find(pc);
+                if(pair != reloc_map.end())
+                    n.reloc = pair->second;
+            }
+            pc++;
+        }
+        nodes.push_back(n);
+    }
+    node_of_pc[insts.size()] = nodes.size();
+    for(auto& n : nodes) {
+        if(n.target == -1)
+            continue;
+        if(n.target < 0 || n.target > insts.size() || node_of_pc[n.target] == -1)
+            return false; // jump into an immediate or out of the piece, don't touch it
+        n.target = node_of_pc[n.target];
+    }
+    return true;
+}
+void BytecodeOptimizer::encode() {
+    std::vector<int> pc_of_node(nodes.size() + 1);
+    int pc = 0;
+    for(int i=0;i<nodes.size();i++) {
+        pc_of_node[i] = pc;
+        pc += has_imm(nodes[i].inst.opcode) ? 2 : 1;
+    }
+    pc_of_node[nodes.size()] = pc;
+
+    piece->instructions.clear();
+    piece->relocations.clear();
+    piece->index_of_non_immediates.clear();
+    #ifndef DISABLE_DEBUG_LINES
+    piece->line_of_instruction.clear();
+    #endif
+    for(int i=0;i<nodes.size();i++) {
+        auto& n = nodes[i];
+        piece->index_of_non_immediates.push_back(piece->instructions.size());
+        piece->instructions.push_back(n.inst);
+        #ifndef DISABLE_DEBUG_LINES
+        piece->line_of_instruction.push_back(n.line);
+        #endif
+        if(!has_imm(n.inst.opcode))
+            continue;
+        int imm_index = piece->instructions.size();
+        int imm = n.imm;
+        if(n.target != -1)
+            imm = pc_of_node[n.target] - imm_index;
+        if(n.reloc)
+            piece->addRelocation(n.reloc, imm_index);
+        piece->instructions.push_back(*(Instruction*)&imm);
+        #ifndef DISABLE_DEBUG_LINES
+        piece->line_of_instruction.push_back(n.line);
+        #endif
+    }
+}
+void BytecodeOptimizer::compact() {
+    // A removed node maps to the next node that is kept
+    std::vector<int> remap(nodes.size() + 1);
+    int kept = 0;
+    for(int i=0;i<nodes.size();i++) {
+        remap[i] = kept;
+        if(!nodes[i].removed)
+            kept++;
+    }
+    remap[nodes.size()] = kept;
+
+    int head = 0;
+    for(int i=0;i<nodes.size();i++) {
+        if(nodes[i].removed)
+            continue;
+        nodes[head] = nodes[i];
+        if(nodes[head].target != -1)
+            nodes[head].target = remap[nodes[head].target];
+        head++;
+    }
+    nodes.resize(head);
+}
+void BytecodeOptimizer::find_targets() {
+    is_target.assign(nodes.size() + 1, false);
+    for(auto& n : nodes) {
+        if(n.target != -1)
+            is_target[n.target] = true;
+    }
+}
+// Whether node i starts a new basic block
+#define BLOCK_START(I) ((I) == 0 || is_target[I] || !falls_through(nodes[(I)-1].inst.opcode) || is_jump(nodes[(I)-1].inst.opcode))
+
+bool BytecodeOptimizer::jump_threading() {
+    bool changed = false;
+    for(int i=0;i<nodes.size();i++) {
+        auto& n = nodes[i];
+        if(n.target == -1)
+            continue;
+        int t = n.target;
+        int hops = 0;
+        while(t < nodes.size() && nodes[t].inst.opcode == INST_JMP && nodes[t].target != t && hops < 32) {
+            t = nodes[t].target;
+            hops++;
+        }
+        if(t != n.target) {
+            n.target = t;
+            changed = true;
+        }
+        // jumping to the next instruction does nothing
+        if(n.target == i + 1) {
+            n.removed = true;
+            changed = true;
+        }
+    }
+    compact();
+    return changed;
+}
+/*
+    push a      =>
+    ...         =>  ...
+    pop b       =>  mov_rr b, a
+
+    The instructions in between may not touch the stack pointer
+    or write to a. Nothing reads the pushed value since the only way
+    to address it is through the stack pointer.
+*/
+bool BytecodeOptimizer::push_pop() {
+    bool changed = false;
+    find_targets();
+    for(int j=0;j<nodes.size();j++) {
+        auto& pop = nodes[j];
+        if(pop.inst.opcode != INST_POP || pop.inst.op0 == REG_SP)
+            continue;
+        for(int i=j-1;i>=0;i--) {
+            auto& n = nodes[i];
+            if(n.removed)
+                continue;
+            if(BLOCK_START(i+1)) // i+1 starts a block, the push would be in another block
+                break;
+            if(n.inst.opcode == INST_PUSH) {
+                Register from = n.inst.op0;
+                if(from == REG_SP)
+                    break;
+                bool clobbered = false;
+                for(int k=i+1;k<j;k++) {
+                    u32 reads, writes;
+                    describe(nodes[k], &reads, &writes);
+                    if(!nodes[k].removed && (writes & BIT(from))) {
+                        clobbered = true;
+                        break;
+                    }
+                }
+                if(clobbered)
+                    break;
+                n.removed = true;
+                if(pop.inst.op0 == from) {
+                    pop.removed = true;
+                } else {
+                    pop.inst = { INST_MOV_RR, pop.inst.op0, from };
+                }
+                changed = true;
+                break;
+            }
+            if(references_sp(n) || !falls_through(n.inst.opcode) || is_jump(n.inst.opcode))
+                break;
+        }
+    }
+    compact();
+    return changed;
+}
+bool BytecodeOptimizer::copy_propagation() {
+    bool changed = false;
+    find_targets();
+    Register copy_of[REG_COUNT];
+    for(int i=0;i<nodes.size();i++) {
+        if(BLOCK_START(i))
+            memset(copy_of, 0, sizeof(copy_of));
+        auto& n = nodes[i];
+        auto& inst = n.inst;
+
+        auto replace = [&](Register& r) {
+            if(r < REG_COUNT && copy_of[r] != REG_INVALID) {
+                r = copy_of[r];
+                changed = true;
+            }
+        };
+        // only replace operands that are read and not written
+        switch(inst.opcode) {
+            case INST_MOV_RR: replace(inst.op1); break;
+            case INST_MOV_MR:
+            case INST_MOV_MR_DISP: replace(inst.op0); replace(inst.op1); break;
+            case INST_MOV_RM:
+            case INST_MOV_RM_DISP: replace(inst.op1); break;
+            case INST_NOT: replace(inst.op1); break;
+            case INST_MEMZERO: replace(inst.op0); replace(inst.op1); break;
+            case INST_MEMCPY: replace(inst.op0); replace(inst.op1); replace(inst.op2); break;
+            case INST_MEMCPY_IMM: replace(inst.op0); replace(inst.op1); break;
+            case INST_JZ: replace(inst.op0); break;
+            case INST_PUSH: {
+                // push decrements sp before reading the register
+                if(copy_of[inst.op0] != REG_SP)
+                    replace(inst.op0);
+            } break;
+            default: {
+                if(is_binary_op(inst.opcode))
+                    replace(inst.op1);
+            }
+        }
+        if(inst.opcode == INST_MOV_RR && inst.op0 == inst.op1) {
+            n.removed = true;
+            changed = true;
+            continue;
+        }
+
+        u32 reads, writes;
+        describe(n, &reads, &writes);
+        for(int r=0;r<REG_COUNT;r++) {
+            if((writes & BIT(r)) || (copy_of[r] != REG_INVALID && (writes & BIT(copy_of[r]))))
+                copy_of[r] = REG_INVALID;
+        }
+        if(inst.opcode == INST_MOV_RR && (BIT(inst.op0) & GENERAL_REGS))
+            copy_of[inst.op0] = inst.op1;
+    }
+    compact();
+    return changed;
+}
+// Computes what the interpreter would put in op0, false if it can't be known
+static bool evaluate(Instruction inst, i64 a, i64 b, i64* out) {
+    ControlFlags control = (ControlFlags)inst.op2;
+    float fa = *(float*)&a, fb = *(float*)&b;
+    i64 res = a;
+    #define FLOAT_RES(E) { float f = E; *(float*)&res = f; }
+    #define CMP(OP) if (control & CONTROL_FLOAT) res = fa OP fb; else if(control & CONTROL_1B) res = (i8)a OP (i8)b; else res = a OP b;
+    switch(inst.opcode) {
+        case INST_ADD: if(control & CONTROL_FLOAT) FLOAT_RES(fa + fb) else res = a + b; break;
+        case INST_SUB: if(control & CONTROL_FLOAT) FLOAT_RES(fa - fb) else res = a - b; break;
+        case INST_MUL: if(control & CONTROL_FLOAT) FLOAT_RES(fa * fb) else res = a * b; break;
+        case INST_DIV: {
+            if(control & CONTROL_FLOAT) {
+                FLOAT_RES(fa / fb)
+            } else {
+                if(b == 0 || (b == -1 && a == INT64_MIN))
+                    return false; // leave the error to runtime
+                res = a / b;
+            }
+        } break;
+        case INST_AND: res = a && b; break;
+        case INST_OR:  res = a || b; break;
+        case INST_NOT: res = !b; break;
+        case INST_EQUAL:         CMP(==) break;
+        case INST_NOT_EQUAL:     CMP(!=) break;
+        case INST_LESS:          CMP(<) break;
+        case INST_LESS_EQUAL:    CMP(<=) break;
+        case INST_GREATER:       CMP(>) break;
+        case INST_GREATER_EQUAL: CMP(>=) break;
+        case INST_CAST: {
+            if((CastType)inst.op1 == CAST_INT_FLOAT)
+                *(float*)&res = *(int*)&a;
+            else if((CastType)inst.op1 == CAST_FLOAT_INT)
+                *(int*)&res = *(float*)&a;
+        } break;
+        case INST_INCR: res = a + decode_incr(inst); break;
+        default: return false;
+    }
+    #undef FLOAT_RES
+    #undef CMP
+    *out = res;
+    return true;
+}
+bool BytecodeOptimizer::constant_fold() {
+    bool changed = false;
+    find_targets();
+    bool known[REG_COUNT];
+    i64 value[REG_COUNT];
+    for(int i=0;i<nodes.size();i++) {
+        if(BLOCK_START(i))
+            memset(known, 0, sizeof(known));
+        auto& n = nodes[i];
+        auto& inst = n.inst;
+        Register dst = REG_INVALID;
+        bool is_known = false;
+        i64 result = 0;
+
+        if(inst.opcode == INST_LI) {
+            dst = inst.op0;
+            is_known = true;
+            result = n.imm;
+        } else if(inst.opcode == INST_MOV_RR) {
+            dst = inst.op0;
+            is_known = known[inst.op1];
+            result = value[inst.op1];
+        } else if(inst.opcode == INST_JZ && known[inst.op0]) {
+            if(value[inst.op0] == 0) {
+                inst.opcode = INST_JMP;
+                inst.op0 = REG_INVALID;
+            } else {
+                n.removed = true;
+            }
+            changed = true;
+        } else if(is_pure(n) && inst.opcode != INST_DATAPTR) {
+            dst = inst.op0;
+            bool operands_known = false;
+            i64 a = value[inst.op0], b = 0;
+            if(inst.opcode == INST_NOT) {
+                operands_known = known[inst.op1];
+                b = value[inst.op1];
+            } else if(is_binary_op(inst.opcode)) {
+                operands_known = known[inst.op0] && known[inst.op1];
+                b = value[inst.op1];
+                // x + 0, x - 0, x * 1 and x / 1 with integers do nothing
+                if(!operands_known && known[inst.op1] && !(inst.op2 & CONTROL_FLOAT)) {
+                    i64 v = value[inst.op1];
+                    if(((inst.opcode == INST_ADD || inst.opcode == INST_SUB) && v == 0) || ((inst.opcode == INST_MUL || inst.opcode == INST_DIV) && v == 1)) {
+                        n.removed = true;
+                        changed = true;
+                        continue;
+                    }
+                }
+            } else {
+                operands_known = known[inst.op0];
+            }
+            if(operands_known && evaluate(inst, a, b, &result)) {
+                is_known = true;
+                if(result == (i64)(int)result) {
+                    n.inst = { INST_LI, dst };
+                    n.imm = (int)result;
+                    changed = true;
+                }
+            }
+        }
+
+        u32 reads, writes;
+        describe(n, &reads, &writes);
+        for(int r=0;r<REG_COUNT;r++) {
+            if(writes & BIT(r))
+                known[r] = false;
+        }
+        if(dst != REG_INVALID && !n.removed && (BIT(dst) & GENERAL_REGS)) {
+            known[dst] = is_known;
+            value[dst] = result;
+        }
+    }
+    compact();
+    return changed;
+}
+bool BytecodeOptimizer::dead_store() {
+    bool changed = false;
+    int N = nodes.size();
+    std::vector<u32> live_in(N + 1, 0);
+    live_in[N] = ALL_REGS; // running off the end, assume everything is used
+    std::vector<u32> reads(N), writes(N);
+    for(int i=0;i<N;i++)
+        describe(nodes[i], &reads[i], &writes[i]);
+
+    auto live_out = [&](int i) {
+        auto& n = nodes[i];
+        u32 out = 0;
+        if(n.inst.opcode == INST_RET)
+            return out;
+        if(falls_through(n.inst.opcode))
+            out |= live_in[i+1];
+        if(n.target != -1)
+            out |= live_in[n.target];
+        return out;
+    };
+    bool again = true;
+    while(again) {
+        again = false;
+        for(int i=N-1;i>=0;i--) {
+            u32 in = reads[i] | (live_out(i) & ~writes[i]);
+            if(in != live_in[i]) {
+                live_in[i] = in;
+                again = true;
+            }
+        }
+    }
+    for(int i=0;i<N;i++) {
+        auto& n = nodes[i];
+        if(is_pure(n) && !(writes[i] & live_out(i))) {
+            n.removed = true;
+            changed = true;
+        }
+    }
+    compact();
+    return changed;
+}
+bool BytecodeOptimizer::merge_incr() {
+    bool changed = false;
+    find_targets();
+    for(int i=0;i<nodes.size();i++) {
+        auto& n = nodes[i];
+        if(n.removed || n.inst.opcode != INST_INCR)
+            continue;
+        int imm = decode_incr(n.inst);
+        int j = i + 1;
+        while(j < nodes.size() && !is_target[j] && nodes[j].inst.opcode == INST_INCR && nodes[j].inst.op0 == n.inst.op0) {
+            int sum = imm + decode_incr(nodes[j].inst);
+            if(sum != (i16)sum)
+                break;
+            imm = sum;
+            nodes[j].removed = true;
+            changed = true;
+            j++;
+        }
+        if(imm == 0) {
+            n.removed = true;
+            changed = true;
+        } else {
+            n.inst = { INST_INCR, n.inst.op0, (Register)(imm & 0xFF), (Register)((imm >> 8) & 0xFF) };
+        }
+    }
+    compact();
+    return changed;
+}
+/*
+    The sequences were picked from the instruction pairs that show up the
+    most in generated code. Fused instructions still write every register
+    the original sequence did so nothing after them has to change.
+*/
+bool BytecodeOptimizer::superinstructions() {
+    bool changed = false;
+    find_targets();
+    for(int i=0;i+1<nodes.size();i++) {
+        auto& n = nodes[i];
+        auto& next = nodes[i+1];
+        if(is_target[i+1])
+            continue;
+
+        // mov_rr x, y; pop y; op y, x  =>  stack_op op y, x
+        if(i+2 < nodes.size() && !is_target[i+2] && n.inst.opcode == INST_MOV_RR && next.inst.opcode == INST_POP) {
+            auto& op = nodes[i+2];
+            Register x = n.inst.op0, y = n.inst.op1;
+            if(x != y && (BIT(x) & GENERAL_REGS) && (BIT(y) & GENERAL_REGS) && next.inst.op0 == y
+                && is_binary_op(op.inst.opcode) && op.inst.op0 == y && op.inst.op1 == x) {
+                n.imm = op.inst.opcode;
+                n.inst = { INST_STACK_OP, y, x, op.inst.op2 };
+                n.line = op.line;
+                next.removed = true;
+                op.removed = true;
+                changed = true;
+                i += 2;
+                continue;
+            }
+        }
+        Register r = n.inst.op0;
+        if(!(BIT(r) & GENERAL_REGS))
+            continue;
+        if(n.inst.opcode == INST_LI && next.inst.opcode == INST_PUSH && next.inst.op0 == r) {
+            n.inst.opcode = INST_PUSH_LI;
+        } else if((n.inst.opcode == INST_MOV_RM || n.inst.opcode == INST_MOV_RM_DISP) && next.inst.opcode == INST_PUSH && next.inst.op0 == r) {
+            if(n.inst.opcode == INST_MOV_RM)
+                n.imm = 0;
+            n.inst.opcode = INST_PUSH_RM_DISP;
+        } else if(is_compare(n.inst.opcode) && next.inst.opcode == INST_JZ && next.inst.op0 == r && (u8)n.inst.op2 < 32) {
+            n.inst = { INST_CMP_JZ, r, n.inst.op1, encode_cmp_jz(n.inst.opcode, n.inst.op2) };
+            n.target = next.target;
+        } else {
+            continue;
+        }
+        next.removed = true;
+        changed = true;
+        i++;
+    }
+    compact();
+    return changed;
+}
+
+void OptimizePiece(BytecodePiece* piece, u32 passes, OptimizationStats* stats) {
+    ZoneScopedC(tracy::Color::Aqua);
+    if(passes == OPT_NONE)
+        return;
+    BytecodeOptimizer opt{};
+    opt.piece = piece;
+    if(!opt.decode())
+        return;
+
+    int total_before = opt.count();
+
+    typedef bool (BytecodeOptimizer::*PassFunc)();
+    PassFunc pass_funcs[OPT_PASS_COUNT] {
+        &BytecodeOptimizer::jump_threading,
+        &BytecodeOptimizer::push_pop,
+        &BytecodeOptimizer::copy_propagation,
+        &BytecodeOptimizer::constant_fold,
+        &BytecodeOptimizer::dead_store,
+        &BytecodeOptimizer::merge_incr,
+        &BytecodeOptimizer::superinstructions,
+        nullptr, // OPT_INLINE runs across pieces in InlineCalls
+    };
+    auto run_pass = [&](int i) {
+        int before = opt.count();
+        bool changed = (opt.*pass_funcs[i])();
+        if(stats) {
+            atomic_add(&stats->pass_before[i], before);
+            atomic_add(&stats->pass_after[i], opt.count());
+        }
+        return changed;
+    };
+
+    // Passes create opportunities for each other so we run them a couple of times.
+    // The other passes don't look into superinstructions so those are made at the end.
+    const u32 ROUND_PASSES = OPT_ALL & ~(OPT_SUPERINSTRUCTIONS | OPT_INLINE);
+    const int MAX_ROUNDS = 4;
+    for(int round=0;round<MAX_ROUNDS;round++) {
+        bool changed = false;
+        for(int i=0;i<OPT_PASS_COUNT;i++) {
+            if(passes & ROUND_PASSES & (1 << i))
+                changed |= run_pass(i);
+        }
+        if(!changed)
+            break;
+    }
+    for(int i=0;i<OPT_PASS_COUNT;i++) {
+        if(passes & ~ROUND_PASSES & (1 << i) && pass_funcs[i])
+            run_pass(i);
+    }
+    if(stats) {
+        atomic_add(&stats->total_before, total_before);
+        atomic_add(&stats->total_after, opt.count());
+    }
+    opt.encode();
+}
+
+/*
+    call f      =>  incr sp, -16
+                    mov_rr f, sp
+                    <body of f where bp is f and ret jumps to the end>
+                    incr sp, 16
+
+    Only functions without calls are inlined. Nothing else uses register f
+    so it can hold the base pointer of the inlined body. The 16 bytes CALL
+    would push (pc, piece index and bp) are reserved but not written, the
+    parameters and the return value end up where the caller expects them.
+*/
+static const int INLINE_MAX_NODES = 24;
+
+static bool op1_is_register(Opcode op) {
+    switch(op) {
+        case INST_MOV_RR:
+        case INST_MOV_MR:
+        case INST_MOV_MR_DISP:
+        case INST_MOV_RM:
+        case INST_MOV_RM_DISP:
+        case INST_NOT:
+        case INST_MEMZERO:
+        case INST_MEMCPY:
+        case INST_MEMCPY_IMM:
+        case INST_PUSH_RM_DISP:
+        case INST_STACK_OP:
+        case INST_CMP_JZ: return true;
+        default: return is_binary_op(op);
+    }
+}
+static void rename_register(Instruction& inst, Register from, Register to) {
+    if(inst.op0 == from)
+        inst.op0 = to;
+    if(op1_is_register(inst.opcode) && inst.op1 == from)
+        inst.op1 = to;
+    if(inst.opcode == INST_MEMCPY && inst.op2 == from)
+        inst.op2 = to;
+}
+static bool can_inline(const std::vector<OptNode>& body) {
+    if(body.size() > INLINE_MAX_NODES)
+        return false;
+    for(auto& n : body) {
+        if(n.inst.opcode == INST_CALL || n.inst.opcode == INST_TAILCALL || n.inst.opcode == INST_HALT)
+            return false;
+        u32 reads, writes;
+        describe(n, &reads, &writes);
+        if((reads | writes) & BIT(REG_F))
+            return false;
+        if(n.inst.opcode != INST_RET && (writes & BIT(REG_BP)))
+            return false;
+    }
+    return true;
+}
+static Instruction make_incr(Register reg, int imm) {
+    return { INST_INCR, reg, (Register)(imm & 0xFF), (Register)((imm >> 8) & 0xFF) };
+}
+
+void InlineCalls(Bytecode* bytecode, u32 passes, OptimizationStats* stats) {
+    ZoneScopedC(tracy::Color::Aqua);
+    if(!(passes & OPT_INLINE))
+        return;
+    static_assert(OPT_INLINE == 1 << 7, "pass index of OPT_INLINE");
+    const int INLINE_PASS = 7;
+
+    auto& pieces = bytecode->pieces_unsafe();
+    std::unordered_map<ASTFunction*, BytecodeOptimizer> bodies;
+    for(auto piece : pieces) {
+        if(!piece->function)
+            continue;
+        BytecodeOptimizer body{};
+        body.piece = piece;
+        if(body.decode() && can_inline(body.nodes))
+            bodies[piece->function] = std::move(body);
+    }
+    if(bodies.size() == 0)
+        return;
+
+    for(auto piece : pieces) {
+        if(bodies.count(piece->function))
+            continue; // makes no calls
+        BytecodeOptimizer opt{};
+        opt.piece = piece;
+        if(!opt.decode())
+            continue;
+        bool has_inlinable_call = false;
+        for(auto& n : opt.nodes) {
+            if(n.inst.opcode == INST_CALL && n.reloc && bodies.count(n.reloc))
+                has_inlinable_call = true;
+        }
+        if(!has_inlinable_call)
+            continue;
+
+        int before = opt.count();
+        std::vector<OptNode> out;
+        std::vector<int> new_index(opt.nodes.size() + 1);
+        std::vector<int> caller_jumps; // nodes in out with targets into opt.nodes
+        std::unordered_map<ASTFunction*, int> line_offset;
+        for(int i=0;i<opt.nodes.size();i++) {
+            auto& n = opt.nodes[i];
+            new_index[i] = out.size();
+            auto pair = n.inst.opcode == INST_CALL && n.reloc ? bodies.find(n.reloc) : bodies.end();
+            if(pair == bodies.end()) {
+                if(n.target != -1)
+                    caller_jumps.push_back(out.size());
+                out.push_back(n);
+                continue;
+            }
+            auto& body = pair->second;
+            int lines = 0;
+            #ifndef DISABLE_DEBUG_LINES
+            auto line_pair = line_offset.find(n.reloc);
+            if(line_pair == line_offset.end()) {
+                lines = piece->lines.size();
+                line_offset[n.reloc] = lines;
+                auto& callee_lines = body.piece->lines;
+                piece->lines.insert(piece->lines.end(), callee_lines.begin(), callee_lines.end());
+            } else {
+                lines = line_pair->second;
+            }
+            #endif
+
+            OptNode prologue{};
+            prologue.line = n.line;
+            prologue.inst = make_incr(REG_SP, -16);
+            out.push_back(prologue);
+            prologue.inst = { INST_MOV_RR, REG_F, REG_SP };
+            out.push_back(prologue);
+
+            int start = out.size();
+            int end = start + body.nodes.size();
+            for(auto b : body.nodes) {
+                rename_register(b.inst, REG_BP, REG_F);
+                if(b.target != -1)
+                    b.target += start;
+                if(b.inst.opcode == INST_RET) {
+                    b.inst = { INST_JMP };
+                    b.imm = 0;
+                    b.target = end;
+                }
+                if(b.line != -1)
+                    b.line += lines;
+                out.push_back(b);
+            }
+            OptNode epilogue{};
+            epilogue.line = n.line;
+            epilogue.inst = make_incr(REG_SP, 16);
+            out.push_back(epilogue);
+        }
+        new_index[opt.nodes.size()] = out.size();
+        for(int i : caller_jumps)
+            out[i].target = new_index[out[i].target];
+        opt.nodes = std::move(out);
+        int inlined = opt.count();
+        opt.encode();
+
+        OptimizePiece(piece, passes & ~OPT_INLINE, nullptr);
+        if(stats && opt.decode()) {
+            atomic_add(&stats->pass_before[INLINE_PASS], before);
+            atomic_add(&stats->pass_after[INLINE_PASS], inlined);
+            atomic_add(&stats->total_after, opt.count() - before);
+        }
+    }
+}
+
+void OptimizationStats::print(u32 enabled_passes) {
+    log_color(GOLD);
+    printf("Bytecode optimizations:\n");
+    log_color(NO_COLOR);
+    for(int i=0;i<OPT_PASS_COUNT;i++) {
+        if(!(enabled_passes & (1 << i))) {
+            log_color(GRAY);
+            printf(" %-18s disabled\n", optimization_pass_names[i]);
+            log_color(NO_COLOR);
+            continue;
+        }
+        printf(" %-18s %8d -> %8d (%d removed)\n", optimization_pass_names[i], pass_before[i], pass_after[i], pass_before[i] - pass_after[i]);
+    }
+    printf(" %-18s %8d -> %8d instructions\n", "total", total_before, total_after);
+}
@@ -0,0 +1,221 @@
+#include "Profiler.h"
+
+#include <algorithm>
+
+void VMProfiler::init(Bytecode* bytecode) {
+    auto& pieces = bytecode->pieces_unsafe();
+    counters.resize(pieces.size());
+    for(int i=0;i<pieces.size();i++)
+        counters[i].resize(pieces[i]->instructions.size(), Counter{});
+    since_sample = 0;
+    last_sample = StartMeasure();
+}
+
+void VMProfiler::sample(int piece_index, int pc, u8* bp, u8* stack_top) {
+    TimePoint now = StartMeasure();
+    counters[piece_index][pc].ticks += now - last_sample;
+    last_sample = now;
+
+    // frames pushed by CALL: saved bp, piece index and pc of the caller
+    frames.clear();
+    frames.push_back(piece_index);
+    while(bp < stack_top) {
+        int caller = *(int*)(bp + 8);
+        if(caller < 0)
+            break; // the frame VirtualMachine::call returns to
+        frames.push_back(caller);
+        bp = *(u8**)bp;
+    }
+    std::string key;
+    for(int i=frames.size()-1;i>=0;i--)
+        key.append((char*)&frames[i], sizeof(int));
+    stacks[key] += since_sample;
+    since_sample = 0;
+}
+
+void VMProfiler::print_report(Bytecode* bytecode) {
+    auto& pieces = bytecode->pieces_unsafe();
+    u64 total_instructions = 0;
+    u64 total_ticks = 0;
+
+    struct Entry {
+        std::string name;
+        int line_number;
+        std::string text;
+        u64 instructions;
+        u64 ticks;
+    };
+    std::vector<Entry> piece_entries;
+    std::vector<Entry> line_entries;
+    std::unordered_map<u64, int> line_index_of; // piece_index << 32 | line number, a source line can have several entries in piece->lines
+    for(int i=0;i<counters.size();i++) {
+        auto piece = pieces[i];
+        Entry entry{ piece->name, 0, "", 0, 0 };
+        for(int pc=0;pc<counters[i].size();pc++) {
+            auto& counter = counters[i][pc];
+            entry.instructions += counter.instructions;
+            entry.ticks += counter.ticks;
+            #ifndef DISABLE_DEBUG_LINES
+            if(counter.instructions == 0 && counter.ticks == 0)
+                continue;
+            if(pc >= piece->line_of_instruction.size() || piece->line_of_instruction[pc] == -1)
+                continue;
+            int line = piece->line_of_instruction[pc];
+            u64 key = ((u64)i << 32) | (u32)piece->lines[line].line_number;
+            auto pair = line_index_of.find(key);
+            if(pair == line_index_of.end()) {
+                line_index_of[key] = line_entries.size();
+                line_entries.push_back({ piece->name, piece->lines[line].line_number, piece->lines[line].text, 0, 0 });
+                pair = line_index_of.find(key);
+            }
+            line_entries[pair->second].instructions += counter.instructions;
+            line_entries[pair->second].ticks += counter.ticks;
+            #endif
+        }
+        total_instructions += entry.instructions;
+        total_ticks += entry.ticks;
+        if(entry.instructions != 0)
+            piece_entries.push_back(entry);
+    }
+    auto by_ticks = [](const Entry& a, const Entry& b) {
+        if(a.ticks != b.ticks)
+            return a.ticks > b.ticks;
+        return a.instructions > b.instructions;
+    };
+    std::sort(piece_entries.begin(), piece_entries.end(), by_ticks);
+    std::sort(line_entries.begin(), line_entries.end(), by_ticks);
+
+    auto percent = [](u64 part, u64 total) {
+        return total == 0 ? 0.0 : part * 100.0 / total;
+    };
+    log_color(GOLD);
+    printf("VM profile: %llu instructions, %.2f ms\n", (unsigned long long)total_instructions, DiffMeasure(total_ticks) * 1000);
+    log_color(NO_COLOR);
+    printf(" %-24s %14s %7s %10s %7s\n", "piece", "instructions", "%", "ms", "%");
+    for(auto& e : piece_entries) {
+        printf(" %-24s %14llu %6.2f%% %10.3f %6.2f%%\n", e.name.c_str(), (unsigned long long)e.instructions, percent(e.instructions, total_instructions),
+            DiffMeasure(e.ticks) * 1000, percent(e.ticks, total_ticks));
+    }
+    const int MAX_LINES = 20;
+    if(line_entries.size() != 0) {
+        printf(" %-24s %14s %7s %10s %7s\n", "line", "instructions", "%", "ms", "%");
+        for(int i=0;i<line_entries.size() && i < MAX_LINES;i++) {
+            auto& e = line_entries[i];
+            std::string name = e.name + ":" + std::to_string(e.line_number);
+            printf(" %-24s %14llu %6.2f%% %10.3f %6.2f%%  ", name.c_str(), (unsigned long long)e.instructions, percent(e.instructions, total_instructions),
+                DiffMeasure(e.ticks) * 1000, percent(e.ticks, total_ticks));
+            log_color(AQUA);
+            printf("%s\n", e.text.c_str());
+            log_color(NO_COLOR);
+        }
+    }
+}
+
+bool VMProfiler::write_collapsed_stacks(Bytecode* bytecode, const std::string& path) {
+    std::ofstream file(path, std::ofstream::binary);
+    if(!file.is_open())
+        return false;
+    auto& pieces = bytecode->pieces_unsafe();
+    for(auto& pair : stacks) {
+        int count = pair.first.size() / sizeof(int);
+        const int* indices = (const int*)pair.first.data();
+        for(int i=0;i<count;i++) {
+            if(i != 0)
+                file << ";";
+            file << pieces[indices[i]]->name;
+        }
+        file << " " << pair.second << "\n";
+    }
+    return true;
+}
+
+void VMStats::init(Bytecode* bytecode) {
+    natives.resize(NATIVE_MAX + bytecode->host_natives.size(), 0);
+}
+
+void VMStats::print_report(Bytecode* bytecode) {
+    struct Entry {
+        std::string name;
+        u64 count;
+    };
+    auto print_sorted = [](const char* title, std::vector<Entry>& entries, u64 total, int max_entries) {
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.count > b.count; });
+        log_color(GOLD);
+        printf(" %s\n", title);
+        log_color(NO_COLOR);
+        for(int i=0;i<entries.size() && i < max_entries;i++)
+            printf("  %-36s %14llu %6.2f%%\n", entries[i].name.c_str(), (unsigned long long)entries[i].count, total == 0 ? 0.0 : entries[i].count * 100.0 / total);
+    };
+    auto describe_control = [](u8 control) {
+        std::string out;
+        if(control & ~CONTROL_FLOAT)
+            out = std::to_string(control & ~CONTROL_FLOAT) + "B ";
+        out += (control & CONTROL_FLOAT) ? "float" : "int";
+        return out;
+    };
+    // op2 is an operand size or control flags for these opcodes, a register or unused for the others
+    auto describe_op2 = [&](Opcode opcode, u8 op2) -> std::string {
+        Instruction inst{};
+        inst.opcode = opcode;
+        inst.op2 = (Register)op2;
+        switch(opcode) {
+        case INST_MOV_MR:
+        case INST_MOV_RM:
+        case INST_MOV_MR_DISP:
+        case INST_MOV_RM_DISP:
+        case INST_PUSH_RM_DISP:
+            return std::to_string(op2) + "B";
+        case INST_CMP_JZ:
+            return std::string(opcode_names[decode_cmp_jz(inst)]) + " " + describe_control(decode_cmp_jz_control(inst));
+        case INST_STACK_OP:
+            return describe_control(op2);
+        default:
+            if(opcode >= INST_ADD && opcode <= INST_GREATER_EQUAL)
+                return describe_control(op2);
+            return "";
+        }
+    };
+
+    u64 total = 0;
+    std::vector<Entry> entries;
+    for(int i=0;i<INST_OPCODE_COUNT;i++) {
+        total += opcodes[i];
+        if(opcodes[i])
+            entries.push_back({ opcode_names[i], opcodes[i] });
+    }
+    log_color(GOLD);
+    printf("VM stats: %llu instructions\n", (unsigned long long)total);
+    log_color(NO_COLOR);
+    print_sorted("opcodes", entries, total, INST_OPCODE_COUNT);
+
+    entries.clear();
+    for(int i=0;i<INST_OPCODE_COUNT;i++) {
+        for(int j=0;j<INST_OPCODE_COUNT;j++) {
+            if(pairs[i][j])
+                entries.push_back({ std::string(opcode_names[i]) + ", " + opcode_names[j], pairs[i][j] });
+        }
+    }
+    print_sorted("opcode pairs", entries, total, 30);
+
+    entries.clear();
+    for(int i=0;i<INST_OPCODE_COUNT;i++) {
+        for(int j=0;j<256;j++) {
+            if(!operands[i][j])
+                continue;
+            std::string operand = describe_op2((Opcode)i, j);
+            if(!operand.empty())
+                entries.push_back({ std::string(opcode_names[i]) + " " + operand, operands[i][j] });
+        }
+    }
+    print_sorted("operand sizes and control flags", entries, total, 30);
+
+    u64 total_natives = 0;
+    entries.clear();
+    for(int i=0;i<natives.size();i++) {
+        total_natives += natives[i];
+        if(natives[i])
+            entries.push_back({ i < NATIVE_MAX ? NAME_OF_NATIVE(i) : bytecode->host_natives[i - NATIVE_MAX].name, natives[i] });
+    }
+    if(entries.size() != 0)
+        print_sorted("native calls", entries, total_natives, natives.size());
+}
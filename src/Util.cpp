@@ -303,6 +303,9 @@ i32 atomic_add(volatile i32* ptr, i32 value) {
     i32 res = InterlockedAdd((volatile long*)ptr, value);
     return res;
 }
+void* atomic_compare_swap(void* volatile* ptr, void* expected, void* desired) {
+    return InterlockedCompareExchangePointer(ptr, desired, expected);
+}
 Semaphore::Semaphore(u32 initial, u32 max) {
     Assert(!m_internalHandle);
     m_initial = initial;
@@ -545,11 +548,207 @@ void SetHighThreadPriority() {
         printf("fail prio\n");
     }
 }
+void* AllocateExecutable(int size) {
+    return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+bool ProtectExecutable(void* ptr, int size) {
+    DWORD old;
+    if(!VirtualProtect(ptr, size, PAGE_EXECUTE_READ, &old))
+        return false;
+    FlushInstructionCache(GetCurrentProcess(), ptr, size);
+    return true;
+}
+void FreeExecutable(void* ptr, int size) {
+    VirtualFree(ptr, 0, MEM_RELEASE);
+}
+void* AllocatePages(u64 size) {
+    return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+void FreePages(void* ptr, u64 size) {
+    VirtualFree(ptr, 0, MEM_RELEASE);
+}
+bool ProtectNoAccess(void* ptr, u64 size) {
+    DWORD old;
+    return VirtualProtect(ptr, size, PAGE_NOACCESS, &old);
+}
+static int GuardPageFilter(EXCEPTION_POINTERS* info, void* region, u64 size) {
+    if(info->ExceptionRecord->ExceptionCode != EXCEPTION_ACCESS_VIOLATION)
+        return EXCEPTION_CONTINUE_SEARCH;
+    u8* address = (u8*)info->ExceptionRecord->ExceptionInformation[1];
+    if(address < (u8*)region || address >= (u8*)region + size)
+        return EXCEPTION_CONTINUE_SEARCH;
+    return EXCEPTION_EXECUTE_HANDLER;
+}
+#ifdef _MSC_VER
+bool CallWithGuardPages(void (*proc)(void* arg), void* arg, void* region, u64 size) {
+    __try {
+        proc(arg);
+    } __except(GuardPageFilter(GetExceptionInformation(), region, size)) {
+        return false;
+    }
+    return true;
+}
+#else
+// __try/__except is MSVC only. A vectored handler jumps back to the guarded
+// call of the thread instead, like the signal handler on unix. The builtin
+// setjmp doesn't unwind so it works through JIT code without unwind info.
+static thread_local void** guard_jump = nullptr;
+static thread_local u8* guard_region = nullptr;
+static thread_local u64 guard_size = 0;
+static LONG CALLBACK GuardPageHandler(EXCEPTION_POINTERS* info) {
+    if(guard_jump && GuardPageFilter(info, guard_region, guard_size) == EXCEPTION_EXECUTE_HANDLER)
+        __builtin_longjmp(guard_jump, 1);
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+bool CallWithGuardPages(void (*proc)(void* arg), void* arg, void* region, u64 size) {
+    static void* handler = AddVectoredExceptionHandler(1, GuardPageHandler);
+    (void)handler;
+    void* jump[5];
+    void** prev_jump = guard_jump;
+    u8* prev_region = guard_region;
+    u64 prev_size = guard_size;
+    if(__builtin_setjmp(jump)) {
+        guard_jump = prev_jump;
+        guard_region = prev_region;
+        guard_size = prev_size;
+        return false;
+    }
+    guard_jump = jump;
+    guard_region = (u8*)region;
+    guard_size = size;
+    proc(arg);
+    guard_jump = prev_jump;
+    guard_region = prev_region;
+    guard_size = prev_size;
+    return true;
+}
+#endif
+void* MapFile(const char* path, u64* out_size) {
+    *out_size = 0;
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file == INVALID_HANDLE_VALUE)
+        return nullptr;
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return nullptr;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if(!mapping)
+        return nullptr;
+    void* ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping); // the view keeps the mapping alive
+    if(ptr)
+        *out_size = size.QuadPart;
+    return ptr;
+}
+void UnmapFile(void* ptr, u64 size) {
+    UnmapViewOfFile(ptr);
+}
 
 #endif
 
 #ifdef OS_UNIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <setjmp.h>
 
-
+void* AllocateExecutable(int size) {
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED)
+        return nullptr;
+    return ptr;
+}
+bool ProtectExecutable(void* ptr, int size) {
+    return mprotect(ptr, size, PROT_READ | PROT_EXEC) == 0;
+}
+void FreeExecutable(void* ptr, int size) {
+    munmap(ptr, size);
+}
+void* AllocatePages(u64 size) {
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED)
+        return nullptr;
+    return ptr;
+}
+void FreePages(void* ptr, u64 size) {
+    munmap(ptr, size);
+}
+bool ProtectNoAccess(void* ptr, u64 size) {
+    return mprotect(ptr, size, PROT_NONE) == 0;
+}
+// The guarded call of the current thread
+static thread_local sigjmp_buf* guard_jump = nullptr;
+static thread_local u8* guard_region = nullptr;
+static thread_local u64 guard_size = 0;
+static void GuardPageHandler(int sig, siginfo_t* info, void* context) {
+    u8* address = (u8*)info->si_addr;
+    if(guard_jump && address >= guard_region && address < guard_region + guard_size)
+        siglongjmp(*guard_jump, 1);
+    // not a guard page, the instruction faults again and crashes the program
+    signal(sig, SIG_DFL);
+}
+bool CallWithGuardPages(void (*proc)(void* arg), void* arg, void* region, u64 size) {
+    static bool installed = []() {
+        struct sigaction action{};
+        action.sa_sigaction = GuardPageHandler;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, nullptr);
+        sigaction(SIGBUS, &action, nullptr);
+        return true;
+    }();
+    (void)installed;
+    sigjmp_buf jump;
+    sigjmp_buf* prev_jump = guard_jump;
+    u8* prev_region = guard_region;
+    u64 prev_size = guard_size;
+    if(sigsetjmp(jump, 1)) {
+        guard_jump = prev_jump;
+        guard_region = prev_region;
+        guard_size = prev_size;
+        return false;
+    }
+    guard_jump = &jump;
+    guard_region = (u8*)region;
+    guard_size = size;
+    proc(arg);
+    guard_jump = prev_jump;
+    guard_region = prev_region;
+    guard_size = prev_size;
+    return true;
+}
+void* MapFile(const char* path, u64* out_size) {
+    *out_size = 0;
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+        return nullptr;
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    void* ptr = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if(ptr == MAP_FAILED)
+        return nullptr;
+    *out_size = info.st_size;
+    return ptr;
+}
+void UnmapFile(void* ptr, u64 size) {
+    munmap(ptr, size);
+}
+i32 atomic_add(volatile i32* ptr, i32 value) {
+    return __atomic_add_fetch(ptr, value, __ATOMIC_SEQ_CST);
+}
+void* atomic_compare_swap(void* volatile* ptr, void* expected, void* desired) {
+    // expected is overwritten with the old value when the swap fails
+    __atomic_compare_exchange_n(ptr, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return expected;
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,121 @@
+#include "VMHeap.h"
+
+VMHeap::Region* VMHeap::find_region(void* ptr) {
+    // the last region starting at or before ptr
+    int low = 0;
+    int high = regions.size();
+    while(low < high) {
+        int mid = (low + high) / 2;
+        if(regions[mid].base <= (u8*)ptr)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if(low == 0)
+        return nullptr;
+    Region* region = &regions[low - 1];
+    if((u8*)ptr >= region->base + region->size)
+        return nullptr;
+    return region;
+}
+
+void VMHeap::add_region(u8* base, u64 size, int block_shift) {
+    Region region{ base, size, block_shift };
+    int index = regions.size();
+    while(index > 0 && regions[index - 1].base > base)
+        index--;
+    regions.insert(regions.begin() + index, region);
+}
+
+void* VMHeap::allocate(int size) {
+    if(size < 0)
+        return nullptr;
+    u64 total = (u64)size + HEADER_SIZE;
+    int size_class = 0;
+    while(size_class < CLASS_COUNT && ((u64)1 << (size_class + MIN_CLASS_SHIFT)) < total)
+        size_class++;
+
+    Header* header = nullptr;
+    if(size_class == CLASS_COUNT) {
+        // large allocations get pages of their own
+        u64 region_size = (total + 0xFFF) & ~(u64)0xFFF;
+        u8* base = (u8*)AllocatePages(region_size);
+        if(!base)
+            return nullptr;
+        add_region(base, region_size, 0);
+        header = (Header*)base;
+    } else if(free_lists[size_class]) {
+        header = (Header*)free_lists[size_class];
+        free_lists[size_class] = *(void**)(header + 1);
+    } else {
+        int block_size = 1 << (size_class + MIN_CLASS_SHIFT);
+        if(bump[size_class] == bump_end[size_class]) {
+            u8* base = (u8*)AllocatePages(REGION_SIZE);
+            if(!base)
+                return nullptr;
+            add_region(base, REGION_SIZE, size_class + MIN_CLASS_SHIFT);
+            bump[size_class] = base;
+            bump_end[size_class] = base + REGION_SIZE;
+        }
+        header = (Header*)bump[size_class];
+        bump[size_class] += block_size;
+    }
+    header->size = size;
+    header->allocated = 1;
+    live_allocations++;
+    return header + 1;
+}
+
+bool VMHeap::free(void* ptr) {
+    Region* region = find_region(ptr);
+    if(!region)
+        return false;
+    Header* header = (Header*)ptr - 1;
+    if((u8*)header < region->base || !header->allocated)
+        return false;
+    u64 offset = (u8*)header - region->base;
+    if(region->block_shift == 0) {
+        if(offset != 0)
+            return false;
+        u8* base = region->base;
+        u64 size = region->size;
+        regions.erase(regions.begin() + (region - regions.data()));
+        FreePages(base, size);
+    } else {
+        if(offset & ((1 << region->block_shift) - 1))
+            return false; // not the start of a block
+        header->allocated = 0;
+        int size_class = region->block_shift - MIN_CLASS_SHIFT;
+        *(void**)(header + 1) = free_lists[size_class];
+        free_lists[size_class] = header;
+    }
+    live_allocations--;
+    return true;
+}
+
+bool VMHeap::contains(void* ptr, int size) {
+    Region* region = find_region(ptr);
+    if(!region)
+        return false;
+    Header* header = (Header*)region->base;
+    if(region->block_shift != 0) {
+        u64 offset = (u8*)ptr - region->base;
+        header = (Header*)(region->base + ((offset >> region->block_shift) << region->block_shift));
+    }
+    if(!header->allocated)
+        return false;
+    u64 diff = (u8*)ptr - (u8*)(header + 1);
+    return (u8*)ptr >= (u8*)(header + 1) && diff + size <= header->size;
+}
+
+void VMHeap::release() {
+    for(auto& region : regions)
+        FreePages(region.base, region.size);
+    regions.clear();
+    for(int i=0;i<CLASS_COUNT;i++) {
+        free_lists[i] = nullptr;
+        bump[i] = nullptr;
+        bump_end[i] = nullptr;
+    }
+    live_allocations = 0;
+}
@@ -1,4 +1,5 @@
 #include "VirtualMachine.h"
+#include "AST.h"
 
 #ifdef OS_WINDOWS
     #define WIN32_LEAN_AND_MEAN
@@ -10,21 +11,23 @@
 // #define LOG(X)
 
 void VirtualMachine::init() {
-    int max = 0x10000;
-    stack = NEW_ARRAY(u8, max, HERE);
-    Assert(stack);
-    stack_max = max;
+    stack_max = (stack_size + STACK_GUARD_SIZE - 1) & ~(STACK_GUARD_SIZE - 1);
+    if(stack_max <= 0)
+        stack_max = STACK_GUARD_SIZE;
+    stack_region_size = (u64)STACK_GUARD_SIZE + stack_max + STACK_GUARD_SIZE;
+    stack_region = (u8*)AllocatePages(stack_region_size);
+    Assert(stack_region);
+    stack = stack_region + STACK_GUARD_SIZE;
+    bool yes = ProtectNoAccess(stack_region, STACK_GUARD_SIZE);
+    yes &= ProtectNoAccess(stack + stack_max, STACK_GUARD_SIZE);
+    Assert(yes);
 }
 
-void VirtualMachine::execute() {
-    bool interactive = false;
-    bool enable_logging = false;
-    // interactive = true;
-    // enable_logging = true;
-    
-    bytecode->apply_relocations();
+void VirtualMachine::prepare() {
+    bytecode->finalize();
 
-    global_data = bytecode->copyGlobalData(&global_data_max);
+    if(!global_data)
+        global_data = bytecode->copyGlobalData(&global_data_max);
 
     // printf("global size %d\n",global_data_max);
     
@@ -32,22 +35,23 @@ void VirtualMachine::execute() {
     
     registers[REG_SP] = (i64)(stack + stack_max); // stack starts at the top and grows down
     
-    bool found_main = false;
-    auto unsafe_pieces = bytecode->pieces_unsafe();
-    for(int i=0;i<unsafe_pieces.size(); i++) {
-        if(unsafe_pieces[i]->name == "main") {
-            found_main = true;
-            piece_index = i;
-            piece = unsafe_pieces[i];
-            break;
-        }
-    }
-    if(!found_main) {
+    if(profiler)
+        profiler->init(bytecode);
+    if(stats)
+        stats->init(bytecode);
+}
+
+void VirtualMachine::execute() {
+    prepare();
+    
+    piece = bytecode->findPiece("main");
+    if(!piece) {
         log_color(RED);
         printf("VM: main was not found.\n");
         log_color(NO_COLOR);
         return;
     }
+    piece_index = piece->piece_index;
     if(piece->instructions.size() == 0) {
         log_color(YELLOW);
         printf("VM: '%s' has no instructions.\n", piece->name.c_str());
@@ -55,43 +59,154 @@ void VirtualMachine::execute() {
         return;
     }
     
-    // printf("VirtualMachine: Stack overflow (sp: %ld, stack range: %d - %d)\n", (i64)registers[REG_SP], (int)stack_max, 0);
-    #define CHECK_STACK if(registers[REG_SP] > (i64)stack + stack_max || registers[REG_SP] < (i64)stack) {\
-        printf("\n");\
-        log_color(Color::RED);\
-        printf("VM: Stack overflow (d_sp: %lld, max: %d)\n", (i64)registers[REG_SP] - (i64)stack, (int)stack_max);\
-        log_color(Color::NO_COLOR);\
-        return;\
+    registers[REG_BP] = registers[REG_SP];
+    
+    log_color(GREEN);
+    printf("VM: Started in '%s'\n", piece->name.c_str());
+    log_color(NO_COLOR);
+    
+    auto proc = [](void* vm) { ((VirtualMachine*)vm)->interpret(); };
+    bool no_overflow = CallWithGuardPages(proc, this, stack_region, stack_region_size);
+    flush_output();
+    if(!no_overflow) {
+        printf("\n");
+        log_color(Color::RED);
+        printf("VM: Stack overflow (d_sp: %lld, max: %d)\n", (long long)(registers[REG_SP] - (i64)stack), (int)stack_max);
+        log_color(Color::NO_COLOR);
     }
     
-    bool memory_check = false;
-    auto can_access_memory=[this](void* ptr, int size) {
-        u64 diff = (u64)ptr - (u64)stack;
-        if((diff >= 0 && diff + size <= stack_max)) {
-            goto valid_access;
-        }
-        diff = (u64)ptr - (u64)global_data;
-        if((diff >= 0 && diff + size <= global_data_max)) {
-            goto valid_access;
-        }
-        
-        for(auto pair : allocations) {
-            u64 diff = (u64)ptr - (u64)pair.first;
-            if((diff >= 0 && diff + size <= pair.second.size)) {
-                goto valid_access;
-            }
+    if(heap.live_allocations > 0) {
+        log_color(RED);
+        printf("VM: Finished with %d unfreed allocations.\n", heap.live_allocations);
+        log_color(NO_COLOR);
+        heap.release();
+    } else {
+        log_color(GREEN);
+        printf("VM: Finished\n");
+        log_color(NO_COLOR);
+    }
+    close_files(); // still open when main returned
+    if(profiler)
+        profiler->print_report(bytecode);
+    if(stats)
+        stats->print_report(bytecode);
+    // print_registers();
+}
+
+BytecodePiece* VirtualMachine::find_function(const std::string& name) {
+    return bytecode->findPiece(name);
+}
+
+bool VirtualMachine::call_packed(BytecodePiece* function, void* ret, int ret_size, const void** args, const int* arg_sizes, int arg_count) {
+    if(!function || !function->function) {
+        log_color(RED);
+        printf("VM: Called function doesn't exist.\n");
+        log_color(NO_COLOR);
+        return false;
+    }
+    ASTFunction* func = function->function;
+    if(arg_count != func->parameters.size()) {
+        log_color(RED);
+        printf("VM: '%s' takes %d arguments, %d were passed.\n", func->name.c_str(), (int)func->parameters.size(), arg_count);
+        log_color(NO_COLOR);
+        return false;
+    }
+    AST* ast = bytecode->ast;
+    for(int i=0;i<arg_count;i++) {
+        int size = ast->sizeOfType(func->parameters[i].typeId);
+        if(arg_sizes[i] != size) {
+            log_color(RED);
+            printf("VM: Argument '%s' of '%s' is %d bytes, %d were passed.\n", func->parameters[i].name.c_str(), func->name.c_str(), size, arg_sizes[i]);
+            log_color(NO_COLOR);
+            return false;
         }
-        
+    }
+    int return_size = ast->sizeOfType(func->return_type);
+    if(ret && ret_size != return_size) {
         log_color(RED);
-        printf("VM: Access violation at 0x%p + %d\n", ptr, size);
+        printf("VM: '%s' returns %d bytes, %d were expected.\n", func->name.c_str(), return_size, ret_size);
         log_color(NO_COLOR);
         return false;
-    valid_access:
-        return true;
-    };
+    }
+    
+    prepare();
     
+    // same layout as the call sequence the generator emits
+    registers[REG_SP] -= func->parameters_size;
+    u8* args_base = (u8*)registers[REG_SP];
+    for(int i=0;i<arg_count;i++)
+        memcpy(args_base + func->parameters[i].offset - 16, args[i], arg_sizes[i]);
+    
+    // a frame returning to piece -1 stops the interpreter
+    registers[REG_SP] -= 4;
+    *(int*)registers[REG_SP] = 0;
+    registers[REG_SP] -= 4;
+    *(int*)registers[REG_SP] = -1;
+    registers[REG_SP] -= 8;
+    *(i64*)registers[REG_SP] = registers[REG_BP];
     registers[REG_BP] = registers[REG_SP];
     
+    piece = function;
+    piece_index = function->piece_index;
+    registers[REG_PC] = 0;
+    
+    struct Run { VirtualMachine* vm; bool returned; } run{ this, false };
+    auto proc = [](void* data) { ((Run*)data)->returned = ((Run*)data)->vm->interpret(); };
+    bool no_overflow = CallWithGuardPages(proc, &run, stack_region, stack_region_size);
+    flush_output();
+    if(!no_overflow) {
+        log_color(Color::RED);
+        printf("VM: Stack overflow in '%s' (d_sp: %lld, max: %d)\n", func->name.c_str(), (long long)(registers[REG_SP] - (i64)stack), (int)stack_max);
+        log_color(Color::NO_COLOR);
+        return false;
+    }
+    if(!run.returned)
+        return false;
+    
+    if(ret && return_size > 0)
+        memcpy(ret, args_base - 16 + func->return_offset, return_size);
+    return true;
+}
+// Whether the program may read or write size bytes at ptr, reports an access violation if not
+bool VirtualMachine::can_access_memory(void* ptr, int size, bool write) {
+    u64 diff = (u64)ptr - (u64)stack;
+    if((diff >= 0 && diff + size <= stack_max)) {
+        goto valid_access;
+    }
+    diff = (u64)ptr - (u64)global_data;
+    if((diff >= 0 && diff + size <= global_data_max)) {
+        goto valid_access;
+    }
+    
+    if(heap.contains(ptr, size)) {
+        goto valid_access;
+    }
+    
+    if(!write) {
+        for(auto& mapped : mapped_files) {
+            diff = (u64)ptr - (u64)mapped.data;
+            if(diff + size <= mapped.size)
+                goto valid_access;
+        }
+    }
+    
+    flush_output();
+    log_color(RED);
+    printf("VM: Access violation at 0x%p + %d\n", ptr, size);
+    log_color(NO_COLOR);
+    return false;
+valid_access:
+    return true;
+}
+template<bool INSTRUMENTED>
+bool VirtualMachine::interpret_loop() {
+    bool interactive = false;
+    bool enable_logging = false;
+    // interactive = true;
+    // enable_logging = true;
+    
+    bool check_memory = this->check_memory; // local copy so the compiler can keep it in a register
+    
     auto mov=[&](int size, void* dst, void* src) {
         switch(size){
         case 1: *( u8*)dst = *( u8*)src; break;
@@ -102,16 +217,25 @@ void VirtualMachine::execute() {
         }
     };
     
-    log_color(GREEN);
-    printf("VM: Started in '%s'\n", piece->name.c_str());
-    log_color(NO_COLOR);
-    
     int debug_last_piece = -1;
     int debug_last_line = -1;
     
+    VMProfiler* profiler = this->profiler;
+    VMStats* stats = this->stats;
+    const bool instrumented = INSTRUMENTED;
+    u8* stack_top = stack + stack_max;
+    bool use_jit = enable_jit && !interactive && !enable_logging && !instrumented;
+    bool jit_check = false; // set when entering a piece or jumping backwards
+    if(use_jit && jit_pieces.size() != bytecode->pieces_unsafe().size()) {
+        // compiled pieces are kept between calls
+        jit_pieces.resize(bytecode->pieces_unsafe().size());
+    }
+    
+    bool returned = false;
     bool running = true;
     while(running) {
         if(interactive) {
+            flush_output();
             printf("> ");
             std::string line;
             std::getline(std::cin, line);
@@ -147,7 +271,29 @@ void VirtualMachine::execute() {
             }
         }
         
+        if(jit_check) {
+            jit_check = false;
+            auto& jit = jit_pieces[piece_index];
+            if(!jit.code && !jit.failed && ++jit.counter >= JIT_THRESHOLD) {
+                jit.code = JitCompile(this, piece);
+                jit.failed = !jit.code;
+            }
+            if(jit.code) {
+                // returns at calls, returns and instructions it can't handle
+                JitExit status = jit.code->run(registers, registers[REG_PC]);
+                if(status == JIT_EXIT_STACK_OVERFLOW) {
+                    flush_output();
+                    printf("\n");
+                    log_color(Color::RED);
+                    printf("VM: Stack overflow (d_sp: %lld, max: %d)\n", (long long)(registers[REG_SP] - (i64)stack), (int)stack_max);
+                    log_color(Color::NO_COLOR);
+                    return false;
+                }
+            }
+        }
+        
         if(registers[REG_PC] >= piece->instructions.size()) {
+            flush_output();
             log_color(Color::RED);
             printf("INTERPRETER: PC out of bounds (pc: %d, piece instructions: %d\n", (int)registers[REG_PC], (int)piece->instructions.size());
             log_color(Color::NO_COLOR);
@@ -156,6 +302,13 @@ void VirtualMachine::execute() {
         int prev_pc = registers[REG_PC];
         Instruction inst = piece->instructions[registers[REG_PC]];
         registers[REG_PC]++;
+        
+        if(instrumented) {
+            if(profiler)
+                profiler->count(piece_index, prev_pc, (u8*)registers[REG_BP], stack_top);
+            if(stats)
+                stats->count(inst);
+        }
 
         ControlFlags control = (ControlFlags)inst.op2;
         
@@ -210,7 +363,7 @@ void VirtualMachine::execute() {
         case INST_MOV_MR_DISP: {
             void* ptr = (void*)(registers[inst.op0] + imm);
             int size = inst.op2;
-            if(!can_access_memory(ptr, size)) {
+            if(check_memory && !can_access_memory(ptr, size, true)) {
                 piece->print(bytecode, true, prev_pc, prev_pc+1);
                 printf("\n");
                 running = false;
@@ -223,7 +376,7 @@ void VirtualMachine::execute() {
             void* ptr = (void*)(registers[inst.op1] + imm);
             int size = inst.op2;
             registers[inst.op0] = 0; // reset register
-            if(!can_access_memory(ptr, size)) {
+            if(check_memory && !can_access_memory(ptr, size, false)) {
                 piece->print(bytecode, true, prev_pc, prev_pc+1);
                 printf("\n");
                 running = false;
@@ -237,51 +390,60 @@ void VirtualMachine::execute() {
         }
         case INST_PUSH: {
             registers[REG_SP] -= 8;
-            CHECK_STACK
             *(i64*)registers[REG_SP] = registers[inst.op0];
             break;
         }
         case INST_POP: {
             registers[inst.op0] = *(i64*)registers[REG_SP];
             registers[REG_SP] += 8;
-            CHECK_STACK
             break;
         }
         case INST_INCR: {
-            int imm = ((i8)inst.op1) | ((i8)inst.op2 << 8);
-            registers[inst.op0] += imm;
-            if(inst.op0 == REG_SP) {
-                CHECK_STACK
-            }
+            registers[inst.op0] += decode_incr(inst);
             break;
         }
         case INST_DATAPTR: {
             registers[inst.op0] = (i64)(global_data + imm);
         } break;
         case INST_CALL: {
+            if(imm < -NATIVE_MAX) {
+                run_host_call(host_native_index(imm));
+                if(profiler) // charge the time of the native to the call
+                    profiler->sample(piece_index, prev_pc, (u8*)registers[REG_BP], stack_top);
+                if(stats)
+                    stats->count_native(NATIVE_MAX + host_native_index(imm));
+                break;
+            }
             if(imm < 0) { // special native call
                 NativeCalls type = (NativeCalls)(imm + NATIVE_MAX);
                 bool will_print = type == NATIVE_printc || type == NATIVE_printf || type == NATIVE_printi || type == NATIVE_prints;
                 if(will_print) {
                     LOG(printf("\n");)
                 }
-                run_native_call(type);
+                if(!run_native_call(type)) {
+                    piece->print(bytecode, true, prev_pc, prev_pc+1);
+                    printf("\n");
+                    running = false;
+                    break;
+                }
+                if(profiler)
+                    profiler->sample(piece_index, prev_pc, (u8*)registers[REG_BP], stack_top);
+                if(stats)
+                    stats->count_native(type);
                 if(will_print) {
                     printed_newline = true;
-                    LOG(printf("\n");)
+                    LOG(flush_output(); printf("\n");)
                 }
                 break;
             }
             
             // push pc
             registers[REG_SP] -= 4;
-            CHECK_STACK
             *(int*)registers[REG_SP] = registers[REG_PC];
             Assert(registers[REG_PC] >> 32 == 0); // make sure we don't overflow, probably never will but just in case
             
             // push piece_index
             registers[REG_SP] -= 4;
-            CHECK_STACK
             *(int*)registers[REG_SP] = piece_index;
             
             // set program counter to start of the function
@@ -291,50 +453,66 @@ void VirtualMachine::execute() {
 
             // push bp
             registers[REG_SP] -= 8;
-            CHECK_STACK
             *(i64*)registers[REG_SP] = registers[REG_BP];
 
             // mov bp, sp
             registers[REG_BP] = registers[REG_SP];
 
+            jit_check = use_jit;
+            break;
+        }
+        case INST_TAILCALL: {
+            // sp is at bp and the arguments are where the callee's parameters go,
+            // the frame is handed over as it is
+            Assert(imm > 0);
+            registers[REG_PC] = 0;
+            piece_index = imm - 1;
+            piece = bytecode->getPiece(piece_index);
+            jit_check = use_jit;
             break;
         }
         case INST_RET: {
             if(registers[REG_SP] == (i64)stack + stack_max) {
+                returned = true;
                 running = false;
                 break;
             }
 
             if(registers[REG_BP] != registers[REG_SP]) {
+                flush_output();
                 printf("\n");
                 log_color(Color::RED);
-                printf("INTERPRETER: Stack pointer and base pointer mismatch on ret instruction (bp: %lld, sp %lld\n", registers[REG_BP], registers[REG_SP]);
+                printf("INTERPRETER: Stack pointer and base pointer mismatch on ret instruction (bp: %lld, sp %lld\n", (long long)registers[REG_BP], (long long)registers[REG_SP]);
                 log_color(Color::NO_COLOR);
-                return;
+                return false;
             }
 
 
             // pop bp
             registers[REG_BP] = *(i64*)registers[REG_SP];
             registers[REG_SP] += 8;
-            CHECK_STACK
 
             piece_index = *(int*)registers[REG_SP];
             registers[REG_SP] += 4;
-            CHECK_STACK
             
             registers[REG_PC] = *(int*)registers[REG_SP];
             registers[REG_SP] += 4;
-            CHECK_STACK
 
+            if(piece_index < 0) {
+                // returned to the frame set up by call_packed
+                returned = true;
+                running = false;
+                break;
+            }
             
             piece = bytecode->getPiece(piece_index);
+            jit_check = use_jit;
             break;
         }
         case INST_MEMZERO: {
             void* ptr = (void*)(registers[inst.op0]);
             int size = registers[inst.op1];
-            if(!can_access_memory(ptr, size)) {
+            if(check_memory && !can_access_memory(ptr, size, true)) {
                 piece->print(bytecode, true, prev_pc, prev_pc+1);
                 printf("\n");
                 running = false;
@@ -343,31 +521,94 @@ void VirtualMachine::execute() {
             }
             break;
         }
+        case INST_MEMCPY:
+        case INST_MEMCPY_IMM: {
+            void* dst = (void*)registers[inst.op0];
+            void* src = (void*)registers[inst.op1];
+            int size = inst.opcode == INST_MEMCPY ? registers[inst.op2] : imm;
+            if(check_memory && (!can_access_memory(dst, size, true) || !can_access_memory(src, size, false))) {
+                piece->print(bytecode, true, prev_pc, prev_pc+1);
+                printf("\n");
+                running = false;
+            } else {
+                memmove(dst, src, size); // structs are moved between overlapping parts of the stack
+            }
+            break;
+        }
         case INST_JMP: {
             registers[REG_PC] += imm -1; // -1 because imm is relative to the immediates address and not the end of the jump instruction. See BytecodePiece::fix_jump_here for specifics.
+            jit_check = use_jit && imm < 0;
             break;
         }
         case INST_JZ: {
             if(registers[inst.op0] == 0) {
                 registers[REG_PC] += imm -1; // -1 because imm is relative to the immediates address and not the end of the jump instruction. See BytecodePiece::fix_jump_here for specifics.
+                jit_check = use_jit && imm < 0;
             }
             break;
         }
         #define CASEC(T,OP) case T: if (control & CONTROL_FLOAT) registers[inst.op0] = *(float*)&registers[inst.op0] OP *(float*)&registers[inst.op1]; else if(control & CONTROL_1B) registers[inst.op0] = *(i8*)&registers[inst.op0] OP *(i8*)&registers[inst.op1]; else registers[inst.op0] = registers[inst.op0] OP registers[inst.op1]; break;
         #define CASEF(T,OP) case T: if (control & CONTROL_FLOAT) *(float*)&registers[inst.op0] = *(float*)&registers[inst.op0] OP *(float*)&registers[inst.op1]; else registers[inst.op0] = registers[inst.op0] OP registers[inst.op1]; break;
-        CASEF(INST_ADD, +)
-        CASEF(INST_SUB, -)
-        CASEF(INST_MUL, *)
-        CASEF(INST_DIV, /)
-        case INST_AND: registers[inst.op0] = registers[inst.op0] && registers[inst.op1]; break;
-        case INST_OR:  registers[inst.op0] = registers[inst.op0] || registers[inst.op1]; break;
-        case INST_NOT: registers[inst.op0] = !registers[inst.op1]; break;
-        CASEC(INST_EQUAL, ==)
-        CASEC(INST_NOT_EQUAL, !=)
-        CASEC(INST_LESS, <)
-        CASEC(INST_LESS_EQUAL, <=)
-        CASEC(INST_GREATER, >)
+        #define COMPARE_CASES \
+        CASEC(INST_EQUAL, ==) \
+        CASEC(INST_NOT_EQUAL, !=) \
+        CASEC(INST_LESS, <) \
+        CASEC(INST_LESS_EQUAL, <=) \
+        CASEC(INST_GREATER, >) \
         CASEC(INST_GREATER_EQUAL, >=)
+        #define BINARY_CASES \
+        CASEF(INST_ADD, +) \
+        CASEF(INST_SUB, -) \
+        CASEF(INST_MUL, *) \
+        CASEF(INST_DIV, /) \
+        case INST_AND: registers[inst.op0] = registers[inst.op0] && registers[inst.op1]; break; \
+        case INST_OR:  registers[inst.op0] = registers[inst.op0] || registers[inst.op1]; break; \
+        COMPARE_CASES
+        BINARY_CASES
+        case INST_NOT: registers[inst.op0] = !registers[inst.op1]; break;
+        
+        // superinstructions
+        case INST_PUSH_LI: {
+            registers[inst.op0] = imm;
+            registers[REG_SP] -= 8;
+            *(i64*)registers[REG_SP] = registers[inst.op0];
+        } break;
+        case INST_PUSH_RM_DISP: {
+            void* ptr = (void*)(registers[inst.op1] + imm);
+            int size = inst.op2;
+            registers[inst.op0] = 0; // reset register
+            if(check_memory && !can_access_memory(ptr, size, false)) {
+                piece->print(bytecode, true, prev_pc, prev_pc+1);
+                printf("\n");
+                running = false;
+                break;
+            }
+            mov(size, &registers[inst.op0], ptr);
+            registers[REG_SP] -= 8;
+            *(i64*)registers[REG_SP] = registers[inst.op0];
+        } break;
+        case INST_STACK_OP: {
+            registers[inst.op1] = registers[inst.op0];
+            registers[inst.op0] = *(i64*)registers[REG_SP];
+            registers[REG_SP] += 8;
+            switch((Opcode)imm) {
+                BINARY_CASES
+                default: Assert(("Incomplete instruction",false));
+            }
+        } break;
+        case INST_CMP_JZ: {
+            control = decode_cmp_jz_control(inst);
+            switch(decode_cmp_jz(inst)) {
+                COMPARE_CASES
+                default: Assert(("Incomplete instruction",false));
+            }
+            if(registers[inst.op0] == 0) {
+                registers[REG_PC] += imm -1;
+                jit_check = use_jit && imm < 0;
+            }
+        } break;
+        #undef BINARY_CASES
+        #undef COMPARE_CASES
         default: Assert(("Incomplete instruction",false));
         }
         
@@ -377,7 +618,7 @@ void VirtualMachine::execute() {
                 mov((u8)inst.op2, &tmp, (void*)(registers[inst.op0] + imm));
                 LOG(
                     log_color(GRAY);
-                    printf("  *%s = %lld ", register_names[inst.op0], tmp);
+                    printf("  *%s = %lld ", register_names[inst.op0], (long long)tmp);
                     // printf("  *%s = %ld ", register_names[inst.op0], tmp);
                     log_color(NO_COLOR);
                 )
@@ -385,7 +626,7 @@ void VirtualMachine::execute() {
                 LOG(
                     log_color(GRAY);
                     // printf("  %s = %ld ", register_names[inst.op0], registers[inst.op0]);
-                    printf("  %s = %lld ", register_names[inst.op0], registers[inst.op0]);
+                    printf("  %s = %lld ", register_names[inst.op0], (long long)registers[inst.op0]);
                     log_color(NO_COLOR);
                 )
             }
@@ -394,22 +635,17 @@ void VirtualMachine::execute() {
         if(!printed_newline)
             LOG(printf("\n");)
     }
-    if(allocations.size() > 0) {
-        log_color(RED);
-        printf("VM: Finished with %d unfreed allocations.\n", (int)allocations.size());
-        log_color(NO_COLOR);
-        for(auto& pair : allocations) {
-            Free(pair.first, pair.second.size, HERE, typeid(u8));
-        }
-        allocations.clear();
-    } else {
-        log_color(GREEN);
-        printf("VM: Finished\n");
-        log_color(NO_COLOR);
-    }
-    // print_registers();
+    return returned;
+}
+// Runs until the first piece returns, returns false if something stopped
+// it before that. Stack overflow isn't checked here, the guard pages
+// around the stack fault and CallWithGuardPages returns in execute.
+bool VirtualMachine::interpret() {
+    if(profiler || stats)
+        return interpret_loop<true>();
+    return interpret_loop<false>();
 }
-void VirtualMachine::run_native_call(NativeCalls callType) {
+bool VirtualMachine::run_native_call(NativeCalls callType) {
     // auto inst_pop = [&](Register reg) {
     //     Assert(reg >= REG_T0 && reg <= REG_T1);
     //     registers[reg] = *(i64*)registers[REG_SP];
@@ -426,22 +662,27 @@ void VirtualMachine::run_native_call(NativeCalls callType) {
     case NATIVE_printi: {
         int arg0 = *(int*)(registers[REG_SP] + 0);
         
-        printf("%d", arg0);
+        write_int(arg0);
     } break;
     case NATIVE_printf: {
         float arg0 = *(float*)(registers[REG_SP] + 0);
         
-        printf("%f", arg0);
+        write_float(arg0);
     } break;
      case NATIVE_printc: {
         char arg0 = *(char*)(registers[REG_SP] + 0);
         
-        printf("%c", arg0);
+        if(output_used == OUTPUT_BUFFER_SIZE)
+            flush_output();
+        output_buffer[output_used++] = arg0;
     } break;
      case NATIVE_prints: {
         char* arg0 = *(char**)(registers[REG_SP] + 0);
         
-        printf("%s", arg0);
+        write_output(arg0, strlen(arg0));
+    } break;
+    case NATIVE_flush: {
+        flush_output();
     } break;
     case NATIVE_malloc: {
         int arg0 = *(int*)(registers[REG_SP] + 0);
@@ -449,26 +690,17 @@ void VirtualMachine::run_native_call(NativeCalls callType) {
         // int arg2 = *(int*)(registers[REG_SP] + 12);
         void*& ret = *(void**)(registers[REG_SP] - 16 - 8);
         
-        ret = Alloc(arg0, HERE, typeid(u8), 1);
-        if(ret) {
-            allocations[ret] = {arg0};
-        }
+        ret = heap.allocate(arg0);
     } break;
      case NATIVE_mfree: {
         void* arg0 = *(void**)(registers[REG_SP] + 0);
         // void*& ret = *(void**)(registers[REG_SP] - 16 - 8);
         
-        if(arg0) {
-            auto pair = allocations.find(arg0);
-            if(pair == allocations.end()) {
-                log_color(Color::RED);
-                printf("INTERPRETER: mfree was called with a pointer that wasn't allocated\n");
-                log_color(Color::NO_COLOR);
-            } else {
-                // TODO: Not decreasing memory usage
-                Free(arg0, pair->second.size, HERE, typeid(u8));
-                allocations.erase(arg0);
-            }
+        if(arg0 && !heap.free(arg0)) {
+            flush_output();
+            log_color(Color::RED);
+            printf("INTERPRETER: mfree was called with a pointer that wasn't allocated\n");
+            log_color(Color::NO_COLOR);
         }
     } break;
     case NATIVE_memcpy: {
@@ -515,10 +747,9 @@ void VirtualMachine::run_native_call(NativeCalls callType) {
             *out_size = filesize;
         
         if(out_data) {
-            char* text = (char*)NEW_ARRAY(u8, filesize, HERE); // we use u8 because free assumes u8, if we used char then types would be incompatible and assert would fire in the tracker when we allocate the ptr using one type and free it with another
+            char* text = (char*)heap.allocate(filesize); // freed with mfree
             Assert(text);
             
-            allocations[text] = {filesize};
             file.read(text, filesize);
             
             *out_data = text;
@@ -539,14 +770,187 @@ void VirtualMachine::run_native_call(NativeCalls callType) {
             break;
         }
         ret = true;
-        if(out_size < 0) {
+        if(out_size > 0) {
             Assert(out_data);
             file.write(out_data, out_size);
         }
         file.close();
     } break;
+    case NATIVE_file_open: {
+        char* path = *(char**)(registers[REG_SP] + 0);
+        int mode = *(int*)(registers[REG_SP] + 8);
+        int& ret = *(int*)(registers[REG_SP] - 16 - 8);
+        
+        Assert(path);
+        
+        const char* modes[] { "rb", "wb", "ab" };
+        FILE* file = nullptr;
+        if(mode >= 0 && mode < 3)
+            file = fopen(path, modes[mode]);
+        if(!file) {
+            ret = -1;
+            break;
+        }
+        ret = 0;
+        while(ret < files.size() && files[ret])
+            ret++;
+        if(ret == files.size())
+            files.push_back(file);
+        else
+            files[ret] = file;
+    } break;
+    case NATIVE_file_close: {
+        int handle = *(int*)(registers[REG_SP] + 0);
+        
+        if(handle < 0 || handle >= files.size() || !files[handle]) {
+            flush_output();
+            log_color(Color::RED);
+            printf("INTERPRETER: file_close was called with a handle that isn't open (%d)\n", handle);
+            log_color(Color::NO_COLOR);
+            break;
+        }
+        fclose(files[handle]);
+        files[handle] = nullptr;
+    } break;
+    case NATIVE_file_read:
+    case NATIVE_file_write: {
+        int handle = *(int*)(registers[REG_SP] + 0);
+        void* buffer = *(void**)(registers[REG_SP] + 8);
+        int size = *(int*)(registers[REG_SP] + 16);
+        int& ret = *(int*)(registers[REG_SP] - 16 - 8);
+        
+        if(handle < 0 || handle >= files.size() || !files[handle] || size < 0) {
+            ret = -1;
+            break;
+        }
+        if(check_memory && size > 0 && !can_access_memory(buffer, size, callType == NATIVE_file_read)) {
+            ret = -1;
+            return false;
+        }
+        Assert(buffer || size == 0);
+        if(callType == NATIVE_file_read)
+            ret = fread(buffer, 1, size, files[handle]);
+        else
+            ret = fwrite(buffer, 1, size, files[handle]);
+    } break;
+    case NATIVE_map_file: {
+        char* path = *(char**)(registers[REG_SP] + 0);
+        int* out_size = *(int**)(registers[REG_SP] + 8);
+        char*& ret = *(char**)(registers[REG_SP] - 16 - 8);
+        
+        Assert(path);
+        if(check_memory && out_size && !can_access_memory(out_size, sizeof(*out_size), true)) {
+            ret = nullptr;
+            return false;
+        }
+        
+        u64 size = 0;
+        ret = (char*)MapFile(path, &size);
+        if(ret && size > 0x7FFFFFFF) {
+            // sizes are ints in Tin
+            UnmapFile(ret, size);
+            ret = nullptr;
+            size = 0;
+        }
+        if(ret)
+            mapped_files.push_back({(u8*)ret, size});
+        if(out_size)
+            *out_size = size;
+    } break;
+    case NATIVE_unmap_file: {
+        char* data = *(char**)(registers[REG_SP] + 0);
+        
+        int index = 0;
+        while(index < mapped_files.size() && mapped_files[index].data != (u8*)data)
+            index++;
+        if(index == mapped_files.size()) {
+            flush_output();
+            log_color(Color::RED);
+            printf("INTERPRETER: unmap_file was called with a pointer that wasn't mapped\n");
+            log_color(Color::NO_COLOR);
+            break;
+        }
+        UnmapFile(mapped_files[index].data, mapped_files[index].size);
+        mapped_files.erase(mapped_files.begin() + index);
+    } break;
     default: Assert(false);   
     }
+    return true;
+}
+void VirtualMachine::close_files() {
+    for(auto file : files) {
+        if(file)
+            fclose(file);
+    }
+    files.clear();
+    for(auto& mapped : mapped_files)
+        UnmapFile(mapped.data, mapped.size);
+    mapped_files.clear();
+}
+void VirtualMachine::flush_output() {
+    if(output_used > 0)
+        fwrite(output_buffer, 1, output_used, stdout);
+    output_used = 0;
+    fflush(stdout);
+}
+void VirtualMachine::write_output(const char* str, int length) {
+    if(output_used + length > OUTPUT_BUFFER_SIZE) {
+        flush_output();
+        if(length > OUTPUT_BUFFER_SIZE) {
+            fwrite(str, 1, length, stdout);
+            return;
+        }
+    }
+    memcpy(output_buffer + output_used, str, length);
+    output_used += length;
+}
+void VirtualMachine::write_int(int value) {
+    char digits[12];
+    int start = sizeof(digits);
+    u32 abs = value < 0 ? -(u32)value : (u32)value;
+    do {
+        digits[--start] = '0' + abs % 10;
+        abs /= 10;
+    } while(abs);
+    if(value < 0)
+        digits[--start] = '-';
+    write_output(digits + start, sizeof(digits) - start);
+}
+// Same output as printf("%f"). The fraction of a float times 10^6 fits in
+// the mantissa of a double so it is scaled and rounded (to even, like printf) exactly.
+void VirtualMachine::write_float(float value) {
+    double abs = value < 0 ? -(double)value : (double)value;
+    if(!(abs < 1e15)) {
+        // huge, inf or nan
+        char str[64];
+        int length = snprintf(str, sizeof(str), "%f", value);
+        write_output(str, length);
+        return;
+    }
+    u64 whole = (u64)abs;
+    double scaled = (abs - whole) * 1000000.0;
+    u64 fraction = (u64)scaled;
+    double rest = scaled - fraction;
+    if(rest > 0.5 || (rest == 0.5 && (fraction & 1)))
+        fraction++;
+    if(fraction == 1000000) {
+        fraction = 0;
+        whole++;
+    }
+    char digits[32];
+    int start = sizeof(digits);
+    for(int i=0;i<6;i++) {
+        digits[--start] = '0' + fraction % 10;
+        fraction /= 10;
+    }
+    digits[--start] = '.';
+    do {
+        digits[--start] = '0' + whole % 10;
+        whole /= 10;
+    } while(whole);
+    if(std::signbit(value))
+        digits[--start] = '-';
+    write_output(digits + start, sizeof(digits) - start);
 }
 void VirtualMachine::print_registers(bool subtle) {
     log_color(Color::GOLD);
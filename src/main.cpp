@@ -10,6 +10,21 @@ void print_help() {
     printf(" tin <file> -run : Compile and execute a file\n");
     printf(" tin <file> -threads <thread_count> : Execute with one or more threads. Note that you should compile the compiler with multithreading disabled when using one thread.\n");
     printf(" tin <file> -gen-code : Generates procedural code in the 'generated' directory.\n");
+    printf(" tin <file> -O0 : Disable constant folding, dead code removal and all bytecode optimizations.\n");
+    printf(" tin <file> -ir : Generate bytecode through an SSA form with register allocation, dead code elimination, value numbering, loop invariant code motion and pointer increments for indexing in loops.\n");
+    printf(" tin <file> -no-opt <pass> : Disable one bytecode optimization pass (");
+    for(int i=0;i<OPT_PASS_COUNT;i++)
+        printf(i == 0 ? "%s" : ", %s", optimization_pass_names[i]);
+    printf(").\n");
+    printf(" tin <file> -opt-stats : Print instruction counts before and after each optimization pass.\n");
+    printf(" tin <file> -run -jit : Compile frequently executed functions to x86-64 machine code. Memory accesses are not validated in machine code.\n");
+    printf(" tin <file> -run -unchecked : Don't validate loads and stores in the interpreter. Only use it for trusted programs.\n");
+    printf(" tin <file> -run -vms <count> : Execute the program on several virtual machines in parallel, one thread each.\n");
+    printf(" tin <file> -run -stack-size <kilobytes> : Size of the stack in the virtual machine, 64 KB by default.\n");
+    printf(" tin <file> -run -profile <output.folded> : Print the instructions and time spent in each function and line, and write call stacks for flamegraphs.\n");
+    printf(" tin <file> -run -vmstats : Print how many times each opcode, pair of opcodes, operand size and native function was executed.\n");
+    printf(" tin <file> -asm <output.s> : Write x86-64 assembly, build a program with 'gcc output.s runtime/tin_runtime.c -lm'.\n");
+    printf(" tin <file> -emit-c <output.c> : Write C source, build a program with 'gcc -O2 -fwrapv output.c runtime/tin_runtime.c -lm'.\n");
     // printf(" tin <file> -debug : Compile, execute, and debug a file\n");
     // printf(" tin <file> -log : Log the execution\n");
 }
@@ -50,6 +65,75 @@ int main(int argc, const char** argv) {
             gen_code = true;
         } else if(streq(arg, "-measure")) {
             measure = true;
+        } else if(streq(arg, "-O0")) {
+            options.optimization_passes = OPT_NONE;
+            options.fold_constants = false;
+            options.remove_dead_code = false;
+            options.remove_unreachable_functions = false;
+            options.ir_passes = IR_PASS_NONE;
+        } else if(streq(arg, "-ir")) {
+            options.use_ir = true;
+        } else if(streq(arg, "-no-opt")) {
+            i++;
+            if(i < argc) {
+                auto pass = FindOptimizationPass(argv[i]);
+                if(pass == OPT_NONE) {
+                    printf("Unknown optimization pass '%s'\n", argv[i]);
+                    return 1;
+                }
+                options.optimization_passes &= ~pass;
+            } else {
+                printf("Missing pass name for %s\n", arg);
+                return 0;
+            }
+        } else if(streq(arg, "-opt-stats")) {
+            options.print_optimization_stats = true;
+        } else if(streq(arg, "-jit")) {
+            options.jit = true;
+        } else if(streq(arg, "-unchecked")) {
+            options.unchecked = true;
+        } else if(streq(arg, "-vms")) {
+            i++;
+            if(i < argc && atoi(argv[i]) > 0) {
+                options.vm_count = atoi(argv[i]);
+            } else {
+                printf("Missing virtual machine count for %s\n", arg);
+                return 0;
+            }
+        } else if(streq(arg, "-stack-size")) {
+            i++;
+            if(i < argc && atoi(argv[i]) > 0) {
+                options.stack_size = atoi(argv[i]) * 1024;
+            } else {
+                printf("Missing size in kilobytes for %s\n", arg);
+                return 0;
+            }
+        } else if(streq(arg, "-asm")) {
+            i++;
+            if(i < argc) {
+                options.asm_output = argv[i];
+            } else {
+                printf("Missing path for %s\n", arg);
+                return 0;
+            }
+        } else if(streq(arg, "-profile")) {
+            i++;
+            if(i < argc) {
+                options.profile_output = argv[i];
+            } else {
+                printf("Missing path for %s\n", arg);
+                return 0;
+            }
+        } else if(streq(arg, "-vmstats")) {
+            options.vm_stats = true;
+        } else if(streq(arg, "-emit-c")) {
+            i++;
+            if(i < argc) {
+                options.c_output = argv[i];
+            } else {
+                printf("Missing path for %s\n", arg);
+                return 0;
+            }
         // } else if(streq(arg, "-debug")) {
         //     debug_mode = true;
         // } else if(streq(arg, "-log")) {
@@ -105,14 +189,18 @@ int main(int argc, const char** argv) {
         int start_mem = GetAllocatedMemory();
         bool yes = CompileFile(&options, &bytecode);
 
+        if(yes && !options.asm_output.empty()) {
+            Assert(bytecode);
+            yes = GenerateAssembly(bytecode, options.asm_output);
+        }
+        if(yes && !options.c_output.empty()) {
+            Assert(bytecode && bytecode->ast);
+            yes = GenerateC(bytecode->ast, options.c_output);
+        }
+
         if(yes && options.run) {
             Assert(bytecode);
-            VirtualMachine* interpreter = new VirtualMachine();
-            interpreter->bytecode = bytecode;
-            interpreter->init();
-            interpreter->execute();
-            
-            delete interpreter;
+            RunBytecode(bytecode, &options);
         }
         if(bytecode) {
             DELNEW(bytecode, Bytecode, HERE);
@@ -0,0 +1,54 @@
+#!/bin/bash
+# Runs the test programs with every backend and optimization flag and
+# compares the output with the interpreter. Run from the root of the repository:
+#   tests/run_backends.sh [path to tin]
+# The C and assembly backends are built with gcc, assembly is System V
+# x86-64 so it's only run on x86-64 linux.
+
+TIN=${1:-bin/tin.exe}
+PROGRAMS="tests/backends.tin tests/optimize.tin tests/file_natives.tin tests/dead_code.tin tests/test_a.tin"
+INTERPRETER_FLAGS=("-O0" "-ir" "-ir -O0" "-jit" "-unchecked")
+# backends.tin has a struct over 32 KB on the stack twice
+VM_FLAGS="-stack-size 256"
+
+tmp=$(mktemp -d)
+failed=0
+
+# the compiler and VM print these around the output of the program
+filter() {
+    grep -Ev "^(Start|Finished|VM: Started in '.*'|VM: Finished.*|You are using one thread.*)$"
+}
+check() {
+    if cmp -s "$tmp/expected.txt" "$tmp/out.txt"; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        diff "$tmp/expected.txt" "$tmp/out.txt" | head -10
+        failed=1
+    fi
+}
+
+for program in $PROGRAMS; do
+    "$TIN" "$program" -run -silent $VM_FLAGS | filter > "$tmp/expected.txt"
+    for flags in "${INTERPRETER_FLAGS[@]}"; do
+        "$TIN" "$program" -run -silent $VM_FLAGS $flags | filter > "$tmp/out.txt"
+        check "$program $flags"
+    done
+    if ! command -v gcc > /dev/null; then
+        continue
+    fi
+    rm -f "$tmp/out.c" "$tmp/out.txt"
+    "$TIN" "$program" -silent -emit-c "$tmp/out.c" > /dev/null
+    gcc -w -O2 -fwrapv "$tmp/out.c" runtime/tin_runtime.c -lm -o "$tmp/c_program" && "$tmp/c_program" > "$tmp/out.txt"
+    check "$program -emit-c"
+    if [ "$(uname -s)" = Linux ] && [ "$(uname -m)" = x86_64 ]; then
+        rm -f "$tmp/out.s" "$tmp/out.txt"
+        "$TIN" "$program" -silent -asm "$tmp/out.s" > /dev/null
+        gcc -w "$tmp/out.s" runtime/tin_runtime.c -lm -o "$tmp/asm_program" && "$tmp/asm_program" > "$tmp/out.txt"
+        check "$program -asm"
+    fi
+done
+
+rm -rf "$tmp"
+rm -f tests/file_natives.tmp
+exit $failed